@@ -20,6 +20,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
 
 #include <EGL/egl.h>
 #include <drm_fourcc.h>
@@ -423,15 +425,59 @@ EGLBoolean eplConfigListGetAttribute(EplPlatformData *platform, EGLDisplay edpy,
     return success;
 }
 
-const EplFormatInfo *eplFormatInfoLookup(uint32_t fourcc)
+/**
+ * The number of slots in the FORMAT_INFO_LIST hash table. This must be a
+ * power of two, and should be comfortably larger than FORMAT_INFO_COUNT.
+ */
+#define FORMAT_INFO_HASH_SIZE 128
+
+/**
+ * An open-addressed hash table mapping a fourcc code to an index in
+ * FORMAT_INFO_LIST, plus one. A value of zero means an empty slot.
+ *
+ * eplFormatInfoLookup gets called for every entry in a server's format table,
+ * so this avoids a linear search of FORMAT_INFO_LIST for each one.
+ */
+static uint8_t format_info_hash[FORMAT_INFO_HASH_SIZE];
+static pthread_once_t format_info_hash_once = PTHREAD_ONCE_INIT;
+
+static uint32_t FormatInfoHashSlot(uint32_t fourcc)
+{
+    // Fourcc codes are ASCII, so mix the bytes together before masking.
+    return (fourcc * 2654435761U) >> 25;
+}
+
+static void InitFormatInfoHash(void)
 {
     int i;
+
+    assert(FORMAT_INFO_COUNT < FORMAT_INFO_HASH_SIZE);
     for (i=0; i<FORMAT_INFO_COUNT; i++)
     {
-        if (FORMAT_INFO_LIST[i].fourcc == fourcc)
+        uint32_t slot = FormatInfoHashSlot(FORMAT_INFO_LIST[i].fourcc);
+        while (format_info_hash[slot] != 0)
+        {
+            slot = (slot + 1) & (FORMAT_INFO_HASH_SIZE - 1);
+        }
+        format_info_hash[slot] = (uint8_t) (i + 1);
+    }
+}
+
+const EplFormatInfo *eplFormatInfoLookup(uint32_t fourcc)
+{
+    uint32_t slot;
+
+    pthread_once(&format_info_hash_once, InitFormatInfoHash);
+
+    slot = FormatInfoHashSlot(fourcc);
+    while (format_info_hash[slot] != 0)
+    {
+        const EplFormatInfo *fmt = &FORMAT_INFO_LIST[format_info_hash[slot] - 1];
+        if (fmt->fourcc == fourcc)
         {
-            return &FORMAT_INFO_LIST[i];
+            return fmt;
         }
+        slot = (slot + 1) & (FORMAT_INFO_HASH_SIZE - 1);
     }
 
     return NULL;
@@ -0,0 +1,264 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * \file
+ *
+ * Prints the live counters that egl-wayland2 publishes for a running process.
+ *
+ * Usage: egl-wayland2-stats <pid>
+ *
+ * See wayland-stats.h for the layout of the shared memory segment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "wayland-stats.h"
+
+/**
+ * How many times to retry reading a slot that's being updated.
+ */
+#define MAX_READ_RETRIES 100
+
+/**
+ * Looks through /proc/<pid>/fd for the stats memfd, and opens it.
+ *
+ * Returns -1 if the process doesn't have one.
+ */
+static int OpenStatsFd(long pid)
+{
+    char path[PATH_MAX];
+    char target[PATH_MAX];
+    DIR *dir;
+    struct dirent *ent;
+    int fd = -1;
+
+    snprintf(path, sizeof(path), "/proc/%ld/fd", pid);
+    dir = opendir(path);
+    if (dir == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while ((ent = readdir(dir)) != NULL)
+    {
+        ssize_t len;
+
+        if (ent->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "/proc/%ld/fd/%s", pid, ent->d_name);
+        len = readlink(path, target, sizeof(target) - 1);
+        if (len <= 0)
+        {
+            continue;
+        }
+        target[len] = '\0';
+
+        if (strstr(target, "/memfd:" WL_STATS_MEMFD_NAME) == target)
+        {
+            fd = open(path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0)
+            {
+                break;
+            }
+        }
+    }
+
+    closedir(dir);
+    return fd;
+}
+
+/**
+ * Copies a slot, retrying until we get a consistent snapshot.
+ *
+ * Both slot types start with a seq field, so this works for either one.
+ */
+static int ReadSlot(const void *slot, void *out, size_t size)
+{
+    const uint32_t *seq = slot;
+    int i;
+
+    for (i=0; i<MAX_READ_RETRIES; i++)
+    {
+        uint32_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if ((before & 1) == 0)
+        {
+            memcpy(out, slot, size);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+            {
+                return 1;
+            }
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+static void PrintDisplay(const WlStatsDisplay *display)
+{
+    printf("display %llu: roundtrips %llu, buffers allocated %llu, surfaces created %llu\n",
+            (unsigned long long) display->id,
+            (unsigned long long) display->roundtrips,
+            (unsigned long long) display->buffers_allocated,
+            (unsigned long long) display->surfaces_created);
+}
+
+static void PrintSurface(const WlStatsSurface *surface)
+{
+    uint32_t i;
+
+    printf("  surface %llu (wl_surface@%llu):\n",
+            (unsigned long long) surface->id,
+            (unsigned long long) surface->wl_surface_id);
+    printf("    swaps %llu, blocked %.3f ms total",
+            (unsigned long long) surface->swaps,
+            surface->blocked_ns / 1000000.0);
+    if (surface->swaps > 0)
+    {
+        printf(", %.3f ms average", surface->blocked_ns / 1000000.0 / surface->swaps);
+    }
+    printf("\n");
+
+    printf("    blocked histogram:");
+    for (i=0; i<WL_STATS_BLOCKED_BUCKETS; i++)
+    {
+        if (i < WL_STATS_BLOCKED_BUCKETS - 1)
+        {
+            printf(" <%ums:%llu", 1U << i, (unsigned long long) surface->blocked_histogram[i]);
+        }
+        else
+        {
+            printf(" >=%ums:%llu", 1U << (i - 1), (unsigned long long) surface->blocked_histogram[i]);
+        }
+    }
+    printf("\n");
+
+    printf("    prime copies %llu, swapchain reallocs %llu, finish fallbacks %llu, discarded frames %llu\n",
+            (unsigned long long) surface->prime_copies,
+            (unsigned long long) surface->swapchain_reallocs,
+            (unsigned long long) surface->finish_fallbacks,
+            (unsigned long long) surface->discarded_frames);
+    printf("    repaint pixels saved %llu\n",
+            (unsigned long long) surface->repaint_pixels_saved);
+}
+
+int main(int argc, char **argv)
+{
+    const WlStatsHeader *header;
+    const uint8_t *base;
+    const uint8_t *displays;
+    const uint8_t *surfaces;
+    struct stat st;
+    size_t display_size, surface_size;
+    long pid;
+    uint32_t i, j;
+    int fd;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <pid>\n", argv[0]);
+        return 2;
+    }
+    pid = strtol(argv[1], NULL, 10);
+
+    fd = OpenStatsFd(pid);
+    if (fd < 0)
+    {
+        fprintf(stderr, "Process %ld has no egl-wayland2 stats\n", pid);
+        return 1;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(WlStatsHeader))
+    {
+        fprintf(stderr, "Stats segment is too small\n");
+        return 1;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    header = (const WlStatsHeader *) base;
+    if (header->magic != WL_STATS_MAGIC || header->version != WL_STATS_VERSION)
+    {
+        fprintf(stderr, "Unsupported stats version %u\n", header->version);
+        return 1;
+    }
+
+    // Only look at the fields that both sides know about.
+    display_size = header->display_size;
+    surface_size = header->surface_size;
+    if (display_size > sizeof(WlStatsDisplay))
+    {
+        display_size = sizeof(WlStatsDisplay);
+    }
+    if (surface_size > sizeof(WlStatsSurface))
+    {
+        surface_size = sizeof(WlStatsSurface);
+    }
+
+    displays = base + header->header_size;
+    surfaces = displays + ((size_t) header->display_size) * header->max_displays;
+    if ((off_t) (surfaces - base) + ((off_t) header->surface_size) * header->max_surfaces > st.st_size)
+    {
+        fprintf(stderr, "Stats segment is too small\n");
+        return 1;
+    }
+
+    for (i=0; i<header->max_displays; i++)
+    {
+        WlStatsDisplay display = {};
+
+        if (!ReadSlot(displays + ((size_t) header->display_size) * i, &display, display_size)
+                || !display.in_use)
+        {
+            continue;
+        }
+        PrintDisplay(&display);
+
+        for (j=0; j<header->max_surfaces; j++)
+        {
+            WlStatsSurface surface = {};
+
+            if (!ReadSlot(surfaces + ((size_t) header->surface_size) * j, &surface, surface_size)
+                    || !surface.in_use || surface.display_id != display.id)
+            {
+                continue;
+            }
+            PrintSurface(&surface);
+        }
+    }
+
+    return 0;
+}
@@ -30,6 +30,7 @@
 
 #include "platform-utils.h"
 #include "wayland-fbconfig.h"
+#include "wayland-egl-ext.h"
 
 // The minimum and maximum versions of each protocol that we support.
 static const uint32_t PROTO_DMABUF_VERSION[2] = { 3, 4 };
@@ -38,6 +39,24 @@ static const uint32_t PROTO_DRM_VERSION[2] = { 1, 1 };
 static const uint32_t PROTO_PRESENTATION_TIME_VERSION[2] = { 1, 2 };
 static const uint32_t PROTO_FIFO_VERSION[2] = { 1, 1 };
 static const uint32_t PROTO_COMMIT_TIMING_VERSION[2] = { 1, 1 };
+static const uint32_t PROTO_TEARING_CONTROL_VERSION[2] = { 1, 1 };
+static const uint32_t PROTO_VIEWPORTER_VERSION[2] = { 1, 1 };
+
+/**
+ * The default for WlDisplayInstance::frame_callback_timeout, in milliseconds.
+ * This can be overridden with __NV_FRAME_CALLBACK_TIMEOUT.
+ */
+static const int DEFAULT_FRAME_CALLBACK_TIMEOUT = 100;
+
+/**
+ * The default for WlDisplayInstance::prime_direct_max_pixels. This can be
+ * overridden with __NV_PRIME_DIRECT_MAX_PIXELS.
+ *
+ * This is zero, so PRIME always copies unless the user opts in. We don't
+ * have measurements yet to show where rendering into sysmem starts to cost
+ * less than the copy.
+ */
+static const uint64_t DEFAULT_PRIME_DIRECT_MAX_PIXELS = 0;
 
 typedef struct
 {
@@ -64,6 +83,8 @@ typedef struct
     WlDisplayGlobalName wp_presentation;
     WlDisplayGlobalName wp_fifo_manager_v1;
     WlDisplayGlobalName wp_commit_timing_manager_v1;
+    WlDisplayGlobalName wp_tearing_control_manager_v1;
+    WlDisplayGlobalName wp_viewporter;
     WlDisplayGlobalName wl_drm;
 } WlDisplayRegistry;
 
@@ -390,6 +411,8 @@ static void onRegistryGlobal(void *userdata, struct wl_registry *wl_registry,
     CHECK_INTERFACE(wp_presentation, PROTO_PRESENTATION_TIME_VERSION);
     CHECK_INTERFACE(wp_fifo_manager_v1, PROTO_FIFO_VERSION);
     CHECK_INTERFACE(wp_commit_timing_manager_v1, PROTO_COMMIT_TIMING_VERSION);
+    CHECK_INTERFACE(wp_tearing_control_manager_v1, PROTO_TEARING_CONTROL_VERSION);
+    CHECK_INTERFACE(wp_viewporter, PROTO_VIEWPORTER_VERSION);
 #undef CHECK_INTERFACE
 }
 static void OnRegistryGlobalRemove(void *data, struct wl_registry *wl_registry, uint32_t name)
@@ -773,28 +796,65 @@ static void on_wp_presentation_clock_id(void *userdata,
 }
 static struct wp_presentation_listener PRESENTATION_TIME_LISTENER = { on_wp_presentation_clock_id };
 
+/**
+ * Extensions that this library implements on top of whatever the driver
+ * reports.
+ */
+static const char *const PLATFORM_EXTENSIONS[] =
+{
+    "EGL_EXT_present_opaque",
+    "EGL_NVX_wayland_present_mode",
+    "EGL_NVX_wayland_dynamic_resolution",
+    "EGL_NVX_wayland_present_wait",
+    "EGL_NVX_wayland_ready_fd",
+    "EGL_NVX_wayland_target_frame_duration",
+    "EGL_NVX_wayland_memory",
+    "EGL_NVX_wayland_buffer_selection",
+    "EGL_NVX_wayland_present_batch",
+    "EGL_NVX_wayland_frame_capture",
+};
+
 static char *InitExtensionString(const char *internal_ext)
 {
-    static const char PRESENT_OPAQUE_NAME[] = "EGL_EXT_present_opaque";
     size_t len;
+    size_t i;
     char *str;
 
-    if (internal_ext == NULL || internal_ext[0] == '\x00')
+    if (internal_ext == NULL)
     {
-        return strdup(PRESENT_OPAQUE_NAME);
+        internal_ext = "";
     }
-    if (eplFindExtension(PRESENT_OPAQUE_NAME, internal_ext))
+
+    len = strlen(internal_ext);
+    for (i=0; i<sizeof(PLATFORM_EXTENSIONS) / sizeof(PLATFORM_EXTENSIONS[0]); i++)
     {
-        return strdup(internal_ext);
+        len += strlen(PLATFORM_EXTENSIONS[i]) + 1;
     }
 
-    len = strlen(internal_ext);
-    str = malloc(len + 1 + sizeof(PRESENT_OPAQUE_NAME));
-    if (str != NULL)
+    str = malloc(len + 1);
+    if (str == NULL)
+    {
+        return NULL;
+    }
+
+    strcpy(str, internal_ext);
+    len = strlen(str);
+    for (i=0; i<sizeof(PLATFORM_EXTENSIONS) / sizeof(PLATFORM_EXTENSIONS[0]); i++)
     {
-        memcpy(str, internal_ext, len);
-        str[len] = ' ';
-        memcpy(str + len + 1, PRESENT_OPAQUE_NAME, sizeof(PRESENT_OPAQUE_NAME));
+        size_t namelen;
+
+        if (eplFindExtension(PLATFORM_EXTENSIONS[i], internal_ext))
+        {
+            continue;
+        }
+
+        if (len > 0)
+        {
+            str[len++] = ' ';
+        }
+        namelen = strlen(PLATFORM_EXTENSIONS[i]);
+        memcpy(str + len, PLATFORM_EXTENSIONS[i], namelen + 1);
+        len += namelen;
     }
     return str;
 }
@@ -821,7 +881,14 @@ WlDisplayInstance *eplWlDisplayInstanceCreate(EplDisplay *pdpy, EGLBoolean from_
         return NULL;
     }
     eplRefCountInit(&inst->refcount);
+    if (pthread_mutex_init(&inst->alloc_mutex, NULL) != 0)
+    {
+        free(inst);
+        eplSetError(pdpy->platform, EGL_BAD_ALLOC, "Failed to create internal mutex");
+        return NULL;
+    }
     inst->platform = eplPlatformDataRef(pdpy->platform);
+    inst->stats = eplWlStatsAddDisplay();
 
     if (pdpy->native_display == NULL)
     {
@@ -919,7 +986,8 @@ WlDisplayInstance *eplWlDisplayInstanceCreate(EplDisplay *pdpy, EGLBoolean from_
             inst->default_feedback->num_formats, DRM_FORMAT_XRGB8888);
     if (fmt != NULL)
     {
-        supportsLinear = eplWlDmaBufFormatSupportsModifier(fmt, DRM_FORMAT_MOD_LINEAR);
+        supportsLinear = eplWlFormatListHasModifier(inst->default_feedback,
+                DRM_FORMAT_XRGB8888, DRM_FORMAT_MOD_LINEAR);
     }
 
     if (pdpy->priv->requested_device != EGL_NO_DEVICE_EXT)
@@ -1108,6 +1176,62 @@ WlDisplayInstance *eplWlDisplayInstanceCreate(EplDisplay *pdpy, EGLBoolean from_
         }
     }
 
+    if (names.wp_tearing_control_manager_v1.name != 0)
+    {
+        inst->globals.tearing_control = BindGlobalObject(names.registry,
+                names.wp_tearing_control_manager_v1.name,
+                &wp_tearing_control_manager_v1_interface,
+                names.wp_tearing_control_manager_v1.version, NULL);
+        if (inst->globals.tearing_control == NULL)
+        {
+            goto done;
+        }
+    }
+
+    if (names.wp_viewporter.name != 0)
+    {
+        inst->globals.viewporter = BindGlobalObject(names.registry,
+                names.wp_viewporter.name, &wp_viewporter_interface,
+                names.wp_viewporter.version, NULL);
+        if (inst->globals.viewporter == NULL)
+        {
+            goto done;
+        }
+    }
+
+    if (inst->globals.syncobj == NULL
+            && (!inst->supports_implicit_sync || !inst->supports_EGL_ANDROID_native_fence_sync))
+    {
+        // Without explicit or implicit sync, the server has no way to wait
+        // for rendering to finish, so we have to wait before we commit. Do
+        // that on a separate thread so that the app doesn't have to stall.
+        const char *env = getenv("__NV_DISABLE_ASYNC_COMMIT");
+        inst->use_async_commit = (env == NULL || atoi(env) == 0);
+    }
+
+    {
+        const char *env = getenv("__NV_PRIME_DIRECT_MAX_PIXELS");
+        inst->prime_direct_max_pixels = DEFAULT_PRIME_DIRECT_MAX_PIXELS;
+        if (env != NULL && atoll(env) >= 0)
+        {
+            inst->prime_direct_max_pixels = (uint64_t) atoll(env);
+        }
+    }
+
+    {
+        const char *env = getenv("__NV_DISABLE_ASYNC_SWAPCHAIN");
+        inst->use_async_swapchain = (env == NULL || atoi(env) == 0);
+    }
+
+    {
+        const char *env = getenv("__NV_FRAME_CALLBACK_TIMEOUT");
+        inst->frame_callback_timeout = DEFAULT_FRAME_CALLBACK_TIMEOUT;
+        if (env != NULL && atoi(env) > 0)
+        {
+            inst->frame_callback_timeout = atoi(env);
+        }
+    }
+
     inst->driver_formats = eplWlGetDriverFormats(pdpy->platform, inst->internal_display->edpy);
     if (inst->driver_formats == NULL)
     {
@@ -1161,6 +1285,14 @@ static void eplWlDisplayInstanceFree(WlDisplayInstance *inst)
          */
         if (eplWlDisplayInstanceIsNativeValid(inst))
         {
+            if (inst->globals.viewporter != NULL)
+            {
+                wp_viewporter_destroy(inst->globals.viewporter);
+            }
+            if (inst->globals.tearing_control != NULL)
+            {
+                wp_tearing_control_manager_v1_destroy(inst->globals.tearing_control);
+            }
             if (inst->globals.commit_timing != NULL)
             {
                 wp_commit_timing_manager_v1_destroy(inst->globals.commit_timing);
@@ -1202,16 +1334,53 @@ static void eplWlDisplayInstanceFree(WlDisplayInstance *inst)
         eplWlFormatListFree(inst->driver_formats);
         eplConfigListFree(inst->configs);
         free(inst->extension_string);
+        eplWlStatsRemoveDisplay(inst->stats);
 
         if (inst->platform != NULL)
         {
             eplPlatformDataUnref(inst->platform);
         }
 
+        pthread_mutex_destroy(&inst->alloc_mutex);
         free(inst);
     }
 }
 
+EplQueryResult eplWlQueryDisplayAttrib(EplDisplay *pdpy, EGLint attrib, EGLAttrib *ret_value)
+{
+    EplImplPlatform *priv = pdpy->platform->priv;
+    EplQueryResult result = EPL_QUERY_RESULT_SUCCESS;
+
+    // EGL_NVX_wayland_memory reports everything in kilobytes, to match the
+    // surface attributes, which wouldn't fit a byte count in an EGLint.
+    if (attrib == EGL_WAYLAND_DISPLAY_MEMORY_NVX)
+    {
+        *ret_value = (EGLAttrib) (__atomic_load_n(&pdpy->priv->inst->memory_usage, __ATOMIC_RELAXED) / 1024);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+
+    pthread_mutex_lock(&priv->memory.mutex);
+    if (attrib == EGL_WAYLAND_PRESENT_MEMORY_USAGE_NVX)
+    {
+        *ret_value = (EGLAttrib) (priv->memory.usage / 1024);
+    }
+    else if (attrib == EGL_WAYLAND_PRESENT_MEMORY_PEAK_NVX)
+    {
+        *ret_value = (EGLAttrib) (priv->memory.peak / 1024);
+    }
+    else if (attrib == EGL_WAYLAND_PRESENT_MEMORY_BUDGET_NVX)
+    {
+        *ret_value = (EGLAttrib) (priv->memory.budget / 1024);
+    }
+    else
+    {
+        result = EPL_QUERY_RESULT_UNKNOWN;
+    }
+    pthread_mutex_unlock(&priv->memory.mutex);
+
+    return result;
+}
+
 const char *eplWlHookQueryString(EGLDisplay edpy, EGLint name)
 {
     EplDisplay *pdpy = eplDisplayAcquire(edpy);
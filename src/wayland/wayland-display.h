@@ -21,6 +21,7 @@
 #include "wayland-platform.h"
 #include "wayland-dmabuf.h"
 #include "refcountobj.h"
+#include "wayland-stats.h"
 
 #include <gbm.h>
 
@@ -28,6 +29,8 @@
 #include "presentation-time-client-protocol.h"
 #include "commit-timing-v1-client-protocol.h"
 #include "fifo-v1-client-protocol.h"
+#include "tearing-control-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 /**
  * Contains data for an initialized EGLDisplay.
@@ -71,6 +74,8 @@ typedef struct
         struct wp_presentation *presentation_time;
         struct wp_fifo_manager_v1 *fifo;
         struct wp_commit_timing_manager_v1 *commit_timing;
+        struct wp_tearing_control_manager_v1 *tearing_control;
+        struct wp_viewporter *viewporter;
     } globals;
 
     /**
@@ -90,6 +95,17 @@ typedef struct
      */
     struct gbm_device *gbmdev;
 
+    /**
+     * Serializes allocating and freeing color buffers.
+     *
+     * Each surface can build a new swapchain on its own thread, but neither
+     * libgbm nor the driver's eglPlatform*ColorBufferNVX functions promise
+     * that it's safe to allocate from the same device on several threads at
+     * once. This only covers the allocation calls themselves, not the rest
+     * of building a swapchain.
+     */
+    pthread_mutex_t alloc_mutex;
+
     /**
      * The device ID for the render device.
      *
@@ -114,15 +130,57 @@ typedef struct
      */
     EGLBoolean supports_implicit_sync;
 
+    /**
+     * True if we should defer each commit to a helper thread that waits for
+     * rendering to finish.
+     *
+     * This is used when we don't have either explicit or implicit sync, so
+     * the only other option would be a glFinish in every eglSwapBuffers.
+     */
+    EGLBoolean use_async_commit;
+
+    /**
+     * True if we should allocate new swapchains on a worker thread, so that
+     * eglSwapBuffers can present with the old swapchain in the meantime.
+     */
+    EGLBoolean use_async_swapchain;
+
+    /**
+     * How long to wait for a wl_surface::frame callback, in milliseconds,
+     * before we fall back to a timer. This only matters if we don't have
+     * wp_fifo_v1.
+     */
+    int frame_callback_timeout;
+
     /**
      * True if we always to use PRIME.
      */
     EGLBoolean force_prime;
 
+    /**
+     * The largest window, in pixels, for which PRIME renders directly into
+     * the linear present buffers instead of copying to them. Zero means
+     * always copy.
+     */
+    uint64_t prime_direct_max_pixels;
+
     /**
      * The EGL_EXTENSIONS string for this display.
      */
     char *extension_string;
+
+    /**
+     * The number of bytes allocated for color buffers on this display, for
+     * EGL_WAYLAND_DISPLAY_MEMORY_NVX. This is updated with atomic operations,
+     * since swapchains for different surfaces can be created or freed from
+     * different threads.
+     */
+    uint64_t memory_usage;
+
+    /**
+     * The shared memory counters for this display. This may be NULL.
+     */
+    WlStatsDisplay *stats;
 } WlDisplayInstance;
 
 EPL_REFCOUNT_DECLARE_TYPE_FUNCS(WlDisplayInstance, eplWlDisplayInstance);
@@ -177,6 +235,7 @@ EGLBoolean eplWlGetPlatformDisplay(EplPlatformData *plat, EplDisplay *pdpy,
 void eplWlCleanupDisplay(EplDisplay *pdpy);
 EGLBoolean eplWlInitializeDisplay(EplPlatformData *plat, EplDisplay *pdpy, EGLint *major, EGLint *minor);
 void eplWlTerminateDisplay(EplPlatformData *plat, EplDisplay *pdpy);
+EplQueryResult eplWlQueryDisplayAttrib(EplDisplay *pdpy, EGLint attrib, EGLAttrib *ret_value);
 
 const char *eplWlHookQueryString(EGLDisplay edpy, EGLint name);
 
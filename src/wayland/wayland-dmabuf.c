@@ -144,24 +144,26 @@ void eplWlDmaBufFeedbackCommonTrancheFlags(void *userdata,
 static WlFormatList *FinishDefaultFeedback(DefaultFeedbackState *state, dev_t *ret_main_device)
 {
     WlFormatList *data = NULL;
-    struct wl_array fourccs;
-    struct wl_array modifiers;
+    struct wl_array entries;
     DefaultFeedbackTranche *tranche;
+    WlDmaBufFeedbackTableEntry *pairs;
+    size_t num_pairs = 0;
     size_t num_formats = 0;
     size_t num_modifiers = 0;
     uint64_t *mods_dst;
-    uint32_t *fourcc;
+    size_t i;
 
-    wl_array_init(&fourccs);
-    wl_array_init(&modifiers);
+    wl_array_init(&entries);
 
     if (state->base.error)
     {
         goto done;
     }
 
-    // Build a list of fourcc codes, and a list of (fourcc, modifier) pairs
-    // from all of the tranches that we care about, without any duplicates.
+    // Collect the (fourcc, modifier) pairs from all of the tranches that we
+    // care about into a single array. We'll sort that array and drop any
+    // duplicates afterward, rather than checking for duplicates as we go,
+    // since the format table could have thousands of entries.
     glvnd_list_for_each_entry(tranche, &state->tranches, entry)
     {
         const WlDmaBufFeedbackTableEntry *src;
@@ -175,8 +177,7 @@ static WlFormatList *FinishDefaultFeedback(DefaultFeedbackState *state, dev_t *r
 
         wl_array_for_each(src, &tranche->formats)
         {
-            EGLBoolean found = EGL_FALSE;
-            WlDmaBufFeedbackTableEntry *mod;
+            WlDmaBufFeedbackTableEntry *dst;
 
             if (eplFormatInfoLookup(src->fourcc) == NULL)
             {
@@ -185,54 +186,43 @@ static WlFormatList *FinishDefaultFeedback(DefaultFeedbackState *state, dev_t *r
                 continue;
             }
 
-            wl_array_for_each(fourcc, &fourccs)
-            {
-                if (*fourcc == src->fourcc)
-                {
-                    found = EGL_TRUE;
-                    break;
-                }
-            }
-            if (!found)
-            {
-                fourcc = wl_array_add(&fourccs, sizeof(uint32_t));
-                if (fourcc == NULL)
-                {
-                    goto done;
-                }
-                *fourcc = src->fourcc;
-            }
-
-            found = EGL_FALSE;
-            wl_array_for_each(mod, &modifiers)
+            dst = wl_array_add(&entries, sizeof(WlDmaBufFeedbackTableEntry));
+            if (dst == NULL)
             {
-                if (mod->fourcc == src->fourcc && mod->modifier == src->modifier)
-                {
-                    found = EGL_TRUE;
-                    break;
-                }
-            }
-            if (!found)
-            {
-                mod = wl_array_add(&modifiers, sizeof(WlDmaBufFeedbackTableEntry));
-                if (mod == NULL)
-                {
-                    goto done;
-                }
-                *mod = *src;
+                goto done;
             }
+            dst->fourcc = src->fourcc;
+            dst->pad = 0;
+            dst->modifier = src->modifier;
         }
     }
 
-    num_formats = fourccs.size / sizeof(uint32_t);
-    num_modifiers = modifiers.size / sizeof(WlDmaBufFeedbackTableEntry);
-
-    if (num_formats == 0 || num_modifiers == 0)
+    pairs = entries.data;
+    num_pairs = entries.size / sizeof(WlDmaBufFeedbackTableEntry);
+    if (num_pairs == 0)
     {
         goto done;
     }
 
-    qsort(fourccs.data, num_formats, sizeof(uint32_t), eplWlCompareU32);
+    qsort(pairs, num_pairs, sizeof(WlDmaBufFeedbackTableEntry), eplWlCompareFeedbackTableEntry);
+
+    // Remove duplicates and count the distinct fourcc codes. Since the array
+    // is sorted, any duplicates will be adjacent.
+    num_modifiers = 1;
+    num_formats = 1;
+    for (i=1; i<num_pairs; i++)
+    {
+        if (pairs[i].fourcc == pairs[num_modifiers - 1].fourcc
+                && pairs[i].modifier == pairs[num_modifiers - 1].modifier)
+        {
+            continue;
+        }
+        if (pairs[i].fourcc != pairs[num_modifiers - 1].fourcc)
+        {
+            num_formats++;
+        }
+        pairs[num_modifiers++] = pairs[i];
+    }
 
     // Allocate enough space for the WlFormatList itself, plus all
     // of the format structs, plus all of the modifier lists.
@@ -247,27 +237,39 @@ static WlFormatList *FinishDefaultFeedback(DefaultFeedbackState *state, dev_t *r
     mods_dst = (uint64_t *) (data->formats + num_formats);
 
     data->num_formats = 0;
+    data->modifier_hash = NULL;
+    data->modifier_hash_mask = 0;
 
-    wl_array_for_each(fourcc, &fourccs)
+    // The pairs are sorted by fourcc and then by modifier, so each format's
+    // modifier list is a contiguous, sorted run.
+    for (i=0; i<num_modifiers; i++)
     {
-        WlDmaBufFormat *fmt = &data->formats[data->num_formats++];
-        const WlDmaBufFeedbackTableEntry *mod;
-        fmt->fourcc = *fourcc;
+        WlDmaBufFormat *fmt;
 
-        fmt->fmt = eplFormatInfoLookup(*fourcc);
-        assert(fmt->fmt != NULL);
-
-        fmt->modifiers = mods_dst;
-        fmt->num_modifiers = 0;
-
-        wl_array_for_each(mod, &modifiers)
+        if (i == 0 || pairs[i].fourcc != pairs[i - 1].fourcc)
         {
-            if (mod->fourcc == *fourcc)
-            {
-                fmt->modifiers[fmt->num_modifiers++] = mod->modifier;
-            }
+            fmt = &data->formats[data->num_formats++];
+            fmt->fourcc = pairs[i].fourcc;
+            fmt->fmt = eplFormatInfoLookup(pairs[i].fourcc);
+            assert(fmt->fmt != NULL);
+            fmt->modifiers = mods_dst;
+            fmt->num_modifiers = 0;
+        }
+        else
+        {
+            fmt = &data->formats[data->num_formats - 1];
         }
-        mods_dst += fmt->num_modifiers;
+
+        fmt->modifiers[fmt->num_modifiers++] = pairs[i].modifier;
+        mods_dst++;
+    }
+    assert(data->num_formats == num_formats);
+
+    if (!eplWlFormatListBuildModifierHash(data))
+    {
+        eplWlFormatListFree(data);
+        data = NULL;
+        goto done;
     }
 
     if (ret_main_device != NULL)
@@ -276,8 +278,7 @@ static WlFormatList *FinishDefaultFeedback(DefaultFeedbackState *state, dev_t *r
     }
 
 done:
-    wl_array_release(&fourccs);
-    wl_array_release(&modifiers);
+    wl_array_release(&entries);
     return data;
 }
 
@@ -530,6 +531,36 @@ WlFormatList *eplWlDmaBufFeedbackGetDefault(struct wl_display *wdpy,
     return result;
 }
 
+int eplWlCompareU64(const void *p1, const void *p2)
+{
+    uint64_t v1 = *((const uint64_t *) p1);
+    uint64_t v2 = *((const uint64_t *) p2);
+    if (v1 < v2)
+    {
+        return -1;
+    }
+    else if (v1 > v2)
+    {
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+}
+
+int eplWlCompareFeedbackTableEntry(const void *p1, const void *p2)
+{
+    const WlDmaBufFeedbackTableEntry *e1 = p1;
+    const WlDmaBufFeedbackTableEntry *e2 = p2;
+
+    if (e1->fourcc != e2->fourcc)
+    {
+        return (e1->fourcc < e2->fourcc ? -1 : 1);
+    }
+    return eplWlCompareU64(&e1->modifier, &e2->modifier);
+}
+
 int eplWlCompareU32(const void *p1, const void *p2)
 {
     uint32_t v1 = *((const uint32_t *) p1);
@@ -550,24 +581,94 @@ int eplWlCompareU32(const void *p1, const void *p2)
 
 void eplWlFormatListFree(WlFormatList *data)
 {
-    // We allocate everything in one block, so just free it.
+    // We allocate everything except the hash table in one block.
+    if (data != NULL)
+    {
+        free(data->modifier_hash);
+    }
     free(data);
 }
 
-const WlDmaBufFormat *eplWlDmaBufFormatFind(const WlDmaBufFormat *formats, size_t count, uint32_t fourcc)
+static size_t FormatModifierHashSlot(uint32_t fourcc, uint64_t modifier)
 {
-    return bsearch(&fourcc, formats, count, sizeof(WlDmaBufFormat), eplWlCompareU32);
+    // The vendor code is in the top byte of a modifier and fourcc codes are
+    // ASCII, so mix everything together before masking.
+    uint64_t h = (modifier ^ (modifier >> 32) ^ (((uint64_t) fourcc) << 16))
+        * 0x9E3779B97F4A7C15ULL;
+    return (size_t) (h >> 32);
 }
 
-EGLBoolean eplWlDmaBufFormatSupportsModifier(const WlDmaBufFormat *format, uint64_t modifier)
+EGLBoolean eplWlFormatListBuildModifierHash(WlFormatList *list)
 {
-    size_t i;
-    for (i=0; i<format->num_modifiers; i++)
+    size_t total = 0;
+    size_t size = 16;
+    size_t i, j;
+
+    for (i=0; i<list->num_formats; i++)
+    {
+        total += list->formats[i].num_modifiers;
+    }
+    while (size < total * 2)
+    {
+        size *= 2;
+    }
+
+    list->modifier_hash = calloc(size, sizeof(WlFormatModifierHashEntry));
+    if (list->modifier_hash == NULL)
+    {
+        list->modifier_hash_mask = 0;
+        return EGL_FALSE;
+    }
+    list->modifier_hash_mask = size - 1;
+
+    for (i=0; i<list->num_formats; i++)
+    {
+        const WlDmaBufFormat *fmt = &list->formats[i];
+
+        // A fourcc of zero marks an empty slot, but that's never a valid
+        // format code.
+        assert(fmt->fourcc != 0);
+        for (j=0; j<fmt->num_modifiers; j++)
+        {
+            size_t slot = FormatModifierHashSlot(fmt->fourcc, fmt->modifiers[j]) & list->modifier_hash_mask;
+
+            while (list->modifier_hash[slot].fourcc != 0)
+            {
+                slot = (slot + 1) & list->modifier_hash_mask;
+            }
+            list->modifier_hash[slot].fourcc = fmt->fourcc;
+            list->modifier_hash[slot].index = (uint32_t) j;
+            list->modifier_hash[slot].modifier = fmt->modifiers[j];
+        }
+    }
+
+    return EGL_TRUE;
+}
+
+int32_t eplWlFormatListFindModifier(const WlFormatList *list, uint32_t fourcc, uint64_t modifier)
+{
+    size_t slot;
+
+    if (list->modifier_hash == NULL || fourcc == 0)
+    {
+        return -1;
+    }
+
+    slot = FormatModifierHashSlot(fourcc, modifier) & list->modifier_hash_mask;
+    while (list->modifier_hash[slot].fourcc != 0)
     {
-        if (format->modifiers[i] == modifier)
+        const WlFormatModifierHashEntry *entry = &list->modifier_hash[slot];
+        if (entry->fourcc == fourcc && entry->modifier == modifier)
         {
-            return EGL_TRUE;
+            return (int32_t) entry->index;
         }
+        slot = (slot + 1) & list->modifier_hash_mask;
     }
-    return EGL_FALSE;
+    return -1;
 }
+
+const WlDmaBufFormat *eplWlDmaBufFormatFind(const WlDmaBufFormat *formats, size_t count, uint32_t fourcc)
+{
+    return bsearch(&fourcc, formats, count, sizeof(WlDmaBufFormat), eplWlCompareU32);
+}
+
@@ -45,10 +45,26 @@ typedef struct _WlDmaBufFormat
     // with just the fourcc code for a key.
     uint32_t fourcc;
     const EplFormatInfo *fmt;
+
+    /// The supported modifiers, sorted in ascending order.
     uint64_t *modifiers;
     size_t num_modifiers;
 } WlDmaBufFormat;
 
+/**
+ * An entry in WlFormatList's hash table of (fourcc, modifier) pairs.
+ */
+typedef struct
+{
+    /// The fourcc code, or zero if this slot is empty.
+    uint32_t fourcc;
+
+    /// The index of \c modifier in its WlDmaBufFormat's modifier list.
+    uint32_t index;
+
+    uint64_t modifier;
+} WlFormatModifierHashEntry;
+
 /**
  * Contains a list of formats, with the supported modifiers for each.
  */
@@ -57,6 +73,16 @@ typedef struct _WlFormatList
     /// An array of supported formats, sorted by fourcc code.
     WlDmaBufFormat *formats;
     size_t num_formats;
+
+    /**
+     * An open-addressed hash table of every (fourcc, modifier) pair in
+     * \c formats, for eplWlFormatListFindModifier.
+     *
+     * The size is a power of two, and is at least twice the number of pairs,
+     * so that probe sequences stay short.
+     */
+    WlFormatModifierHashEntry *modifier_hash;
+    size_t modifier_hash_mask;
 } WlFormatList;
 
 /**
@@ -158,10 +184,34 @@ WlFormatList *eplWlDmaBufFeedbackGetDefault(struct wl_display *wdpy,
 
 void eplWlFormatListFree(WlFormatList *data);
 
+/**
+ * Builds the (fourcc, modifier) hash table for a format list.
+ *
+ * This must be called once all of the formats and modifiers are filled in.
+ *
+ * \return EGL_TRUE on success, or EGL_FALSE if we ran out of memory.
+ */
+EGLBoolean eplWlFormatListBuildModifierHash(WlFormatList *list);
+
+/**
+ * Looks up a (fourcc, modifier) pair in a format list.
+ *
+ * \return The index of \p modifier in the format's modifier list, or -1 if
+ *      the list doesn't include the pair.
+ */
+int32_t eplWlFormatListFindModifier(const WlFormatList *list, uint32_t fourcc, uint64_t modifier);
+
 const WlDmaBufFormat *eplWlDmaBufFormatFind(const WlDmaBufFormat *formats,
         size_t count, uint32_t fourcc);
 
-EGLBoolean eplWlDmaBufFormatSupportsModifier(const WlDmaBufFormat *format, uint64_t modifier);
+/**
+ * Returns true if \p list includes \p modifier for the format \p fourcc.
+ */
+static inline EGLBoolean eplWlFormatListHasModifier(const WlFormatList *list,
+        uint32_t fourcc, uint64_t modifier)
+{
+    return (eplWlFormatListFindModifier(list, fourcc, modifier) >= 0);
+}
 
 /**
  * A comparison function for \c bsearch or \c qsort which sorts based on a
@@ -171,4 +221,16 @@ EGLBoolean eplWlDmaBufFormatSupportsModifier(const WlDmaBufFormat *format, uint6
  */
 int eplWlCompareU32(const void *p1, const void *p2);
 
+/**
+ * A comparison function for \c bsearch or \c qsort which sorts based on a
+ * uint64_t.
+ */
+int eplWlCompareU64(const void *p1, const void *p2);
+
+/**
+ * A comparison function for \c WlDmaBufFeedbackTableEntry structs, which
+ * sorts by fourcc code and then by modifier.
+ */
+int eplWlCompareFeedbackTableEntry(const void *p1, const void *p2);
+
 #endif // WAYLAND_DMABUF_H
@@ -0,0 +1,350 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYLAND_EGL_EXT_H
+#define WAYLAND_EGL_EXT_H
+
+/**
+ * \file
+ *
+ * Application-visible tokens and functions for the Wayland-specific
+ * extensions that this library implements.
+ *
+ * These are provisional extensions, so the names are all NVX-suffixed, and the
+ * enum values come from a block that's private to this library.
+ */
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * EGL_NVX_wayland_present_mode
+ *
+ * Adds a surface creation attribute to select how eglSwapBuffers queues
+ * frames.
+ *
+ * With EGL_WAYLAND_PRESENT_MODE_FIFO_NVX (the default), eglSwapBuffers
+ * follows the swap interval, and may block waiting for the compositor.
+ *
+ * With EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX, each new frame replaces any
+ * frame that the compositor hasn't latched yet, and eglSwapBuffers never
+ * waits for the compositor. Presentation is still tear-free. The swap interval
+ * is ignored in this mode.
+ *
+ * EGL_WAYLAND_DROPPED_FRAMES_NVX can be passed to eglQuerySurface to find out
+ * how many frames the compositor discarded without displaying. That count
+ * is only updated if the compositor supports presentation-time.
+ */
+#ifndef EGL_NVX_wayland_present_mode
+#define EGL_NVX_wayland_present_mode 1
+#define EGL_WAYLAND_PRESENT_MODE_NVX            0x3480
+#define EGL_WAYLAND_PRESENT_MODE_FIFO_NVX       0x3481
+#define EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX    0x3482
+#define EGL_WAYLAND_DROPPED_FRAMES_NVX          0x3483
+#endif
+
+/**
+ * EGL_NVX_wayland_dynamic_resolution
+ *
+ * Adds a boolean surface creation attribute that lets the library render at a
+ * lower resolution than the window, and have the compositor scale it up with
+ * wp_viewporter.
+ *
+ * The library picks the resolution based on how long recent frames took
+ * compared to the display's refresh rate. EGL_WIDTH and EGL_HEIGHT report the
+ * current render size, which may be smaller than the wl_egl_window.
+ *
+ * EGL_WAYLAND_RENDER_SCALE_NVX can be passed to eglQuerySurface to get the
+ * current scale as a percentage of the window size.
+ *
+ * If the compositor doesn't support wp_viewporter, then the attribute is
+ * ignored and the surface always renders at full resolution.
+ */
+#ifndef EGL_NVX_wayland_dynamic_resolution
+#define EGL_NVX_wayland_dynamic_resolution 1
+#define EGL_WAYLAND_DYNAMIC_RESOLUTION_NVX      0x3484
+#define EGL_WAYLAND_RENDER_SCALE_NVX            0x3485
+#endif
+
+/**
+ * EGL_NVX_wayland_present_wait
+ *
+ * Assigns each eglSwapBuffers call on a window surface a present ID, and lets
+ * the application wait until that frame has actually reached the screen.
+ *
+ * Present IDs start at 1 and increase by one with each eglSwapBuffers call.
+ * eglGetPresentIdNVX returns the ID of the most recent eglSwapBuffers call, or
+ * zero if there hasn't been one yet. A frame in a present batch (see
+ * EGL_NVX_wayland_present_batch) only gets its ID once it's committed, so a
+ * batched frame that's dropped because of an error never gets one.
+ *
+ * eglWaitForPresentNVX waits until the frame with the given ID (and every
+ * frame before it) has either been displayed or discarded by the compositor.
+ * If too many frames are in flight at once, then the library stops tracking
+ * the oldest one and counts it as discarded, including in
+ * EGL_WAYLAND_DROPPED_FRAMES_NVX.
+ * It returns EGL_CONDITION_SATISFIED_KHR, EGL_TIMEOUT_EXPIRED_KHR, or EGL_FALSE
+ * on error, the same as eglClientWaitSyncKHR. A timeout of zero just checks
+ * the current status, and EGL_FOREVER_KHR waits indefinitely.
+ *
+ * Both functions require the surface to be the current draw surface for the
+ * calling thread.
+ *
+ * If the compositor doesn't support presentation-time, then a frame counts as
+ * presented once the compositor has processed its commit.
+ */
+#ifndef EGL_NVX_wayland_present_wait
+#define EGL_NVX_wayland_present_wait 1
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLGETPRESENTIDNVXPROC) (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR *presentId);
+typedef EGLint (EGLAPIENTRYP PFNEGLWAITFORPRESENTNVXPROC) (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR presentId, EGLTimeKHR timeout);
+#ifdef EGL_EGLEXT_PROTOTYPES
+EGLAPI EGLBoolean EGLAPIENTRY eglGetPresentIdNVX (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR *presentId);
+EGLAPI EGLint EGLAPIENTRY eglWaitForPresentNVX (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR presentId, EGLTimeKHR timeout);
+#endif
+#endif
+
+/**
+ * EGL_NVX_wayland_ready_fd
+ *
+ * Adds a read-only surface attribute, EGL_WAYLAND_READY_FD_NVX, which returns
+ * a file descriptor that becomes readable once the next eglSwapBuffers call
+ * on the surface can go through without waiting for a free buffer or for an
+ * earlier frame to be displayed.
+ *
+ * This lets an application drive rendering from its own poll or epoll loop
+ * instead of blocking in eglSwapBuffers.
+ *
+ * The file descriptor is owned by the surface, and stays valid until the
+ * surface is destroyed. The application must not read from or close it.
+ * It stops being readable during the next eglSwapBuffers call.
+ */
+#ifndef EGL_NVX_wayland_ready_fd
+#define EGL_NVX_wayland_ready_fd 1
+#define EGL_WAYLAND_READY_FD_NVX                0x3486
+#endif
+
+/**
+ * EGL_NVX_wayland_target_frame_duration
+ *
+ * Lets the application cap the frame rate of a window surface at an arbitrary
+ * rate, rather than only an integer fraction of the refresh rate.
+ *
+ * EGL_WAYLAND_TARGET_FRAME_DURATION_NVX is a surface creation attribute and
+ * eglQuerySurface attribute, giving the target time between frames in
+ * nanoseconds. eglSetTargetFrameDurationNVX changes it afterward, and can be
+ * called from any thread. Zero (the default) means to just follow the swap
+ * interval.
+ *
+ * The target only applies with a nonzero swap interval, and it replaces the
+ * swap interval's pacing. On a variable refresh rate display, frames are
+ * scheduled at exactly the requested rate. On a fixed refresh rate display,
+ * each frame is rounded to the nearest vblank, but the average rate still
+ * matches the target.
+ */
+#ifndef EGL_NVX_wayland_target_frame_duration
+#define EGL_NVX_wayland_target_frame_duration 1
+#define EGL_WAYLAND_TARGET_FRAME_DURATION_NVX   0x3487
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSETTARGETFRAMEDURATIONNVXPROC) (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR duration);
+#ifdef EGL_EGLEXT_PROTOTYPES
+EGLAPI EGLBoolean EGLAPIENTRY eglSetTargetFrameDurationNVX (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR duration);
+#endif
+#endif
+
+/**
+ * EGL_NVX_wayland_memory
+ *
+ * Reports how much memory the library allocates for color buffers, and how
+ * much it has given back. Sizes are based on each buffer's stride and height.
+ * Every value is in kilobytes (units of 1024 bytes). The surface attributes
+ * saturate at the largest EGLint.
+ *
+ * Read-only surface attributes for eglQuerySurface on a window surface:
+ *
+ * - EGL_WAYLAND_SURFACE_MEMORY_NVX is the memory for the window's current
+ *   buffers, including any that the library is keeping around for dynamic
+ *   resolution.
+ * - EGL_WAYLAND_RECLAIMED_MEMORY_NVX is the total that the library has freed
+ *   from the window while it was idle. A window counts as idle if the
+ *   application swaps only occasionally, or if the compositor is discarding
+ *   its frames because it isn't visible. The library frees any extra buffers
+ *   for an idle window, and allocates new ones if the window gets busy again.
+ *
+ * Read-only display attributes for eglQueryDisplayAttribKHR/EXT:
+ *
+ * - EGL_WAYLAND_DISPLAY_MEMORY_NVX is the total for every surface on the
+ *   EGLDisplay.
+ * - EGL_WAYLAND_PRESENT_MEMORY_USAGE_NVX is the total for every display and
+ *   surface in the process.
+ * - EGL_WAYLAND_PRESENT_MEMORY_PEAK_NVX is the highest that the process-wide
+ *   total has reached.
+ * - EGL_WAYLAND_PRESENT_MEMORY_BUDGET_NVX is the budget set with the
+ *   __NV_PRESENT_MEMORY_BUDGET environment variable, or zero if there isn't
+ *   one. Once the process-wide total reaches the budget, surfaces stop
+ *   allocating extra buffers and wait for a free one instead, and idle
+ *   surfaces free their extra buffers sooner.
+ */
+#ifndef EGL_NVX_wayland_memory
+#define EGL_NVX_wayland_memory 1
+#define EGL_WAYLAND_RECLAIMED_MEMORY_NVX        0x3488
+#define EGL_WAYLAND_PRESENT_MEMORY_USAGE_NVX    0x3489
+#define EGL_WAYLAND_PRESENT_MEMORY_PEAK_NVX     0x348A
+#define EGL_WAYLAND_PRESENT_MEMORY_BUDGET_NVX   0x348B
+#define EGL_WAYLAND_SURFACE_MEMORY_NVX          0x348C
+#define EGL_WAYLAND_DISPLAY_MEMORY_NVX          0x348D
+#endif
+
+/**
+ * EGL_NVX_wayland_buffer_selection
+ *
+ * Adds a window surface creation attribute, EGL_WAYLAND_BUFFER_SELECTION_NVX,
+ * which controls how the library picks the next back buffer when more than
+ * one buffer is free. It can also be passed to eglQuerySurface.
+ *
+ * With EGL_WAYLAND_BUFFER_SELECTION_FIRST_NVX (the default), it picks the
+ * first free buffer.
+ *
+ * With EGL_WAYLAND_BUFFER_SELECTION_MIN_REPAINT_NVX, it picks the free buffer
+ * that should need the least repainting, based on its EGL_BUFFER_AGE_KHR and
+ * the damage passed to eglSwapBuffersWithDamageKHR/EXT for the frames since.
+ * Frames without damage rectangles count as changing the whole window. This
+ * only helps an application that uses EGL_BUFFER_AGE_KHR for partial
+ * updates. If neither explicit nor implicit sync is available, then this
+ * behaves the same as EGL_WAYLAND_BUFFER_SELECTION_FIRST_NVX.
+ */
+#ifndef EGL_NVX_wayland_buffer_selection
+#define EGL_NVX_wayland_buffer_selection 1
+#define EGL_WAYLAND_BUFFER_SELECTION_NVX                0x348E
+#define EGL_WAYLAND_BUFFER_SELECTION_FIRST_NVX          0x348F
+#define EGL_WAYLAND_BUFFER_SELECTION_MIN_REPAINT_NVX    0x3490
+#endif
+
+/**
+ * EGL_NVX_wayland_present_batch
+ *
+ * Lets an application that draws to several windows present them together.
+ *
+ * eglBeginPresentBatchNVX starts a batch on the calling thread. Until
+ * eglEndPresentBatchNVX, eglSwapBuffers on a window surface of that display
+ * finishes the frame, but doesn't wait for the window's earlier frames or
+ * send the frame to the compositor. eglEndPresentBatchNVX then waits for
+ * every window in the batch, commits all of the frames, and flushes the
+ * Wayland connection once.
+ *
+ * Each window in a batch must not be made current on another thread until
+ * eglEndPresentBatchNVX returns. If the application swaps the same window
+ * twice in a batch, or calls eglWaitForPresentNVX or eglWaitClient on it,
+ * then its pending frame is committed right away. If it destroys the window
+ * instead, then the pending frame is discarded.
+ *
+ * Only one batch can be in progress on a thread at a time. Otherwise,
+ * eglBeginPresentBatchNVX fails with EGL_BAD_ACCESS. eglEndPresentBatchNVX
+ * fails with EGL_BAD_ACCESS if the thread has no batch for the display.
+ */
+#ifndef EGL_NVX_wayland_present_batch
+#define EGL_NVX_wayland_present_batch 1
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLBEGINPRESENTBATCHNVXPROC) (EGLDisplay dpy);
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLENDPRESENTBATCHNVXPROC) (EGLDisplay dpy);
+#ifdef EGL_EGLEXT_PROTOTYPES
+EGLAPI EGLBoolean EGLAPIENTRY eglBeginPresentBatchNVX (EGLDisplay dpy);
+EGLAPI EGLBoolean EGLAPIENTRY eglEndPresentBatchNVX (EGLDisplay dpy);
+#endif
+#endif
+
+/**
+ * EGL_NVX_wayland_frame_capture
+ *
+ * Lets an application hand each frame that it presents on a window surface to
+ * another consumer, such as a hardware video encoder, without copying it.
+ *
+ * eglSetCaptureCallbackNVX sets a callback for a window surface, or removes
+ * it if \p callback is NULL. After each eglSwapBuffers, the library calls the
+ * callback on the same thread with an EGLWaylandCaptureFrameNVX describing
+ * the buffer that it just presented. A frame in a present batch (see
+ * EGL_NVX_wayland_present_batch) is captured when it's committed instead,
+ * and a batched frame that's dropped is never captured.
+ *
+ * The exception is if the library commits frames from an internal thread,
+ * which it normally does when the compositor supports neither explicit nor
+ * implicit sync. That thread waits for rendering to finish before it commits
+ * each frame, and then it calls the callback, with acquireFenceFd set to -1.
+ *
+ * Once eglSetCaptureCallbackNVX returns, the library won't call the previous
+ * callback again or use its userData, so the application can free it. If the
+ * previous callback is running on the internal thread, then
+ * eglSetCaptureCallbackNVX waits for it to return first.
+ *
+ * The fields of EGLWaylandCaptureFrameNVX are:
+ *
+ * - dmabufFd is a new file descriptor for the buffer's dma-buf. The consumer
+ *   owns it and must close it.
+ * - acquireFenceFd is a sync_file that signals once rendering has finished,
+ *   or -1 if it's already finished. The consumer owns it and must close it.
+ * - presentId is the frame's present ID from EGL_NVX_wayland_present_wait.
+ * - rects and numRects are the damage passed to eglSwapBuffersWithDamageKHR,
+ *   as x, y, width, height with a bottom-left origin. They're only valid
+ *   during the callback. If numRects is zero, then the whole window changed.
+ *
+ * The buffer won't be rendered to again until the consumer calls
+ * eglReleaseCaptureFrameNVX with the frame's captureId. That may be called
+ * from any thread, including from inside the callback. If releaseFenceFd is
+ * not -1, then it's a sync_file that signals once the consumer has finished
+ * reading, and the library waits for it before rendering to the buffer
+ * again. The library takes ownership of releaseFenceFd, even if the call
+ * fails.
+ *
+ * The consumer can hold at most two frames at a time. While it holds two,
+ * eglSwapBuffers skips the callback. The callback must not call any other
+ * EGL functions for the surface.
+ *
+ * Frame capture is not available for an EGL_SINGLE_BUFFER surface, and
+ * eglSetCaptureCallbackNVX fails with EGL_BAD_MATCH for one.
+ */
+#ifndef EGL_NVX_wayland_frame_capture
+#define EGL_NVX_wayland_frame_capture 1
+typedef struct
+{
+    EGLuint64KHR captureId;
+    EGLuint64KHR presentId;
+    int dmabufFd;
+    int acquireFenceFd;
+    EGLint width;
+    EGLint height;
+    EGLint fourcc;
+    EGLint stride;
+    EGLint offset;
+    EGLuint64KHR modifier;
+    const EGLint *rects;
+    EGLint numRects;
+} EGLWaylandCaptureFrameNVX;
+typedef void (EGLAPIENTRYP PFNEGLWAYLANDCAPTURECALLBACKNVX) (const EGLWaylandCaptureFrameNVX *frame, void *userData);
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSETCAPTURECALLBACKNVXPROC) (EGLDisplay dpy, EGLSurface surface, PFNEGLWAYLANDCAPTURECALLBACKNVX callback, void *userData);
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLRELEASECAPTUREFRAMENVXPROC) (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR captureId, EGLint releaseFenceFd);
+#ifdef EGL_EGLEXT_PROTOTYPES
+EGLAPI EGLBoolean EGLAPIENTRY eglSetCaptureCallbackNVX (EGLDisplay dpy, EGLSurface surface, PFNEGLWAYLANDCAPTURECALLBACKNVX callback, void *userData);
+EGLAPI EGLBoolean EGLAPIENTRY eglReleaseCaptureFrameNVX (EGLDisplay dpy, EGLSurface surface, EGLuint64KHR captureId, EGLint releaseFenceFd);
+#endif
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // WAYLAND_EGL_EXT_H
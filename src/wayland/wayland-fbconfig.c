@@ -101,6 +101,8 @@ WlFormatList *eplWlGetDriverFormats(EplPlatformData *plat, EGLDisplay internal_d
     }
     result->num_formats = 0;
     result->formats = (WlDmaBufFormat *) (result + 1);
+    result->modifier_hash = NULL;
+    result->modifier_hash_mask = 0;
     mods_base = (uint64_t *) (result->formats + num_formats);
 
     modsbuf = malloc(max_modifiers * (sizeof(uint64_t) + sizeof(EGLBoolean)));
@@ -149,22 +151,32 @@ WlFormatList *eplWlGetDriverFormats(EplPlatformData *plat, EGLDisplay internal_d
         }
         mods_offset += fmt->num_modifiers;
 
+        // Keep the modifier list sorted, so that a format's modifier
+        // indexes don't depend on the order that the driver reports them in.
+        qsort(fmt->modifiers, fmt->num_modifiers, sizeof(uint64_t), eplWlCompareU64);
+
         fmt->fourcc = fourccs[i];
         fmt->fmt = eplFormatInfoLookup(fourccs[i]);
         result->num_formats++;
     }
 
-    if (result->num_formats > 0)
+    if (result->num_formats == 0)
     {
-        success = EGL_TRUE;
+        goto done;
     }
+    if (!eplWlFormatListBuildModifierHash(result))
+    {
+        eplSetError(plat, EGL_BAD_ALLOC, "Out of memory");
+        goto done;
+    }
+    success = EGL_TRUE;
 
 done:
     free(fourccs);
     free(modsbuf);
     if (!success)
     {
-        free(result);
+        eplWlFormatListFree(result);
         result = NULL;
     }
     return result;
@@ -182,7 +194,7 @@ static EGLBoolean SetupConfig(EplPlatformData *plat,
     const WlDmaBufFormat *server_fmt = NULL;
     EGLint fourcc = DRM_FORMAT_INVALID;
     EGLBoolean supported = EGL_FALSE;
-    size_t i, j;
+    size_t i;
 
     config->surfaceMask &= ~(EGL_WINDOW_BIT | EGL_PIXMAP_BIT);
 
@@ -247,13 +259,7 @@ static EGLBoolean SetupConfig(EplPlatformData *plat,
         }
         else if (!force_prime)
         {
-            for (j=0; j<driver_fmt->num_modifiers && !supported; j++)
-            {
-                if (server_fmt->modifiers[i] == driver_fmt->modifiers[j])
-                {
-                    supported = EGL_TRUE;
-                }
-            }
+            supported = eplWlFormatListHasModifier(driver_formats, fourcc, server_fmt->modifiers[i]);
         }
     }
 
@@ -17,8 +17,10 @@
 
 #include "wayland-platform.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <assert.h>
@@ -26,6 +28,7 @@
 #include "wayland-display.h"
 #include "wayland-fbconfig.h"
 #include "platform-utils.h"
+#include "wayland-trace.h"
 #include "dma-buf.h"
 
 static const EGLint NEED_PLATFORM_SURFACE_MINOR = 1;
@@ -60,6 +63,7 @@ static const EplImplFuncs WL_IMPL_FUNCS =
     .WaitGL = eplWlWaitGL,
     .SwapInterval = eplWlSwapInterval,
     .QuerySurface = eplWlQuerySurface,
+    .QueryDisplayAttrib = eplWlQueryDisplayAttrib,
 };
 
 static EGLBoolean LoadProcHelper(EplPlatformData *plat, void *handle, void **ptr, const char *name)
@@ -99,6 +103,17 @@ PUBLIC EGLBoolean loadEGLExternalPlatform(int major, int minor,
         return EGL_FALSE;
     }
 
+    eplWlTraceInit();
+    pthread_mutex_init(&plat->priv->memory.mutex, NULL);
+    pthread_mutex_init(&plat->priv->perf_warnings.mutex, NULL);
+    {
+        const char *env = getenv("__NV_PRESENT_MEMORY_BUDGET");
+        if (env != NULL && atoi(env) > 0)
+        {
+            plat->priv->memory.budget = ((uint64_t) atoi(env)) * 1024 * 1024;
+        }
+    }
+
     // Check that the driver supports a compatible version of the platform
     // surface interface.
     ptr_eglPlatformGetVersionNVX = driver->getProcAddress("eglPlatformGetVersionNVX");
@@ -122,6 +137,7 @@ PUBLIC EGLBoolean loadEGLExternalPlatform(int major, int minor,
     plat->priv->egl.CreateSync = driver->getProcAddress("eglCreateSync");
     plat->priv->egl.DestroySync = driver->getProcAddress("eglDestroySync");
     plat->priv->egl.WaitSync = driver->getProcAddress("eglWaitSync");
+    plat->priv->egl.ClientWaitSync = driver->getProcAddress("eglClientWaitSync");
     plat->priv->egl.DupNativeFenceFDANDROID = driver->getProcAddress("eglDupNativeFenceFDANDROID");
     plat->priv->egl.Flush = driver->getProcAddress("glFlush");
     plat->priv->egl.Finish = driver->getProcAddress("glFinish");
@@ -141,6 +157,7 @@ PUBLIC EGLBoolean loadEGLExternalPlatform(int major, int minor,
             || plat->priv->egl.CreateSync == NULL
             || plat->priv->egl.DestroySync == NULL
             || plat->priv->egl.WaitSync == NULL
+            || plat->priv->egl.ClientWaitSync == NULL
             || plat->priv->egl.DupNativeFenceFDANDROID == NULL
             || plat->priv->egl.Finish == NULL
             || plat->priv->egl.Flush == NULL
@@ -196,6 +213,10 @@ PUBLIC EGLBoolean loadEGLExternalPlatform(int major, int minor,
 
     plat->priv->timeline_funcs_supported = timelineSupported;
 
+    // drmSyncobjEventfd is newer than the rest, and we only use it to let the
+    // application poll for a free buffer, so it's optional.
+    LoadProcHelper(plat, dlHandle, (void **) &plat->priv->drm.SyncobjEventfd, "drmSyncobjEventfd");
+
 #undef LOAD_PROC
 
     // Load gbm_bo_create_with_modifiers2 if it's available. If it's not, then
@@ -216,6 +237,8 @@ void eplWlCleanupPlatform(EplPlatformData *plat)
     {
         dlclose(plat->priv->drm.libdrmDlHandle);
     }
+    pthread_mutex_destroy(&plat->priv->memory.mutex);
+    pthread_mutex_destroy(&plat->priv->perf_warnings.mutex);
 }
 
 const char *eplWlQueryString(EplPlatformData *plat, EplDisplay *pdpy, EGLExtPlatformString name)
@@ -247,6 +270,34 @@ void *eplWlGetHookFunction(EplPlatformData *plat, const char *name)
     {
         return eplWlHookQueryString;
     }
+    else if (strcmp(name, "eglGetPresentIdNVX") == 0)
+    {
+        return eplWlHookGetPresentId;
+    }
+    else if (strcmp(name, "eglWaitForPresentNVX") == 0)
+    {
+        return eplWlHookWaitForPresent;
+    }
+    else if (strcmp(name, "eglSetTargetFrameDurationNVX") == 0)
+    {
+        return eplWlHookSetTargetFrameDuration;
+    }
+    else if (strcmp(name, "eglBeginPresentBatchNVX") == 0)
+    {
+        return eplWlHookBeginPresentBatch;
+    }
+    else if (strcmp(name, "eglEndPresentBatchNVX") == 0)
+    {
+        return eplWlHookEndPresentBatch;
+    }
+    else if (strcmp(name, "eglSetCaptureCallbackNVX") == 0)
+    {
+        return eplWlHookSetCaptureCallback;
+    }
+    else if (strcmp(name, "eglReleaseCaptureFrameNVX") == 0)
+    {
+        return eplWlHookReleaseCaptureFrame;
+    }
     return NULL;
 }
 
@@ -362,3 +413,97 @@ int eplWlExportDmaBufSyncFile(int dmabuf)
 
     return fd;
 }
+
+void eplWlMemoryAdd(EplPlatformData *plat, uint64_t size)
+{
+    pthread_mutex_lock(&plat->priv->memory.mutex);
+    plat->priv->memory.usage += size;
+    if (plat->priv->memory.usage > plat->priv->memory.peak)
+    {
+        plat->priv->memory.peak = plat->priv->memory.usage;
+    }
+    pthread_mutex_unlock(&plat->priv->memory.mutex);
+}
+
+void eplWlMemoryRemove(EplPlatformData *plat, uint64_t size)
+{
+    pthread_mutex_lock(&plat->priv->memory.mutex);
+    assert(plat->priv->memory.usage >= size);
+    plat->priv->memory.usage -= size;
+    pthread_mutex_unlock(&plat->priv->memory.mutex);
+}
+
+EGLBoolean eplWlMemoryOverBudget(EplPlatformData *plat, uint64_t size)
+{
+    EGLBoolean over = EGL_FALSE;
+
+    pthread_mutex_lock(&plat->priv->memory.mutex);
+    if (plat->priv->memory.budget != 0)
+    {
+        if (size == 0)
+        {
+            over = (plat->priv->memory.usage >= plat->priv->memory.budget);
+        }
+        else
+        {
+            over = (plat->priv->memory.usage + size > plat->priv->memory.budget);
+        }
+    }
+    pthread_mutex_unlock(&plat->priv->memory.mutex);
+
+    return over;
+}
+
+/**
+ * The minimum time between two reports of the same performance warning, in
+ * nanoseconds.
+ */
+#define PERF_WARNING_INTERVAL 10000000000ULL
+
+static const char *PERF_WARNING_NAMES[WL_PERF_WARNING_COUNT] =
+{
+    [WL_PERF_WARNING_FINISH_FALLBACK] = "WL_PERF_FINISH_FALLBACK",
+    [WL_PERF_WARNING_PRIME_COPY] = "WL_PERF_PRIME_COPY",
+    [WL_PERF_WARNING_RELEASE_GUESS] = "WL_PERF_RELEASE_GUESS",
+    [WL_PERF_WARNING_FULL_DAMAGE] = "WL_PERF_FULL_DAMAGE",
+    [WL_PERF_WARNING_MODIFIER_REALLOC] = "WL_PERF_MODIFIER_REALLOC",
+    [WL_PERF_WARNING_CPU_TIMELINE_WAIT] = "WL_PERF_CPU_TIMELINE_WAIT",
+    [WL_PERF_WARNING_CAPTURE_DROPPED] = "WL_PERF_CAPTURE_DROPPED",
+};
+
+void eplWlPerfWarning(EplPlatformData *plat, WlPerfWarning id, const char *message)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t suppressed;
+    char buf[512];
+
+    assert(id >= 0 && id < WL_PERF_WARNING_COUNT);
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+
+    pthread_mutex_lock(&plat->priv->perf_warnings.mutex);
+    if (plat->priv->perf_warnings.last_time[id] != 0
+            && now - plat->priv->perf_warnings.last_time[id] < PERF_WARNING_INTERVAL)
+    {
+        plat->priv->perf_warnings.suppressed[id]++;
+        pthread_mutex_unlock(&plat->priv->perf_warnings.mutex);
+        return;
+    }
+    plat->priv->perf_warnings.last_time[id] = now;
+    suppressed = plat->priv->perf_warnings.suppressed[id];
+    plat->priv->perf_warnings.suppressed[id] = 0;
+    pthread_mutex_unlock(&plat->priv->perf_warnings.mutex);
+
+    if (suppressed > 0)
+    {
+        snprintf(buf, sizeof(buf), "%s: %s (%llu more since the last report)",
+                PERF_WARNING_NAMES[id], message, (unsigned long long) suppressed);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%s: %s", PERF_WARNING_NAMES[id], message);
+    }
+    plat->callbacks.debugMessage(EGL_DEBUG_MSG_WARN_KHR, buf);
+}
@@ -20,6 +20,7 @@
 
 #include <stdint.h>
 #include <sys/types.h>
+#include <pthread.h>
 
 #include <wayland-client-core.h>
 #include <wayland-client-protocol.h>
@@ -33,6 +34,39 @@
 #include "platform-base.h"
 #include "platform-impl.h"
 #include "driver-platform-surface.h"
+#include "wayland-egl-ext.h"
+
+/**
+ * Identifies a slow path that we report with eplWlPerfWarning.
+ *
+ * Each warning message starts with a stable name for the warning, so that an
+ * application or a telemetry tool can match on it. Don't rename these.
+ */
+typedef enum
+{
+    /// We had to call glFinish instead of passing a fence to the compositor.
+    WL_PERF_WARNING_FINISH_FALLBACK,
+
+    /// We had to blit each frame to a separate buffer for PRIME.
+    WL_PERF_WARNING_PRIME_COPY,
+
+    /// We reused a released buffer without any way to wait for it.
+    WL_PERF_WARNING_RELEASE_GUESS,
+
+    /// The wl_surface is too old for wl_surface.damage_buffer.
+    WL_PERF_WARNING_FULL_DAMAGE,
+
+    /// The compositor's dma-buf feedback forced a swapchain reallocation.
+    WL_PERF_WARNING_MODIFIER_REALLOC,
+
+    /// We had to do a CPU wait on a timeline point.
+    WL_PERF_WARNING_CPU_TIMELINE_WAIT,
+
+    /// A frame capture consumer held too many frames, so we skipped one.
+    WL_PERF_WARNING_CAPTURE_DROPPED,
+
+    WL_PERF_WARNING_COUNT
+} WlPerfWarning;
 
 struct _EplImplPlatform
 {
@@ -45,6 +79,7 @@ struct _EplImplPlatform
         PFNEGLCREATESYNCPROC CreateSync;
         PFNEGLDESTROYSYNCPROC DestroySync;
         PFNEGLWAITSYNCPROC WaitSync;
+        PFNEGLCLIENTWAITSYNCPROC ClientWaitSync;
         PFNEGLDUPNATIVEFENCEFDANDROIDPROC DupNativeFenceFDANDROID;
         void (* Flush) (void);
         void (* Finish) (void);
@@ -83,6 +118,13 @@ struct _EplImplPlatform
                           uint32_t dst_handle, uint64_t dst_point,
                           uint32_t src_handle, uint64_t src_point,
                           uint32_t flags);
+
+        /**
+         * drmSyncobjEventfd, which was added in libdrm 2.4.116. This is
+         * optional, and may be NULL even if explicit sync is supported.
+         */
+        int (* SyncobjEventfd) (int fd, uint32_t handle, uint64_t point,
+                          int ev_fd, uint32_t flags);
     } drm;
 
     struct
@@ -102,6 +144,41 @@ struct _EplImplPlatform
     } gbm;
 
     EGLBoolean timeline_funcs_supported;
+
+    /**
+     * Keeps track of how much memory we've allocated for color buffers,
+     * across every display and surface in the process.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+
+        /// The number of bytes currently allocated.
+        uint64_t usage;
+
+        /// The largest value that \c usage has reached.
+        uint64_t peak;
+
+        /**
+         * The most memory that we should use for color buffers, or zero for
+         * no limit. This is set with __NV_PRESENT_MEMORY_BUDGET, in megabytes.
+         */
+        uint64_t budget;
+    } memory;
+
+    /**
+     * Rate limiting state for eplWlPerfWarning.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+
+        /// The CLOCK_MONOTONIC time of the last report for each warning.
+        uint64_t last_time[WL_PERF_WARNING_COUNT];
+
+        /// The number of warnings suppressed since the last report.
+        uint64_t suppressed[WL_PERF_WARNING_COUNT];
+    } perf_warnings;
 };
 
 /**
@@ -128,6 +205,36 @@ EGLBoolean eplWlImportDmaBufSyncFile(int dmabuf, int syncfd);
  */
 int eplWlExportDmaBufSyncFile(int dmabuf);
 
+/**
+ * Records that we've allocated a color buffer.
+ */
+void eplWlMemoryAdd(EplPlatformData *plat, uint64_t size);
+
+/**
+ * Records that we've freed a color buffer.
+ */
+void eplWlMemoryRemove(EplPlatformData *plat, uint64_t size);
+
+/**
+ * Returns true if allocating another \p size bytes would go over the memory
+ * budget. If \p size is zero, then this checks whether we're already at or
+ * over the budget.
+ */
+EGLBoolean eplWlMemoryOverBudget(EplPlatformData *plat, uint64_t size);
+
+/**
+ * Reports a performance warning through the driver's debug callback, as
+ * EGL_DEBUG_MSG_WARN_KHR.
+ *
+ * Each warning is reported at most once every few seconds, along with the
+ * number of times that it was suppressed in between.
+ *
+ * \param plat The platform data.
+ * \param id The warning.
+ * \param message A description of what happened.
+ */
+void eplWlPerfWarning(EplPlatformData *plat, WlPerfWarning id, const char *message);
+
 EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, EplSurface *psurf,
         EGLConfig config, void *native_surface, const EGLAttrib *attribs, EGLBoolean create_platform,
         const struct glvnd_list *existing_surfaces);
@@ -144,4 +251,42 @@ EGLBoolean eplWlWaitGL(EplDisplay *pdpy, EplSurface *psurf);
 
 EplQueryResult eplWlQuerySurface(EplDisplay *pdpy, EplSurface *psurf, EGLint attrib, EGLint *ret_value);
 
+/**
+ * Hook function for eglGetPresentIdNVX.
+ */
+EGLBoolean eplWlHookGetPresentId(EGLDisplay edpy, EGLSurface esurf, EGLuint64KHR *present_id);
+
+/**
+ * Hook function for eglWaitForPresentNVX.
+ */
+EGLint eplWlHookWaitForPresent(EGLDisplay edpy, EGLSurface esurf,
+        EGLuint64KHR present_id, EGLTimeKHR timeout);
+
+/**
+ * Hook function for eglSetTargetFrameDurationNVX.
+ */
+EGLBoolean eplWlHookSetTargetFrameDuration(EGLDisplay edpy, EGLSurface esurf, EGLuint64KHR duration);
+
+/**
+ * Hook function for eglBeginPresentBatchNVX.
+ */
+EGLBoolean eplWlHookBeginPresentBatch(EGLDisplay edpy);
+
+/**
+ * Hook function for eglEndPresentBatchNVX.
+ */
+EGLBoolean eplWlHookEndPresentBatch(EGLDisplay edpy);
+
+/**
+ * Hook function for eglSetCaptureCallbackNVX.
+ */
+EGLBoolean eplWlHookSetCaptureCallback(EGLDisplay edpy, EGLSurface esurf,
+        PFNEGLWAYLANDCAPTURECALLBACKNVX callback, void *user_data);
+
+/**
+ * Hook function for eglReleaseCaptureFrameNVX.
+ */
+EGLBoolean eplWlHookReleaseCaptureFrame(EGLDisplay edpy, EGLSurface esurf,
+        EGLuint64KHR capture_id, EGLint release_fence_fd);
+
 #endif // WAYLAND_PLATFORM_H
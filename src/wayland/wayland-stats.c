@@ -0,0 +1,231 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wayland-stats.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+typedef struct
+{
+    WlStatsHeader header;
+    WlStatsDisplay displays[WL_STATS_MAX_DISPLAYS];
+    WlStatsSurface surfaces[WL_STATS_MAX_SURFACES];
+} WlStatsSegment;
+
+/**
+ * The shared memory segment, or NULL if we haven't created it yet.
+ *
+ * The segment is created the first time that a display claims a slot, and
+ * then stays around until the process exits, so that the pointers we hand
+ * out never go stale.
+ */
+static WlStatsSegment *segment = NULL;
+static int segment_failed = 0;
+static uint64_t next_id = 1;
+
+/**
+ * Protects \c segment and claiming or releasing a slot. Updating the counters
+ * in a slot doesn't need the mutex.
+ */
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static WlStatsSegment *GetSegment(void)
+{
+    const char *env;
+    int fd;
+    void *ptr;
+
+    if (segment != NULL || segment_failed)
+    {
+        return segment;
+    }
+
+    // Don't try again if anything below fails.
+    segment_failed = 1;
+
+    env = getenv("__NV_DISABLE_WAYLAND_STATS");
+    if (env != NULL && atoi(env) != 0)
+    {
+        return NULL;
+    }
+
+    fd = memfd_create(WL_STATS_MEMFD_NAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+    if (ftruncate(fd, sizeof(WlStatsSegment)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    // A reader can't change the size out from under us.
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+    ptr = mmap(NULL, sizeof(WlStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /*
+     * Note that we deliberately leave the fd open: That's how a reader finds
+     * the segment, through /proc/<pid>/fd.
+     */
+    segment = ptr;
+    segment->header.magic = WL_STATS_MAGIC;
+    segment->header.version = WL_STATS_VERSION;
+    segment->header.header_size = sizeof(WlStatsHeader);
+    segment->header.display_size = sizeof(WlStatsDisplay);
+    segment->header.surface_size = sizeof(WlStatsSurface);
+    segment->header.max_displays = WL_STATS_MAX_DISPLAYS;
+    segment->header.max_surfaces = WL_STATS_MAX_SURFACES;
+    segment->header.pid = (uint32_t) getpid();
+    segment_failed = 0;
+
+    return segment;
+}
+
+WlStatsDisplay *eplWlStatsAddDisplay(void)
+{
+    WlStatsDisplay *display = NULL;
+    WlStatsSegment *seg;
+    uint32_t i;
+
+    pthread_mutex_lock(&segment_mutex);
+    seg = GetSegment();
+    if (seg != NULL)
+    {
+        for (i=0; i<WL_STATS_MAX_DISPLAYS; i++)
+        {
+            if (!seg->displays[i].in_use)
+            {
+                display = &seg->displays[i];
+                break;
+            }
+        }
+    }
+    if (display != NULL)
+    {
+        __atomic_store_n(&display->seq, display->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        display->id = next_id++;
+        display->roundtrips = 0;
+        display->buffers_allocated = 0;
+        display->surfaces_created = 0;
+        display->in_use = 1;
+        __atomic_store_n(&display->seq, display->seq + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&segment_mutex);
+
+    return display;
+}
+
+void eplWlStatsRemoveDisplay(WlStatsDisplay *display)
+{
+    if (display != NULL)
+    {
+        // Bump the sequence number around this, too, so that a reader that's
+        // in the middle of copying the slot will retry.
+        pthread_mutex_lock(&segment_mutex);
+        __atomic_store_n(&display->seq, display->seq + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        __atomic_store_n(&display->in_use, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&display->seq, display->seq + 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&segment_mutex);
+    }
+}
+
+WlStatsSurface *eplWlStatsAddSurface(WlStatsDisplay *display, uint32_t wl_surface_id)
+{
+    WlStatsSurface *surface = NULL;
+    uint32_t i;
+
+    if (display == NULL)
+    {
+        return NULL;
+    }
+
+    WL_STATS_DISPLAY_ADD(display, surfaces_created, 1);
+
+    pthread_mutex_lock(&segment_mutex);
+    for (i=0; i<WL_STATS_MAX_SURFACES; i++)
+    {
+        if (!segment->surfaces[i].in_use)
+        {
+            surface = &segment->surfaces[i];
+            break;
+        }
+    }
+    if (surface != NULL)
+    {
+        eplWlStatsBeginUpdate(surface);
+        memset(((char *) surface) + offsetof(WlStatsSurface, id), 0,
+                sizeof(WlStatsSurface) - offsetof(WlStatsSurface, id));
+        surface->id = next_id++;
+        surface->display_id = display->id;
+        surface->wl_surface_id = wl_surface_id;
+        surface->in_use = 1;
+        eplWlStatsEndUpdate(surface);
+    }
+    pthread_mutex_unlock(&segment_mutex);
+
+    return surface;
+}
+
+void eplWlStatsRemoveSurface(WlStatsSurface *surface)
+{
+    if (surface != NULL)
+    {
+        pthread_mutex_lock(&segment_mutex);
+        eplWlStatsBeginUpdate(surface);
+        __atomic_store_n(&surface->in_use, 0, __ATOMIC_RELAXED);
+        eplWlStatsEndUpdate(surface);
+        pthread_mutex_unlock(&segment_mutex);
+    }
+}
+
+void eplWlStatsRecordSwap(WlStatsSurface *surface, uint64_t blocked_ns)
+{
+    uint32_t bucket = 0;
+    uint64_t limit = 1000000;
+
+    if (surface == NULL)
+    {
+        return;
+    }
+
+    while (bucket < WL_STATS_BLOCKED_BUCKETS - 1 && blocked_ns >= limit)
+    {
+        bucket++;
+        limit *= 2;
+    }
+
+    eplWlStatsBeginUpdate(surface);
+    __atomic_store_n(&surface->swaps, surface->swaps + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&surface->blocked_ns, surface->blocked_ns + blocked_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&surface->blocked_histogram[bucket],
+            surface->blocked_histogram[bucket] + 1, __ATOMIC_RELAXED);
+    eplWlStatsEndUpdate(surface);
+}
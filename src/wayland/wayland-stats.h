@@ -0,0 +1,201 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYLAND_STATS_H
+#define WAYLAND_STATS_H
+
+/**
+ * \file
+ *
+ * Live counters for displays and surfaces, published in shared memory.
+ *
+ * The counters live in a memfd named WL_STATS_MEMFD_NAME, so an external tool
+ * can find it through /proc/<pid>/fd and map it read-only, without having to
+ * restart the process. See src/tools/egl-wayland2-stats.c for a reader.
+ *
+ * The layout below is shared with that reader. Any incompatible change must
+ * bump WL_STATS_VERSION. New fields may only be added at the end of a slot,
+ * and readers should use the sizes in WlStatsHeader to step through the
+ * arrays.
+ *
+ * Each surface slot has a single writer at a time, and is updated with a
+ * seqlock: \c seq is odd while an update is in progress. A reader should
+ * read \c seq, copy the slot, and then check that \c seq is unchanged and
+ * even. Display counters can be updated from more than one thread, so they
+ * use atomic adds instead, and there's no consistency across fields.
+ */
+
+#include <stdint.h>
+
+#define WL_STATS_MEMFD_NAME "egl-wayland2-stats"
+#define WL_STATS_MAGIC 0x53574c45 // "ELWS"
+#define WL_STATS_VERSION 1
+
+#define WL_STATS_MAX_DISPLAYS 16
+#define WL_STATS_MAX_SURFACES 128
+
+/**
+ * The number of buckets in the blocked-time histogram.
+ *
+ * Bucket 0 counts frames that blocked for less than 1 ms, and each bucket
+ * after that doubles the limit (2 ms, 4 ms, and so on). The last bucket
+ * counts everything else.
+ */
+#define WL_STATS_BLOCKED_BUCKETS 8
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;
+    uint32_t display_size;
+    uint32_t surface_size;
+    uint32_t max_displays;
+    uint32_t max_surfaces;
+    uint32_t pid;
+} WlStatsHeader;
+
+typedef struct
+{
+    /**
+     * Incremented before and after claiming or releasing the slot.
+     */
+    uint32_t seq;
+
+    /**
+     * Nonzero if this slot belongs to a display.
+     */
+    uint32_t in_use;
+
+    /**
+     * A unique serial number for the display. This is never reused, so a
+     * reader can tell if a slot was released and claimed again.
+     */
+    uint64_t id;
+
+    /// The number of wl_display roundtrips after eglInitialize.
+    uint64_t roundtrips;
+
+    /// The number of present buffers allocated.
+    uint64_t buffers_allocated;
+
+    /// The number of window surfaces created.
+    uint64_t surfaces_created;
+} WlStatsDisplay;
+
+typedef struct
+{
+    uint32_t seq;
+    uint32_t in_use;
+
+    /// A unique serial number for the surface.
+    uint64_t id;
+
+    /// The \c id of the display that this surface belongs to.
+    uint64_t display_id;
+
+    /// The protocol ID of the wl_surface.
+    uint64_t wl_surface_id;
+
+    uint64_t swaps;
+
+    /**
+     * The total time that eglSwapBuffers spent waiting for the compositor or
+     * for a free buffer, in nanoseconds.
+     */
+    uint64_t blocked_ns;
+    uint64_t blocked_histogram[WL_STATS_BLOCKED_BUCKETS];
+
+    /// The number of frames that needed a PRIME blit.
+    uint64_t prime_copies;
+
+    /// The number of times that we created a new swapchain.
+    uint64_t swapchain_reallocs;
+
+    /// The number of times that we had to fall back to a glFinish.
+    uint64_t finish_fallbacks;
+
+    /// The number of frames that the compositor discarded.
+    uint64_t discarded_frames;
+
+    /**
+     * The number of pixels that EGL_WAYLAND_BUFFER_SELECTION_MIN_REPAINT_NVX
+     * saved the application from repainting, compared to picking the first
+     * free buffer.
+     */
+    uint64_t repaint_pixels_saved;
+} WlStatsSurface;
+
+/**
+ * Claims a slot for a display.
+ *
+ * Returns NULL if we're out of slots, or if stats are turned off with
+ * __NV_DISABLE_WAYLAND_STATS. Every other function here accepts NULL.
+ */
+WlStatsDisplay *eplWlStatsAddDisplay(void);
+void eplWlStatsRemoveDisplay(WlStatsDisplay *display);
+
+/**
+ * Claims a slot for a window surface.
+ */
+WlStatsSurface *eplWlStatsAddSurface(WlStatsDisplay *display, uint32_t wl_surface_id);
+void eplWlStatsRemoveSurface(WlStatsSurface *surface);
+
+/**
+ * Adds to one of a display's counters.
+ */
+#define WL_STATS_DISPLAY_ADD(display, field, n) \
+    do { \
+        if ((display) != NULL) { \
+            __atomic_fetch_add(&(display)->field, (n), __ATOMIC_RELAXED); \
+        } \
+    } while (0)
+
+static inline void eplWlStatsBeginUpdate(WlStatsSurface *surface)
+{
+    __atomic_store_n(&surface->seq, surface->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void eplWlStatsEndUpdate(WlStatsSurface *surface)
+{
+    __atomic_store_n(&surface->seq, surface->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Adds to one of a surface's counters.
+ *
+ * Only one thread may update a given surface's counters at a time.
+ */
+#define WL_STATS_SURFACE_ADD(surface, field, n) \
+    do { \
+        if ((surface) != NULL) { \
+            eplWlStatsBeginUpdate(surface); \
+            __atomic_store_n(&(surface)->field, (surface)->field + (n), __ATOMIC_RELAXED); \
+            eplWlStatsEndUpdate(surface); \
+        } \
+    } while (0)
+
+/**
+ * Records a completed eglSwapBuffers call.
+ *
+ * \param surface The surface's stats slot
+ * \param blocked_ns How long the call spent waiting, in nanoseconds.
+ */
+void eplWlStatsRecordSwap(WlStatsSurface *surface, uint64_t blocked_ns);
+
+#endif // WAYLAND_STATS_H
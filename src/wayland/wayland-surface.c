@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <limits.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 #include <assert.h>
 
 #include <xf86drm.h>
@@ -41,15 +42,133 @@
 #include "wayland-display.h"
 #include "wayland-swapchain.h"
 #include "wayland-dmabuf.h"
+#include "wayland-egl-ext.h"
+#include "wayland-trace.h"
 #include "wl-object-utils.h"
 
 static const int WL_EGL_WINDOW_DESTROY_CALLBACK_SINCE = 3;
 
+static const int32_t FORMAT_TABLE_MAP_NONE = -1;
+static const int32_t FORMAT_TABLE_MAP_LINEAR = -2;
+
 /**
  * How much time to use for padding in wp_commit_timer_v1::set_timestamp.
  */
 static const uint32_t FRAME_TIMESTAMP_PADDING = 500000; // 5 ms
 
+/**
+ * The number of per-frame presentation feedback objects we'll keep track of.
+ *
+ * The compositor should discard a frame as soon as a newer one replaces it,
+ * so we'd normally only have one or two of these pending at once.
+ */
+#define MAX_FRAME_FEEDBACK 8
+
+/**
+ * How often (in milliseconds) to check explicit sync release points for
+ * EGL_NVX_wayland_ready_fd, if we can't get an eventfd for them.
+ */
+#define READY_RELEASE_POLL_INTERVAL 2
+
+/**
+ * The number of frames that a frame capture consumer can hold at once.
+ *
+ * This leaves the swapchain with at least WL_MIN_PRESENT_BUFFERS buffers
+ * that it can render to, so eglSwapBuffers can't end up waiting on the
+ * consumer.
+ */
+#define MAX_CAPTURE_HOLDS (WL_MAX_PRESENT_BUFFERS - WL_MIN_PRESENT_BUFFERS)
+
+/**
+ * Parameters for guessing whether an output has a variable refresh rate.
+ *
+ * A presentation is off the refresh grid if it's more than 1/VRR_GRID_TOLERANCE
+ * of a refresh period away from a multiple of the refresh period. We switch to
+ * VRR pacing once the score reaches VRR_SCORE_THRESHOLD, and switch back once
+ * it drops to zero.
+ */
+#define VRR_GRID_TOLERANCE 8
+#define VRR_SCORE_THRESHOLD 4
+#define VRR_SCORE_MAX 8
+
+/**
+ * The number of discarded frames in a row before we assume that a window is
+ * occluded.
+ */
+#define OCCLUDED_DISCARD_THRESHOLD 2
+
+/**
+ * How long to wait for a frame to be presented before we assume that a window
+ * is occluded, in multiples of the expected frame time.
+ */
+#define OCCLUDED_TIMEOUT_FRAMES 4
+
+/**
+ * The minimum time to wait for a frame to be presented before we assume that
+ * a window is occluded, in nanoseconds.
+ */
+#define OCCLUDED_TIMEOUT_MIN 50000000
+
+/**
+ * The range of refresh periods, in milliseconds, that we'll accept from the
+ * frame callback timestamps when we estimate the refresh rate.
+ */
+#define FRAME_CALLBACK_MIN_PERIOD 4
+#define FRAME_CALLBACK_MAX_PERIOD 50
+
+/**
+ * If the time between eglSwapBuffers calls is at least this long (in
+ * nanoseconds), then we treat the window as idle.
+ */
+#define IDLE_SWAP_PERIOD 250000000
+
+/**
+ * The number of idle frames in a row before we free a window's extra buffers.
+ *
+ * If we're over the memory budget, then we only wait for one idle frame.
+ */
+#define IDLE_TRIM_SWAPS 3
+
+/**
+ * How long a window has to stay idle before we free its extra buffers, in
+ * nanoseconds. Like IDLE_TRIM_SWAPS, this doesn't apply if we're over the
+ * memory budget.
+ */
+#define IDLE_TRIM_PERIOD 1000000000
+
+/**
+ * The render scales, in percent, that dynamic resolution can pick from.
+ *
+ * Sticking to a small, fixed set of scales means that we keep coming back to
+ * the same buffer sizes, so that we can reuse a swapchain instead of
+ * allocating a new one every time the scale changes.
+ */
+static const uint32_t RESOLUTION_SCALES[] = { 100, 85, 70, 50 };
+#define NUM_RESOLUTION_SCALES (sizeof(RESOLUTION_SCALES) / sizeof(RESOLUTION_SCALES[0]))
+
+/**
+ * How many consecutive frames have to go over budget before we drop to a
+ * lower resolution.
+ */
+static const uint32_t RESOLUTION_DOWN_FRAMES = 10;
+
+/**
+ * How many frames have to stay within budget before we try a higher
+ * resolution.
+ *
+ * If we go back down right after trying a higher resolution, then we double
+ * this, up to \c RESOLUTION_MAX_UP_FRAMES, so that we don't keep bouncing
+ * between two scales.
+ */
+static const uint32_t RESOLUTION_UP_FRAMES = 120;
+static const uint32_t RESOLUTION_MAX_UP_FRAMES = 1920;
+
+/**
+ * How many frames to ignore after changing the resolution, so that the cost
+ * of the reallocation doesn't count against the new scale.
+ */
+static const uint32_t RESOLUTION_COOLDOWN_FRAMES = 10;
+
 /**
  * Keeps track of a per-surface dma-buf feedback object.
  *
@@ -87,6 +206,18 @@ typedef struct
 
     EGLBoolean tranche_linear_supported;
 
+    /**
+     * Maps each entry in the current format table to an index in the
+     * surface's driver modifier list.
+     *
+     * This is rebuilt whenever we get a new format table, so that handling
+     * each zwp_linux_dmabuf_feedback_v1::tranche_formats index is just an
+     * array lookup. Entries that don't match our format are set to
+     * \c FORMAT_TABLE_MAP_NONE, and linear entries are set to
+     * \c FORMAT_TABLE_MAP_LINEAR.
+     */
+    int32_t *format_table_map;
+
     /**
      * A counter that we increment when we get a new round of feedback events.
      *
@@ -96,11 +227,138 @@ typedef struct
     uint32_t feedback_update_count;
 } SurfaceFeedbackState;
 
+/**
+ * A frame that's waiting for rendering to finish before we can commit it.
+ *
+ * This is used when the display's \c use_async_commit flag is set.
+ */
+typedef struct
+{
+    WlPresentBuffer *present_buf;
+    EGLint swap_interval;
+    uint64_t present_id;
+
+    /**
+     * The time that the frame should be displayed, from PaceFrame, or zero.
+     */
+    uint64_t target_time;
+
+    /**
+     * The damage rectangles for the frame. This points to
+     * \c EplImplSurface::commit.rects.
+     */
+    const EGLint *rects;
+    EGLint n_rects;
+
+    /**
+     * A native fence FD for the frame's rendering, or -1.
+     *
+     * For a frame in a present batch, this is the sync_file from
+     * SyncRendering, which PresentBatchedFrame hands to the frame capture
+     * consumer.
+     */
+    int fence_fd;
+
+    /**
+     * An EGL_SYNC_FENCE object for the frame's rendering, or EGL_NO_SYNC.
+     *
+     * This is used if we don't have EGL_ANDROID_native_fence_sync.
+     */
+    EGLSync fence_sync;
+
+    /**
+     * True if the commit thread should hand \c capture to the frame capture
+     * callback once rendering has finished.
+     */
+    EGLBoolean capture_pending;
+    EGLWaylandCaptureFrameNVX capture;
+} WlCommitJob;
+
+/**
+ * A wp_presentation_feedback object for a single frame.
+ *
+ * With a swap interval of zero or in mailbox mode, we can have several frames
+ * in flight at once, so we keep one of these for each frame.
+ */
+typedef struct
+{
+    EplSurface *psurf;
+    struct wp_presentation_feedback *feedback;
+
+    /// The present ID of the frame.
+    uint64_t present_id;
+} WlFrameFeedback;
+
+/**
+ * A swapchain that's being allocated on the surface's build thread.
+ *
+ * Allocating a swapchain means a GBM allocation, a driver import, and a
+ * roundtrip to create each wl_buffer, so we do that on a separate thread
+ * while we keep presenting with the old swapchain.
+ *
+ * Everything except \c swapchain and \c done is set up before the build is
+ * queued, and the build thread only reads it.
+ */
+typedef struct
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t display_width;
+    uint32_t display_height;
+    EGLBoolean prime;
+    EGLBoolean prime_direct;
+
+    /**
+     * A copy of the modifier list. We can't use the surface's list directly,
+     * because a dma-buf feedback event could replace it while the worker
+     * thread is running.
+     */
+    uint64_t *modifiers;
+    size_t num_modifiers;
+
+    /// The surface's feedback update count when we started.
+    uint32_t feedback_update_count;
+
+    /// True if the build was handed to the build thread.
+    EGLBoolean queued;
+
+    /// The new swapchain, or NULL if the allocation failed.
+    WlSwapChain *swapchain;
+
+    /// Set to true, with a release store, once \c swapchain is ready.
+    EGLBoolean done;
+} WlSwapChainBuild;
+
+/**
+ * A frame that we've handed to a frame capture consumer.
+ */
+typedef struct
+{
+    /// The capture ID of the frame, or zero if this entry is unused.
+    uint64_t id;
+
+    /**
+     * True if the consumer has called eglReleaseCaptureFrameNVX, but
+     * eglSwapBuffers hasn't handed the buffer back to the swapchain yet.
+     */
+    EGLBoolean released;
+
+    /// The release fence from the consumer, or -1. Only valid if \c released is set.
+    int release_fd;
+} WlCaptureHold;
+
 struct _EplImplSurface
 {
     /// A pointer back to the owning display.
     WlDisplayInstance *inst;
 
+    /**
+     * The shared memory counters for this surface. This may be NULL.
+     *
+     * These are only updated from the thread that owns \c current.
+     */
+    WlStatsSurface *stats;
+
     long int native_window_version;
 
     /**
@@ -115,6 +373,32 @@ struct _EplImplSurface
      */
     uint32_t present_fourcc;
 
+    /**
+     * The present mode, as set by the EGL_WAYLAND_PRESENT_MODE_NVX attribute.
+     *
+     * This is either EGL_WAYLAND_PRESENT_MODE_FIFO_NVX or
+     * EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX, and can't change after the surface
+     * is created.
+     */
+    EGLint present_mode;
+
+    /**
+     * How to pick the next back buffer, as set by the
+     * EGL_WAYLAND_BUFFER_SELECTION_NVX attribute. This can't change after the
+     * surface is created.
+     */
+    EGLint buffer_selection;
+
+    /**
+     * True if the app asked for EGL_SINGLE_BUFFER.
+     *
+     * In that case, the swapchain only ever has one buffer, which stays
+     * attached to the wl_surface. The app renders into it directly, and
+     * eglSwapBuffers only commits the new damage. This can't change after the
+     * surface is created.
+     */
+    EGLBoolean single_buffer;
+
     /**
      * Contains data that should only be accessed while the surface is current
      * or destroyed.
@@ -129,6 +413,15 @@ struct _EplImplSurface
         /// A wrapper for the app's wl_surface.
         struct wl_surface *wsurf;
 
+        /**
+         * A wrapper for the wl_display, used for the wl_display::sync request
+         * in eglSwapBuffers.
+         *
+         * We keep this around so that we don't have to create a new wrapper
+         * every frame.
+         */
+        struct wl_display *wdpy;
+
         /// A wrapper for the display's wp_presentation object.
         struct wp_presentation *presentation_time;
 
@@ -138,6 +431,16 @@ struct _EplImplSurface
          */
         struct wp_linux_drm_syncobj_surface_v1 *syncobj;
 
+        /**
+         * For a single-buffered surface with explicit sync, a separate
+         * timeline for the release points.
+         *
+         * We keep attaching the same buffer, and each commit's release point
+         * would otherwise be ahead of the next frame's acquire point on the
+         * buffer's own timeline.
+         */
+        WlTimeline single_release;
+
         /**
          * The current swapchain for this surface.
          */
@@ -155,19 +458,53 @@ struct _EplImplSurface
         struct wl_callback *last_swap_sync;
 
         /**
-         * A presentation feedback object for the last presented frame.
+         * The present ID of the most recent eglSwapBuffers call.
+         *
+         * Present IDs start at 1 and increase by one with each frame.
+         */
+        uint64_t last_present_id;
+
+        /**
+         * The newest present ID that the compositor has either displayed or
+         * discarded.
+         *
+         * The compositor handles frames in order, so this also means that
+         * every earlier frame is finished.
+         *
+         * If we don't have presentation-time, then we count a frame as
+         * finished once the wl_display::sync after it comes back.
+         */
+        uint64_t completed_present_id;
+
+        /**
+         * The present ID that the next eglSwapBuffers has to wait for, or
+         * zero.
          *
-         * If this is non-NULL, then we can expect to receive a presented or
-         * discarded event in finite time.
+         * If this is newer than \c completed_present_id, then we can expect
+         * to receive a presented or discarded event in finite time.
          *
          * Currently, that means we've got a wp_fifo_v1 object, and the last
          * eglSwapBuffers had a nonzero swap interval.
          */
-        struct wp_presentation_feedback *presentation_feedback;
+        uint64_t throttle_present_id;
+
+        /// The present ID of the frame that \c last_swap_sync was sent after.
+        uint64_t last_swap_sync_id;
 
         struct wp_fifo_v1 *fifo;
         struct wp_commit_timer_v1 *commit_timer;
 
+        /**
+         * The tearing control object for this surface, or NULL if the server
+         * doesn't support wp_tearing_control_v1.
+         */
+        struct wp_tearing_control_v1 *tearing_control;
+
+        /**
+         * The last presentation hint that we sent with \c tearing_control.
+         */
+        uint32_t tearing_hint;
+
         /**
          * The timestamp of the last wp_presentation_feedback::presented or
          * discarded event.
@@ -185,6 +522,189 @@ struct _EplImplSurface
          */
         uint32_t last_present_refresh;
 
+        /**
+         * Presentation feedback for each frame that we've sent.
+         *
+         * This is a ring buffer, and \c next_frame_feedback is the next
+         * slot to use. If that slot is still waiting for an event, then we
+         * just drop it.
+         */
+        WlFrameFeedback frame_feedback[MAX_FRAME_FEEDBACK];
+        uint32_t next_frame_feedback;
+
+        /**
+         * Frame pacing state for EGL_WAYLAND_TARGET_FRAME_DURATION_NVX.
+         */
+        struct
+        {
+            /**
+             * The ideal presentation time of the last frame, or zero if we
+             * haven't scheduled one yet.
+             *
+             * Each frame is scheduled relative to the last one's ideal time
+             * rather than its actual presentation time, so that rounding to
+             * a vblank doesn't accumulate into drift.
+             */
+            uint64_t next_target;
+
+            /// The timestamp of the previous presented event, for VRR detection.
+            uint64_t prev_present_timestamp;
+
+            /**
+             * How many recent presentations landed off of the refresh grid.
+             * This goes up for each one that doesn't line up with a vblank
+             * and down for each one that does.
+             */
+            uint32_t vrr_score;
+
+            /**
+             * True if it looks like the output has a variable refresh rate,
+             * so that a frame can be displayed at any time rather than only
+             * on a vblank.
+             */
+            EGLBoolean vrr;
+        } pacing;
+
+        /**
+         * State for deciding whether the window might be occluded.
+         *
+         * With wp_fifo_v1, if the window isn't visible, then the compositor
+         * might never send a presented or discarded event for a frame. To
+         * avoid blocking forever, we send a second commit with another
+         * wp_fifo_v1::wait_barrier, which the compositor has to handle in
+         * finite time, and which makes it discard the first frame.
+         *
+         * That doubles the number of commits per frame, though, so we only
+         * send the extra commit right away if we think the window is
+         * occluded. Otherwise, we only send it if a frame takes too long to
+         * show up.
+         */
+        struct
+        {
+            /// The number of discarded events in a row.
+            uint32_t consecutive_discards;
+
+            /// True if we think the window is currently occluded.
+            EGLBoolean occluded;
+
+            /**
+             * True if we still need to send the extra commit for the frame
+             * in \c throttle_present_id.
+             */
+            EGLBoolean commit_needed;
+
+            /**
+             * The CLOCK_MONOTONIC time after which we give up waiting for
+             * the frame in \c throttle_present_id and send the extra
+             * commit.
+             */
+            uint64_t deadline;
+        } visibility;
+
+        /**
+         * State for throttling with wl_surface::frame callbacks, which we use
+         * if we don't have wp_fifo_v1.
+         *
+         * If the window is hidden, then the compositor might not send a frame
+         * callback for a long time, if ever. So, if we've waited longer than
+         * \c WlDisplayInstance::frame_callback_timeout, then we switch to a
+         * CPU timer based on the estimated refresh rate until the callback
+         * comes back.
+         *
+         * While the timer is active, we don't request any new frame
+         * callbacks, so that we don't pile up an unbounded number of them in
+         * the server.
+         */
+        struct
+        {
+            /// The CLOCK_MONOTONIC time of the last commit.
+            uint64_t commit_time;
+
+            /// The time to wait between frames when we're using the timer.
+            uint64_t period;
+
+            /// The estimated refresh period, in nanoseconds.
+            uint64_t refresh_estimate;
+
+            /// The timestamp from the last frame callback, in milliseconds.
+            uint32_t last_callback_time;
+
+            /// The swap interval of the frame that \c frame_callback is for.
+            EGLint callback_interval;
+
+            /**
+             * True if we've timed out waiting for \c frame_callback, and
+             * we're using a timer instead.
+             */
+            EGLBoolean use_timer;
+        } frame_throttle;
+
+        /**
+         * State for EGL_WAYLAND_DYNAMIC_RESOLUTION_NVX.
+         */
+        struct
+        {
+            /**
+             * The viewport that we use to scale up the buffers, or NULL if
+             * dynamic resolution isn't enabled.
+             */
+            struct wp_viewport *viewport;
+
+            /**
+             * The last size that we sent in wp_viewport::set_destination, or
+             * -1 if we haven't set one.
+             */
+            int32_t dest_width;
+            int32_t dest_height;
+
+            /// An index into RESOLUTION_SCALES.
+            uint32_t level;
+
+            /// The time that the last eglSwapBuffers call started.
+            uint64_t last_swap_time;
+
+            /// A running average of the time between eglSwapBuffers calls.
+            uint64_t avg_frame_time;
+
+            uint32_t slow_frames;
+            uint32_t ok_frames;
+            uint32_t frames_at_level;
+            uint32_t up_frames;
+            uint32_t cooldown;
+
+            /**
+             * The swapchain for the previous scale.
+             *
+             * When we change scales, we keep the old swapchain around so
+             * that if we switch back, we don't need to reallocate anything.
+             */
+            WlSwapChain *spare;
+        } dynres;
+
+        /**
+         * Tracks whether the window is idle, so that we can free buffers that
+         * it doesn't need.
+         */
+        struct
+        {
+            /// The time that the last eglSwapBuffers call started.
+            uint64_t last_swap_time;
+
+            /// The number of idle frames in a row.
+            uint32_t idle_swaps;
+
+            /// The time of the first frame in the current idle streak.
+            uint64_t idle_start;
+
+            /**
+             * True if we've already trimmed the swapchain during the current
+             * idle streak. We only trim once per streak, so that a window
+             * that keeps rendering while it's occluded doesn't free and
+             * reallocate a buffer on every frame.
+             */
+            EGLBoolean trimmed;
+        } activity;
+
         /**
          * A dma-buf feedback object for this surface.
          */
@@ -214,6 +734,40 @@ struct _EplImplSurface
          * to actually render anything.
          */
         EGLBoolean force_realloc;
+
+        /**
+         * A swapchain that we're building in the background after a resize
+         * or a dma-buf feedback change, or NULL.
+         *
+         * We keep presenting with the current swapchain until this one is
+         * ready, and then switch to it after a present. If the window was
+         * resized, then the viewport scales the old buffers to the new size
+         * in the meantime.
+         */
+        WlSwapChainBuild *pending_build;
+
+        /**
+         * A frame that eglSwapBuffers set aside as part of a present batch.
+         *
+         * eglEndPresentBatchNVX will wait for the surface's earlier frames
+         * and commit it, along with the other frames in the same batch. See
+         * EGL_NVX_wayland_present_batch.
+         */
+        struct
+        {
+            /// True if \c job is waiting to be committed.
+            EGLBoolean pending;
+
+            /// The ID of the batch that the frame belongs to.
+            uint64_t batch_id;
+
+            /**
+             * The frame to commit. The damage rectangles are stored in
+             * \c EplImplSurface::commit.rects, which is otherwise unused
+             * without a commit thread.
+             */
+            WlCommitJob job;
+        } batch;
     } current;
 
     /**
@@ -248,34 +802,225 @@ struct _EplImplSurface
          */
         EGLint pending_width;
         EGLint pending_height;
-    } params;
-};
-
 
-/**
- * Sets the surface's modifier list to use the modifiers from the default
- * dma-buf feedback.
- *
- * This is used as a fallback if we don't have per-surface feedback.
- */
-static void PickDefaultModifiers(EplSurface *psurf)
-{
-    const WlDmaBufFormat *driver_format = psurf->priv->driver_format;
-    const WlDmaBufFormat *server_format;
-    size_t i;
+        /**
+         * The number of frames that the compositor discarded without
+         * displaying, for EGL_WAYLAND_DROPPED_FRAMES_NVX.
+         *
+         * This lives here rather than in \c current so that the application
+         * can query it from any thread.
+         */
+        EGLint dropped_frames;
 
-    psurf->priv->current.num_surface_modifiers = 0;
+        /**
+         * The current render scale in percent. This is always 100 unless
+         * dynamic resolution is enabled.
+         */
+        uint32_t render_scale;
 
-    if (psurf->priv->inst->force_prime)
-    {
-        // If we have to use PRIME, then leave the modifier list empty. The
-        // present buffers will all be linear, and the render buffer only has
-        // to match the driver, not the server's support.
-        return;
-    }
+        /**
+         * The target time between frames in nanoseconds, or zero to just
+         * follow the swap interval.
+         */
+        uint64_t target_frame_duration;
 
-    server_format = eplWlDmaBufFormatFind(psurf->priv->inst->default_feedback->formats,
-            psurf->priv->inst->default_feedback->num_formats, psurf->priv->present_fourcc);
+        /**
+         * The total number of bytes that we've freed by trimming buffers from
+         * an idle window, for EGL_WAYLAND_RECLAIMED_MEMORY_NVX.
+         */
+        uint64_t reclaimed_bytes;
+
+        /**
+         * The number of bytes allocated for this surface's color buffers,
+         * for EGL_WAYLAND_SURFACE_MEMORY_NVX.
+         */
+        uint64_t memory_bytes;
+    } params;
+
+    /**
+     * State for the helper thread that commits frames once rendering has
+     * finished.
+     *
+     * This is only used if the display's \c use_async_commit flag is set.
+     *
+     * The commit queue holds at most one frame. Anything that touches the
+     * Wayland state in \c current has to call WaitForPendingCommit first,
+     * which ensures that frames are always committed in order.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_t thread;
+        EGLBoolean thread_started;
+
+        /// True if \c job is waiting to be (or is being) committed.
+        EGLBoolean pending;
+
+        /// Set to tell the helper thread to exit.
+        EGLBoolean quit;
+
+        WlCommitJob job;
+
+        /**
+         * A buffer to hold a copy of the damage rectangles, so that we don't
+         * need a new allocation for every frame.
+         */
+        EGLint *rects;
+        size_t rects_capacity;
+    } commit;
+
+    /**
+     * State for EGL_NVX_wayland_ready_fd.
+     *
+     * The helper thread is started the first time that the application
+     * queries EGL_WAYLAND_READY_FD_NVX. After that, it's armed at the end of
+     * each eglSwapBuffers call. While armed, it reads and dispatches events
+     * for the surface until the next eglSwapBuffers call wouldn't block, and
+     * then it signals \c event_fd.
+     *
+     * Anything that touches the Wayland state in \c current has to call
+     * PauseReadyWatch first, and ResumeReadyWatch afterward.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_t thread;
+        EGLBoolean thread_started;
+
+        /// True if the helper thread should be watching the surface.
+        EGLBoolean armed;
+
+        /// True while the helper thread is reading events for the surface.
+        EGLBoolean busy;
+
+        /// Set to tell the helper thread to exit.
+        EGLBoolean quit;
+
+        /// The eventfd that we hand out to the application.
+        int event_fd;
+
+        /// An eventfd to wake up the helper thread when it's waiting.
+        int wake_fd;
+
+        /**
+         * An eventfd that we register with drmSyncobjEventfd for the release
+         * points, or -1 if that's not available.
+         */
+        int release_fd;
+    } ready;
+
+    /**
+     * State for EGL_NVX_wayland_frame_capture.
+     *
+     * The application can set the callback and release frames from any
+     * thread, so everything here is protected by \c mutex. Only
+     * eglSwapBuffers touches the buffers themselves, though: A release just
+     * marks the entry in \c holds, and the next eglSwapBuffers call hands
+     * the buffer back to the swapchain.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+
+        PFNEGLWAYLANDCAPTURECALLBACKNVX callback;
+        void *user_data;
+
+        /**
+         * True while DeliverCaptureFrame is calling the callback, so that
+         * eglSetCaptureCallbackNVX can wait for it to return. \c cond is
+         * signaled when this goes back to false.
+         */
+        EGLBoolean delivering;
+        pthread_t delivery_thread;
+        pthread_cond_t cond;
+
+        WlCaptureHold holds[MAX_CAPTURE_HOLDS];
+
+        /// The capture ID for the next frame. Capture IDs start at 1.
+        uint64_t next_id;
+    } capture;
+
+    /**
+     * State for the helper thread that allocates new swapchains.
+     *
+     * The thread is started the first time that we need a new swapchain
+     * after creating the surface, and then it stays around until the surface
+     * is destroyed. It runs at most one WlSwapChainBuild at a time, which is
+     * always \c current.pending_build or a build that eglSwapBuffers will
+     * wait for after presenting.
+     */
+    struct
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        pthread_t thread;
+        EGLBoolean thread_started;
+
+        /// Set to tell the helper thread to exit.
+        EGLBoolean quit;
+
+        /// A build that the helper thread hasn't picked up yet, or NULL.
+        WlSwapChainBuild *job;
+    } builder;
+};
+
+static void WaitForPendingCommit(EplSurface *psurf);
+static void StopCommitThread(EplSurface *psurf);
+static void *CommitThreadProc(void *param);
+static void PauseReadyWatch(EplSurface *psurf);
+static void ResumeReadyWatch(EplSurface *psurf);
+static void StopReadyThread(EplSurface *psurf);
+static EGLBoolean FlushBatchedFrame(EplSurface *psurf);
+static void DropBatchedFrame(EplSurface *psurf);
+static EGLBoolean PrepareCaptureFrame(EplSurface *psurf, WlPresentBuffer *present_buf,
+        uint64_t present_id, EGLWaylandCaptureFrameNVX *frame);
+static void DeliverCaptureFrame(EplSurface *psurf, EGLWaylandCaptureFrameNVX *frame,
+        const EGLint *rects, EGLint n_rects);
+static void CaptureFrame(EplSurface *psurf, WlPresentBuffer *present_buf,
+        uint64_t present_id, int fence_fd, const EGLint *rects, EGLint n_rects);
+
+/**
+ * The present batch that the current thread started with
+ * eglBeginPresentBatchNVX.
+ *
+ * \c inst is NULL if the thread isn't in a batch.
+ */
+static __thread struct
+{
+    EGLDisplay edpy;
+    WlDisplayInstance *inst;
+    uint64_t id;
+} present_batch;
+
+static uint64_t next_present_batch_id = 1;
+
+
+/**
+ * Sets the surface's modifier list to use the modifiers from the default
+ * dma-buf feedback.
+ *
+ * This is used as a fallback if we don't have per-surface feedback.
+ */
+static void PickDefaultModifiers(EplSurface *psurf)
+{
+    const WlDmaBufFormat *driver_format = psurf->priv->driver_format;
+    const WlDmaBufFormat *server_format;
+    size_t i;
+
+    psurf->priv->current.num_surface_modifiers = 0;
+
+    if (psurf->priv->inst->force_prime)
+    {
+        // If we have to use PRIME, then leave the modifier list empty. The
+        // present buffers will all be linear, and the render buffer only has
+        // to match the driver, not the server's support.
+        return;
+    }
+
+    server_format = eplWlDmaBufFormatFind(psurf->priv->inst->default_feedback->formats,
+            psurf->priv->inst->default_feedback->num_formats, psurf->priv->present_fourcc);
 
     if (server_format == NULL)
     {
@@ -288,7 +1033,8 @@ static void PickDefaultModifiers(EplSurface *psurf)
 
     for (i=0; i<driver_format->num_modifiers; i++)
     {
-        if (eplWlDmaBufFormatSupportsModifier(server_format, driver_format->modifiers[i]))
+        if (eplWlFormatListHasModifier(psurf->priv->inst->default_feedback,
+                    server_format->fourcc, driver_format->modifiers[i]))
         {
             psurf->priv->current.surface_modifiers[psurf->priv->current.num_surface_modifiers++] = driver_format->modifiers[i];
         }
@@ -319,8 +1065,6 @@ static void OnSurfaceFeedbackTrancheFormats(void *userdata,
             struct wl_array *indices)
 {
     SurfaceFeedbackState *state = userdata;
-    EplSurface *psurf = state->psurf;
-    size_t i;
     uint16_t *index;
 
     if (state->base.error || state->base.format_table_len == 0 || SurfaceFeedbackHasModifiers(state))
@@ -328,30 +1072,81 @@ static void OnSurfaceFeedbackTrancheFormats(void *userdata,
         return;
     }
 
+    if (state->format_table_map == NULL)
+    {
+        return;
+    }
+
     wl_array_for_each(index, indices)
     {
+        int32_t slot;
+
         if (*index >= state->base.format_table_len)
         {
             continue;
         }
-        if (state->base.format_table[*index].fourcc != psurf->priv->present_fourcc)
+
+        slot = state->format_table_map[*index];
+        if (slot == FORMAT_TABLE_MAP_LINEAR)
+        {
+            state->tranche_linear_supported = EGL_TRUE;
+        }
+        else if (slot >= 0)
+        {
+            state->tranche_modifiers_supported[slot] = EGL_TRUE;
+        }
+    }
+}
+
+static void OnSurfaceFeedbackFormatTable(void *userdata,
+        struct zwp_linux_dmabuf_feedback_v1 *wfeedback,
+        int32_t fd, uint32_t size)
+{
+    SurfaceFeedbackState *state = userdata;
+    const WlDmaBufFormat *driver_format = state->psurf->priv->driver_format;
+    const WlFormatList *driver_formats = state->psurf->priv->inst->driver_formats;
+    size_t i;
+
+    eplWlDmaBufFeedbackCommonFormatTable(userdata, wfeedback, fd, size);
+
+    free(state->format_table_map);
+    state->format_table_map = NULL;
+
+    if (state->base.format_table_len == 0)
+    {
+        return;
+    }
+
+    state->format_table_map = malloc(state->base.format_table_len * sizeof(int32_t));
+    if (state->format_table_map == NULL)
+    {
+        state->base.error = EGL_TRUE;
+        return;
+    }
+
+    for (i=0; i<state->base.format_table_len; i++)
+    {
+        const WlDmaBufFeedbackTableEntry *entry = &state->base.format_table[i];
+
+        state->format_table_map[i] = FORMAT_TABLE_MAP_NONE;
+        if (entry->fourcc != state->psurf->priv->present_fourcc)
         {
             continue;
         }
-        if (state->base.format_table[*index].modifier == DRM_FORMAT_MOD_LINEAR)
+
+        if (entry->modifier == DRM_FORMAT_MOD_LINEAR)
         {
-            state->tranche_linear_supported = EGL_TRUE;
+            state->format_table_map[i] = FORMAT_TABLE_MAP_LINEAR;
+            continue;
         }
-        else
+
+        // The driver format's modifier indexes are the same as the slots
+        // in modifiers_supported.
+        state->format_table_map[i] = eplWlFormatListFindModifier(driver_formats,
+                driver_format->fourcc, entry->modifier);
+        if (state->format_table_map[i] < 0)
         {
-            for (i=0; i<psurf->priv->driver_format->num_modifiers; i++)
-            {
-                if (psurf->priv->driver_format->modifiers[i] == state->base.format_table[*index].modifier)
-                {
-                    state->tranche_modifiers_supported[i] = EGL_TRUE;
-                    break;
-                }
-            }
+            state->format_table_map[i] = FORMAT_TABLE_MAP_NONE;
         }
     }
 }
@@ -443,7 +1238,7 @@ static void OnSurfaceFeedbackDone(void *userdata,
 static const struct zwp_linux_dmabuf_feedback_v1_listener SURFACE_FEEDBACK_LISTENER =
 {
     OnSurfaceFeedbackDone,
-    eplWlDmaBufFeedbackCommonFormatTable,
+    OnSurfaceFeedbackFormatTable,
     eplWlDmaBufFeedbackCommonMainDevice,
     OnSurfaceFeedbackTrancheDone,
     eplWlDmaBufFeedbackCommonTrancheTargetDevice,
@@ -500,6 +1295,7 @@ static EGLBoolean CreateSurfaceFeedback(EplSurface *psurf)
     // Do a single round trip. The server should send a full batch of feedback
     // data, but if it doesn't, then the modifier list is already initialized
     // using the default feedback.
+    WL_STATS_DISPLAY_ADD(inst->stats, roundtrips, 1);
     if (wl_display_roundtrip_queue(inst->wdpy, psurf->priv->current.queue) < 0)
     {
         eplSetError(inst->platform, EGL_BAD_ALLOC, "Failed to read window system events");
@@ -519,155 +1315,575 @@ static void DestroySurfaceFeedback(EplSurface *psurf)
             zwp_linux_dmabuf_feedback_v1_destroy(psurf->priv->current.feedback->feedback);
         }
         eplWlDmaBufFeedbackCommonCleanup(&psurf->priv->current.feedback->base);
+        free(psurf->priv->current.feedback->format_table_map);
         free(psurf->priv->current.feedback);
         psurf->priv->current.feedback = NULL;
     }
 }
 
 /**
- * Checks if we need to allocate a new swapchain.
- *
- * If the current swapchain is not NULL, then this function will check to see
- * if it's still valid to use. If it is, then this function will return
- * EGL_TRUE, and will return NULL in \p ret_new_swapchain.
- *
- * \note This function must only be called during surface creation, or while
- * the surface is current.
+ * Decides whether a PRIME swapchain should render directly into its linear
+ * present buffers, instead of rendering into a separate buffer and copying.
  *
- * \param psurf The surface that we're allocating a swapchain for.
- * \param allow_modifier_realloc If true, then create a new swapchain with
- *      different format modifiers, even if the size hasn't changed.
- * \param[out] ret_new_swapchain Returns the new swapchain, or NULL if the
- *      current swapchain should still be used.
+ * Rendering into a linear sysmem buffer is slower than rendering into a tiled
+ * vidmem buffer, but for a small enough window, that costs less than the copy
+ * does.
+ */
+static EGLBoolean UsePrimeDirect(EplSurface *psurf, uint32_t width, uint32_t height)
+{
+    // A single-buffered surface has to render into the buffer that the
+    // compositor is displaying.
+    if (psurf->priv->single_buffer)
+    {
+        return EGL_TRUE;
+    }
+    return ((uint64_t) width) * height <= psurf->priv->inst->prime_direct_max_pixels;
+}
+
+/**
+ * Allocates the swapchain for a WlSwapChainBuild.
  *
- * \return EGL_TRUE on success, or EGL_FALSE on error.
+ * This is called from the build thread, or directly from StartSwapChainBuild
+ * if we're not using the build thread.
  */
-static EGLBoolean SwapChainRealloc(EplSurface *psurf,
-        EGLBoolean allow_modifier_realloc, WlSwapChain **ret_new_swapchain)
+static void RunSwapChainBuild(EplSurface *psurf, WlSwapChainBuild *build)
 {
-    const WlDmaBufFormat *driver_format = psurf->priv->driver_format;
-    WlSwapChain *swapchain = NULL;
-    uint32_t width, height;
-    EGLBoolean needs_new = EGL_FALSE;
-    EGLBoolean success = EGL_FALSE;
+    build->swapchain = eplWlSwapChainCreate(psurf->priv->inst, psurf->priv->current.wsurf,
+            build->width, build->height, psurf->priv->driver_format->fourcc,
+            psurf->priv->present_fourcc, build->prime, build->prime_direct,
+            build->modifiers, build->num_modifiers);
+}
 
-    pthread_mutex_lock(&psurf->priv->params.mutex);
-    width = psurf->priv->params.pending_width;
-    height = psurf->priv->params.pending_height;
-    pthread_mutex_unlock(&psurf->priv->params.mutex);
+static void *SwapChainBuildThreadProc(void *param)
+{
+    EplSurface *psurf = param;
+    EplImplSurface *priv = psurf->priv;
 
-    if (psurf->priv->current.swapchain == NULL || psurf->priv->current.force_realloc)
-    {
-        needs_new = EGL_TRUE;
-    }
-    else if (width != psurf->priv->current.swapchain->width
-            || height != psurf->priv->current.swapchain->height)
-    {
-        needs_new = EGL_TRUE;
-    }
-    else if (allow_modifier_realloc
-            && psurf->priv->current.feedback != NULL
-            && psurf->priv->current.feedback->feedback_update_count
-                != psurf->priv->current.swapchain->feedback_update_count)
+    pthread_mutex_lock(&priv->builder.mutex);
+    while (1)
     {
-        if (psurf->priv->current.swapchain->prime)
+        WlSwapChainBuild *build;
+
+        while (priv->builder.job == NULL && !priv->builder.quit)
         {
-            if (psurf->priv->current.num_surface_modifiers > 0)
-            {
-                // Transition from prime to direct
-                needs_new = EGL_TRUE;
-            }
+            pthread_cond_wait(&priv->builder.cond, &priv->builder.mutex);
         }
-        else
+        if (priv->builder.job == NULL)
         {
-            // We might need to transition from direct to either prime or
-            // direct with different modifiers.
-            size_t i;
-            needs_new = EGL_TRUE;
-            for (i=0; i<psurf->priv->current.num_surface_modifiers; i++)
-            {
-                if (psurf->priv->current.swapchain->modifier == psurf->priv->current.surface_modifiers[i])
-                {
-                    // The current modifier is still valid.
-                    needs_new = EGL_FALSE;
-                    break;
-                }
-            }
+            break;
         }
 
-        if (!needs_new)
-        {
-            // If the current modifier is still valid, then record the current
-            // feedback count so that we know not to check again next frame.
-            psurf->priv->current.swapchain->feedback_update_count =
-                psurf->priv->current.feedback->feedback_update_count;
-        }
+        build = priv->builder.job;
+        priv->builder.job = NULL;
+        pthread_mutex_unlock(&priv->builder.mutex);
+
+        RunSwapChainBuild(psurf, build);
+
+        pthread_mutex_lock(&priv->builder.mutex);
+        __atomic_store_n(&build->done, EGL_TRUE, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&priv->builder.cond);
     }
+    pthread_mutex_unlock(&priv->builder.mutex);
+
+    return NULL;
+}
 
-    if (needs_new)
+/**
+ * Starts the build thread, if it isn't already running.
+ */
+static EGLBoolean StartSwapChainBuildThread(EplSurface *psurf)
+{
+    if (!psurf->priv->builder.thread_started)
     {
-        if (psurf->priv->current.num_surface_modifiers > 0)
-        {
-            swapchain = eplWlSwapChainCreate(psurf->priv->inst, psurf->priv->current.wsurf,
-                    width, height, driver_format->fourcc, psurf->priv->present_fourcc, EGL_FALSE,
-                    psurf->priv->current.surface_modifiers,
-                    psurf->priv->current.num_surface_modifiers);
-        }
-        else
-        {
-            swapchain = eplWlSwapChainCreate(psurf->priv->inst, psurf->priv->current.wsurf,
-                    width, height, driver_format->fourcc, psurf->priv->present_fourcc, EGL_TRUE,
-                    driver_format->modifiers, driver_format->num_modifiers);
-        }
-        if (swapchain == NULL)
+        if (pthread_create(&psurf->priv->builder.thread, NULL,
+                    SwapChainBuildThreadProc, psurf) != 0)
         {
-            goto done;
-        }
-        if (psurf->priv->current.feedback != NULL)
-        {
-            // Record the current feedback update count. In SwapChainRealloc,
-            // we'll use this to check if we need to reallocate the swapchain
-            // with different modifiers.
-            swapchain->feedback_update_count = psurf->priv->current.feedback->feedback_update_count;
+            return EGL_FALSE;
         }
+        psurf->priv->builder.thread_started = EGL_TRUE;
     }
-
-    success = EGL_TRUE;
-
-done:
-    *ret_new_swapchain = swapchain;
-    return success;
+    return EGL_TRUE;
 }
 
-static void NativeResizeCallback(struct wl_egl_window *native, void *param)
+static void StopSwapChainBuildThread(EplSurface *psurf)
 {
-    EplSurface *psurf = param;
-    if (psurf == NULL || psurf->priv == NULL)
+    if (!psurf->priv->builder.thread_started)
     {
         return;
     }
 
-    if (native->width > 0 && native->height > 0)
-    {
-        pthread_mutex_lock(&psurf->priv->params.mutex);
-        psurf->priv->params.pending_width = native->width;
-        psurf->priv->params.pending_height = native->height;
-        pthread_mutex_unlock(&psurf->priv->params.mutex);
-    }
+    pthread_mutex_lock(&psurf->priv->builder.mutex);
+    psurf->priv->builder.quit = EGL_TRUE;
+    pthread_cond_broadcast(&psurf->priv->builder.cond);
+    pthread_mutex_unlock(&psurf->priv->builder.mutex);
+
+    pthread_join(psurf->priv->builder.thread, NULL);
+    psurf->priv->builder.thread_started = EGL_FALSE;
 }
 
-static void NativeDestroyWindowCallback(void *param)
+/**
+ * Starts allocating a new swapchain for the surface.
+ *
+ * \param psurf The surface.
+ * \param width The size of the new buffers.
+ * \param height The size of the new buffers.
+ * \param display_width The size that the compositor should display them at.
+ * \param display_height The size that the compositor should display them at.
+ * \param background If true, then allocate the swapchain on the build
+ *      thread. Otherwise, allocate it before returning.
+ *
+ * \return A WlSwapChainBuild, which the caller must pass to
+ *      FinishSwapChainBuild, or NULL if we ran out of memory.
+ */
+static WlSwapChainBuild *StartSwapChainBuild(EplSurface *psurf,
+        uint32_t width, uint32_t height, uint32_t display_width, uint32_t display_height,
+        EGLBoolean background)
 {
-    EplSurface *psurf = param;
-    if (psurf == NULL || psurf->priv == NULL)
+    const WlDmaBufFormat *driver_format = psurf->priv->driver_format;
+    WlSwapChainBuild *build;
+    const uint64_t *modifiers;
+
+    build = calloc(1, sizeof(WlSwapChainBuild));
+    if (build == NULL)
     {
-        return;
+        return NULL;
     }
 
-    pthread_mutex_lock(&psurf->priv->params.mutex);
-    psurf->priv->params.native_window = NULL;
-    pthread_mutex_unlock(&psurf->priv->params.mutex);
-}
+    build->width = width;
+    build->height = height;
+    build->display_width = display_width;
+    build->display_height = display_height;
+    if (psurf->priv->current.feedback != NULL)
+    {
+        build->feedback_update_count = psurf->priv->current.feedback->feedback_update_count;
+    }
+
+    if (psurf->priv->current.num_surface_modifiers > 0)
+    {
+        build->prime = EGL_FALSE;
+        modifiers = psurf->priv->current.surface_modifiers;
+        build->num_modifiers = psurf->priv->current.num_surface_modifiers;
+    }
+    else
+    {
+        build->prime = EGL_TRUE;
+        build->prime_direct = UsePrimeDirect(psurf, width, height);
+        modifiers = driver_format->modifiers;
+        build->num_modifiers = driver_format->num_modifiers;
+    }
+    if (build->num_modifiers > 0)
+    {
+        build->modifiers = malloc(build->num_modifiers * sizeof(uint64_t));
+        if (build->modifiers == NULL)
+        {
+            free(build);
+            return NULL;
+        }
+        memcpy(build->modifiers, modifiers, build->num_modifiers * sizeof(uint64_t));
+    }
+
+    if (background && psurf->priv->inst->use_async_swapchain
+            && StartSwapChainBuildThread(psurf))
+    {
+        pthread_mutex_lock(&psurf->priv->builder.mutex);
+        assert(psurf->priv->builder.job == NULL);
+        psurf->priv->builder.job = build;
+        build->queued = EGL_TRUE;
+        pthread_cond_broadcast(&psurf->priv->builder.cond);
+        pthread_mutex_unlock(&psurf->priv->builder.mutex);
+    }
+    else
+    {
+        RunSwapChainBuild(psurf, build);
+        build->done = EGL_TRUE;
+    }
+    return build;
+}
+
+/**
+ * Returns true if a swapchain build has finished, so that
+ * FinishSwapChainBuild won't block.
+ */
+static EGLBoolean IsSwapChainBuildDone(WlSwapChainBuild *build)
+{
+    return __atomic_load_n(&build->done, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Waits for a swapchain build to finish, and frees the WlSwapChainBuild.
+ *
+ * \return The new swapchain, or NULL if the allocation failed.
+ */
+static WlSwapChain *FinishSwapChainBuild(EplSurface *psurf, WlSwapChainBuild *build)
+{
+    WlSwapChain *swapchain;
+
+    if (build->queued && !IsSwapChainBuildDone(build))
+    {
+        WL_TRACE_BEGIN(trace);
+        pthread_mutex_lock(&psurf->priv->builder.mutex);
+        while (!build->done)
+        {
+            pthread_cond_wait(&psurf->priv->builder.cond, &psurf->priv->builder.mutex);
+        }
+        pthread_mutex_unlock(&psurf->priv->builder.mutex);
+        WL_TRACE_END(trace, "FinishSwapChainBuild");
+    }
+
+    swapchain = build->swapchain;
+    if (swapchain != NULL)
+    {
+        WL_STATS_SURFACE_ADD(psurf->priv->stats, swapchain_reallocs, 1);
+
+        // Record the feedback update count. In SwapChainRealloc, we'll use
+        // this to check if we need to reallocate the swapchain with different
+        // modifiers.
+        swapchain->feedback_update_count = build->feedback_update_count;
+        swapchain->display_width = build->display_width;
+        swapchain->display_height = build->display_height;
+        swapchain->min_repaint = (psurf->priv->buffer_selection
+                == EGL_WAYLAND_BUFFER_SELECTION_MIN_REPAINT_NVX);
+    }
+
+    free(build->modifiers);
+    free(build);
+    return swapchain;
+}
+
+/**
+ * Stops any background swapchain build, and frees the result.
+ *
+ * If the build thread hasn't started on it yet, then this just takes it back
+ * without waiting.
+ */
+static void CancelPendingSwapChainBuild(EplSurface *psurf)
+{
+    WlSwapChainBuild *build = psurf->priv->current.pending_build;
+
+    if (build != NULL)
+    {
+        pthread_mutex_lock(&psurf->priv->builder.mutex);
+        if (psurf->priv->builder.job == build)
+        {
+            psurf->priv->builder.job = NULL;
+            build->done = EGL_TRUE;
+        }
+        pthread_mutex_unlock(&psurf->priv->builder.mutex);
+
+        eplWlSwapChainDestroy(psurf->priv->inst, FinishSwapChainBuild(psurf, build));
+        psurf->priv->current.pending_build = NULL;
+    }
+}
+
+/**
+ * Returns true if we can keep presenting with the current swapchain while we
+ * build a new one with buffers of \p width by \p height.
+ *
+ * If the size is different, then that depends on having a viewport to scale
+ * the old buffers up or down to the new window size.
+ */
+static EGLBoolean CanPresentWhileBuilding(EplSurface *psurf, uint32_t width, uint32_t height)
+{
+    const WlSwapChain *swapchain = psurf->priv->current.swapchain;
+
+    if (swapchain == NULL || psurf->priv->current.force_realloc)
+    {
+        return EGL_FALSE;
+    }
+    return (psurf->priv->current.dynres.viewport != NULL
+            || (swapchain->width == width && swapchain->height == height));
+}
+
+/**
+ * Checks if we need to allocate a new swapchain.
+ *
+ * If the current swapchain is not NULL, then this function will check to see
+ * if it's still valid to use. If it is, then this function will return
+ * EGL_TRUE, and will return NULL in \p ret_new_swapchain.
+ *
+ * If \p ret_build is not NULL, then a new swapchain is allocated on the build
+ * thread, so that the caller can present with the current swapchain in the
+ * meantime:
+ * - Normally, the build is stored in \c EplImplSurface::current.pending_build,
+ *   and it can take as many frames as it needs. Until it's done, the caller
+ *   keeps presenting with the current swapchain, and if the window was
+ *   resized, then the viewport scales it to the new size. Once the build is
+ *   done, a later call returns it in \p ret_new_swapchain.
+ * - If we can't present with the current swapchain until then, because the
+ *   size changed and we don't have a viewport, then this returns the build
+ *   in \p ret_build, and the caller must pass it to FinishSwapChainBuild
+ *   after presenting.
+ *
+ * \note This function must only be called during surface creation, or while
+ * the surface is current.
+ *
+ * \param psurf The surface that we're allocating a swapchain for.
+ * \param allow_modifier_realloc If true, then create a new swapchain with
+ *      different format modifiers, even if the size hasn't changed.
+ * \param[out] ret_new_swapchain Returns the new swapchain, or NULL if the
+ *      current swapchain should still be used.
+ * \param[out] ret_build If not NULL, returns a swapchain that's still being
+ *      allocated, or NULL.
+ *
+ * \return EGL_TRUE on success, or EGL_FALSE on error.
+ */
+static EGLBoolean SwapChainRealloc(EplSurface *psurf,
+        EGLBoolean allow_modifier_realloc, WlSwapChain **ret_new_swapchain,
+        WlSwapChainBuild **ret_build)
+{
+    WlSwapChain *swapchain = NULL;
+    WlSwapChainBuild *build = NULL;
+    uint32_t width, height;
+    uint32_t display_width, display_height;
+    uint32_t scale;
+    EGLBoolean needs_new = EGL_FALSE;
+    EGLBoolean modifier_change = EGL_FALSE;
+    EGLBoolean background = (ret_build != NULL);
+    EGLBoolean success = EGL_FALSE;
+    WL_TRACE_BEGIN(trace);
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    display_width = psurf->priv->params.pending_width;
+    display_height = psurf->priv->params.pending_height;
+    scale = psurf->priv->params.render_scale;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    width = display_width;
+    height = display_height;
+    if (scale < 100)
+    {
+        width = (width * scale + 50) / 100;
+        height = (height * scale + 50) / 100;
+        width = (width > 0 ? width : 1);
+        height = (height > 0 ? height : 1);
+    }
+
+    if (psurf->priv->current.swapchain == NULL || psurf->priv->current.force_realloc)
+    {
+        needs_new = EGL_TRUE;
+    }
+    else if (width != psurf->priv->current.swapchain->width
+            || height != psurf->priv->current.swapchain->height)
+    {
+        needs_new = EGL_TRUE;
+    }
+    else if (allow_modifier_realloc
+            && psurf->priv->current.feedback != NULL
+            && psurf->priv->current.feedback->feedback_update_count
+                != psurf->priv->current.swapchain->feedback_update_count)
+    {
+        if (psurf->priv->current.swapchain->prime)
+        {
+            if (psurf->priv->current.num_surface_modifiers > 0)
+            {
+                // Transition from prime to direct
+                needs_new = EGL_TRUE;
+            }
+        }
+        else
+        {
+            // We might need to transition from direct to either prime or
+            // direct with different modifiers.
+            size_t i;
+            needs_new = EGL_TRUE;
+            for (i=0; i<psurf->priv->current.num_surface_modifiers; i++)
+            {
+                if (psurf->priv->current.swapchain->modifier == psurf->priv->current.surface_modifiers[i])
+                {
+                    // The current modifier is still valid.
+                    needs_new = EGL_FALSE;
+                    break;
+                }
+            }
+        }
+
+        if (!needs_new)
+        {
+            // If the current modifier is still valid, then record the current
+            // feedback count so that we know not to check again next frame.
+            psurf->priv->current.swapchain->feedback_update_count =
+                psurf->priv->current.feedback->feedback_update_count;
+        }
+        modifier_change = needs_new;
+    }
+
+    if (psurf->priv->current.pending_build != NULL && (needs_new || background))
+    {
+        WlSwapChainBuild *pending = psurf->priv->current.pending_build;
+
+        if (background && !IsSwapChainBuildDone(pending)
+                && CanPresentWhileBuilding(psurf, width, height))
+        {
+            // Keep presenting with the current swapchain until the new one is
+            // ready. If the window was resized again, then the viewport
+            // scales the current buffers to the latest size.
+            psurf->priv->current.swapchain->display_width = display_width;
+            psurf->priv->current.swapchain->display_height = display_height;
+            success = EGL_TRUE;
+            goto done;
+        }
+
+        psurf->priv->current.pending_build = NULL;
+        swapchain = FinishSwapChainBuild(psurf, pending);
+        if (swapchain == NULL)
+        {
+            if (modifier_change)
+            {
+                // We couldn't allocate the new swapchain, but the current one
+                // still works, so keep using it until the feedback changes
+                // again.
+                psurf->priv->current.swapchain->feedback_update_count =
+                    psurf->priv->current.feedback->feedback_update_count;
+                needs_new = EGL_FALSE;
+            }
+        }
+        else if (!needs_new || (psurf->priv->current.dynres.viewport == NULL
+                    && (swapchain->width != width || swapchain->height != height)))
+        {
+            // Either the window size or the feedback changed back, so we
+            // don't need a new swapchain after all, or the window was resized
+            // again, and we can't scale this one to the new size.
+            eplWlSwapChainDestroy(psurf->priv->inst, swapchain);
+            swapchain = NULL;
+        }
+    }
+
+    if (!needs_new)
+    {
+        // If only the window size changed, but we ended up with the same
+        // scaled size, then we can keep the same buffers and just change the
+        // viewport.
+        psurf->priv->current.swapchain->display_width = display_width;
+        psurf->priv->current.swapchain->display_height = display_height;
+    }
+    else if (swapchain != NULL)
+    {
+        // This is a background build that finished. If the window was
+        // resized since we started it, then the viewport will scale it, and
+        // the next call will start another build.
+        swapchain->display_width = display_width;
+        swapchain->display_height = display_height;
+    }
+    else if (psurf->priv->current.dynres.spare != NULL)
+    {
+        WlSwapChain *spare = psurf->priv->current.dynres.spare;
+        psurf->priv->current.dynres.spare = NULL;
+
+        if (!psurf->priv->current.force_realloc
+                && spare->width == width && spare->height == height
+                && spare->prime == (psurf->priv->current.num_surface_modifiers == 0)
+                && (psurf->priv->current.feedback == NULL
+                    || spare->feedback_update_count == psurf->priv->current.feedback->feedback_update_count)
+                && eplWlSwapChainReuse(psurf->priv->inst, spare))
+        {
+            swapchain = spare;
+            swapchain->display_width = display_width;
+            swapchain->display_height = display_height;
+        }
+        else
+        {
+            eplWlSwapChainDestroy(psurf->priv->inst, spare);
+        }
+    }
+
+    if (needs_new && swapchain == NULL)
+    {
+        build = StartSwapChainBuild(psurf, width, height, display_width, display_height,
+                background);
+        if (build == NULL)
+        {
+            goto done;
+        }
+
+        if (modifier_change)
+        {
+            eplWlPerfWarning(psurf->priv->inst->platform, WL_PERF_WARNING_MODIFIER_REALLOC,
+                    "The compositor's dma-buf feedback changed, so the color buffers are reallocated");
+        }
+
+        if (!background)
+        {
+            swapchain = FinishSwapChainBuild(psurf, build);
+            build = NULL;
+            if (swapchain == NULL)
+            {
+                goto done;
+            }
+        }
+        else if (!IsSwapChainBuildDone(build) && CanPresentWhileBuilding(psurf, width, height))
+        {
+            psurf->priv->current.pending_build = build;
+            build = NULL;
+            psurf->priv->current.swapchain->display_width = display_width;
+            psurf->priv->current.swapchain->display_height = display_height;
+        }
+    }
+
+    success = EGL_TRUE;
+
+done:
+    *ret_new_swapchain = swapchain;
+    if (ret_build != NULL)
+    {
+        *ret_build = build;
+    }
+    WL_TRACE_END(trace, "SwapChainRealloc");
+    return success;
+}
+
+static void NativeResizeCallback(struct wl_egl_window *native, void *param)
+{
+    EplSurface *psurf = param;
+    if (psurf == NULL || psurf->priv == NULL)
+    {
+        return;
+    }
+
+    if (native->width > 0 && native->height > 0)
+    {
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        psurf->priv->params.pending_width = native->width;
+        psurf->priv->params.pending_height = native->height;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+    }
+}
+
+static void NativeDestroyWindowCallback(void *param)
+{
+    EplSurface *psurf = param;
+    if (psurf == NULL || psurf->priv == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    psurf->priv->params.native_window = NULL;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+}
+
+/**
+ * Updates the memory usage that we report for EGL_WAYLAND_SURFACE_MEMORY_NVX.
+ *
+ * This should be called after anything that might allocate or free a color
+ * buffer.
+ */
+static void UpdateMemoryUsage(EplSurface *psurf)
+{
+    uint64_t bytes = 0;
+
+    if (psurf->priv->current.swapchain != NULL)
+    {
+        bytes += eplWlSwapChainGetMemoryUsage(psurf->priv->current.swapchain);
+    }
+    if (psurf->priv->current.dynres.spare != NULL)
+    {
+        bytes += eplWlSwapChainGetMemoryUsage(psurf->priv->current.dynres.spare);
+    }
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    psurf->priv->params.memory_bytes = bytes;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+}
 
 static void SetWindowSwapchain(EplSurface *psurf, WlSwapChain *swapchain)
 {
@@ -676,11 +1892,31 @@ static void SetWindowSwapchain(EplSurface *psurf, WlSwapChain *swapchain)
         GL_BACK, (EGLAttrib) swapchain->render_buffer,
         EGL_NONE
     };
+
+    // Make sure the helper thread is done with the old swapchain before we
+    // free it, and that we've committed any frame that's waiting for a
+    // present batch.
+    WaitForPendingCommit(psurf);
+    FlushBatchedFrame(psurf);
     if (psurf->priv->inst->platform->priv->egl.PlatformSetColorBuffersNVX(
                 psurf->priv->inst->internal_display->edpy,
                 psurf->internal_surface, buffers))
     {
-        eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.swapchain);
+        WlSwapChain *old = psurf->priv->current.swapchain;
+
+        if (old != NULL && psurf->priv->current.dynres.viewport != NULL
+                && old->display_width == swapchain->display_width
+                && old->display_height == swapchain->display_height)
+        {
+            // This is just a change in the render scale, so hang on to the
+            // old swapchain in case we switch back to it.
+            eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.dynres.spare);
+            psurf->priv->current.dynres.spare = old;
+        }
+        else
+        {
+            eplWlSwapChainDestroy(psurf->priv->inst, old);
+        }
         psurf->priv->current.swapchain = swapchain;
         psurf->priv->current.force_realloc = EGL_FALSE;
     }
@@ -690,6 +1926,7 @@ static void SetWindowSwapchain(EplSurface *psurf, WlSwapChain *swapchain)
         eplWlSwapChainDestroy(psurf->priv->inst, swapchain);
         psurf->priv->current.force_realloc = EGL_TRUE;
     }
+    UpdateMemoryUsage(psurf);
 }
 
 static void WindowUpdateCallback(void *param)
@@ -706,15 +1943,14 @@ static void WindowUpdateCallback(void *param)
     }
     pthread_mutex_unlock(&psurf->priv->params.mutex);
 
-    if (!SwapChainRealloc(psurf, EGL_FALSE, &swapchain))
-    {
-        return;
-    }
+    PauseReadyWatch(psurf);
 
-    if (swapchain != NULL)
+    if (SwapChainRealloc(psurf, EGL_FALSE, &swapchain, NULL) && swapchain != NULL)
     {
         SetWindowSwapchain(psurf, swapchain);
     }
+
+    ResumeReadyWatch(psurf);
 }
 
 static uint32_t FindOpaqueFormat(const EplFormatInfo *fmt)
@@ -765,6 +2001,11 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
     EGLAttrib *driverAttribs = NULL;
     EGLint numAttribs = eplCountAttribs(attribs);
     EGLBoolean presentOpaque = EGL_FALSE;
+    EGLint presentMode = EGL_WAYLAND_PRESENT_MODE_FIFO_NVX;
+    EGLint bufferSelection = EGL_WAYLAND_BUFFER_SELECTION_FIRST_NVX;
+    EGLBoolean singleBuffer = EGL_FALSE;
+    EGLBoolean dynamicResolution = EGL_FALSE;
+    EGLint targetFrameDuration = 0;
     EGLAttrib platformAttribs[] =
     {
         GL_BACK, 0,
@@ -836,17 +2077,47 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
                 eplSetError(plat, EGL_BAD_ATTRIBUTE, "Invalid attribute 0x%04x\n", attribs[i]);
                 goto done;
             }
-            else if (attribs[i] == EGL_RENDER_BUFFER)
+            else if (attribs[i] == EGL_WAYLAND_PRESENT_MODE_NVX)
             {
-                if (attribs[i + 1] == EGL_SINGLE_BUFFER)
+                if (attribs[i + 1] != EGL_WAYLAND_PRESENT_MODE_FIFO_NVX
+                        && attribs[i + 1] != EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX)
                 {
-                    /*
-                     * Wayland doesn't allow front-buffered rendering, but this
-                     * attribute is only a hint. So, issue a warning, but don't
-                     * treat it as an error.
-                     */
-                    plat->callbacks.debugMessage(EGL_DEBUG_MSG_WARN_KHR,
-                            "EGL_SINGLE_BUFFER requested, but Wayland does not support front-buffered rendering");
+                    eplSetError(plat, EGL_BAD_ATTRIBUTE,
+                            "Invalid EGL_WAYLAND_PRESENT_MODE_NVX value 0x%04x", attribs[i + 1]);
+                    goto done;
+                }
+                presentMode = (EGLint) attribs[i + 1];
+            }
+            else if (attribs[i] == EGL_WAYLAND_BUFFER_SELECTION_NVX)
+            {
+                if (attribs[i + 1] != EGL_WAYLAND_BUFFER_SELECTION_FIRST_NVX
+                        && attribs[i + 1] != EGL_WAYLAND_BUFFER_SELECTION_MIN_REPAINT_NVX)
+                {
+                    eplSetError(plat, EGL_BAD_ATTRIBUTE,
+                            "Invalid EGL_WAYLAND_BUFFER_SELECTION_NVX value 0x%04x", attribs[i + 1]);
+                    goto done;
+                }
+                bufferSelection = (EGLint) attribs[i + 1];
+            }
+            else if (attribs[i] == EGL_WAYLAND_DYNAMIC_RESOLUTION_NVX)
+            {
+                dynamicResolution = (attribs[i + 1] != 0);
+            }
+            else if (attribs[i] == EGL_WAYLAND_TARGET_FRAME_DURATION_NVX)
+            {
+                if (attribs[i + 1] < 0)
+                {
+                    eplSetError(plat, EGL_BAD_ATTRIBUTE,
+                            "Invalid EGL_WAYLAND_TARGET_FRAME_DURATION_NVX value %d", (int) attribs[i + 1]);
+                    goto done;
+                }
+                targetFrameDuration = (EGLint) attribs[i + 1];
+            }
+            else if (attribs[i] == EGL_RENDER_BUFFER)
+            {
+                if (attribs[i + 1] == EGL_SINGLE_BUFFER)
+                {
+                    singleBuffer = EGL_TRUE;
                 }
                 else if (attribs[i + 1] != EGL_BACK_BUFFER)
                 {
@@ -883,6 +2154,102 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
         eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal mutex");
         goto done;
     }
+    if (pthread_mutex_init(&priv->commit.mutex, NULL) != 0)
+    {
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal mutex");
+        goto done;
+    }
+    if (pthread_cond_init(&priv->commit.cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal condition variable");
+        goto done;
+    }
+    if (pthread_mutex_init(&priv->ready.mutex, NULL) != 0)
+    {
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal mutex");
+        goto done;
+    }
+    if (pthread_cond_init(&priv->ready.cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&priv->ready.mutex);
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal condition variable");
+        goto done;
+    }
+    if (pthread_mutex_init(&priv->capture.mutex, NULL) != 0)
+    {
+        pthread_cond_destroy(&priv->ready.cond);
+        pthread_mutex_destroy(&priv->ready.mutex);
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal mutex");
+        goto done;
+    }
+    if (pthread_cond_init(&priv->capture.cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&priv->capture.mutex);
+        pthread_cond_destroy(&priv->ready.cond);
+        pthread_mutex_destroy(&priv->ready.mutex);
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal condition variable");
+        goto done;
+    }
+    if (pthread_mutex_init(&priv->builder.mutex, NULL) != 0)
+    {
+        pthread_cond_destroy(&priv->capture.cond);
+        pthread_mutex_destroy(&priv->capture.mutex);
+        pthread_cond_destroy(&priv->ready.cond);
+        pthread_mutex_destroy(&priv->ready.mutex);
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal mutex");
+        goto done;
+    }
+    if (pthread_cond_init(&priv->builder.cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&priv->builder.mutex);
+        pthread_cond_destroy(&priv->capture.cond);
+        pthread_mutex_destroy(&priv->capture.mutex);
+        pthread_cond_destroy(&priv->ready.cond);
+        pthread_mutex_destroy(&priv->ready.mutex);
+        pthread_cond_destroy(&priv->commit.cond);
+        pthread_mutex_destroy(&priv->commit.mutex);
+        pthread_mutex_destroy(&priv->params.mutex);
+        free(priv);
+        priv = NULL;
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal condition variable");
+        goto done;
+    }
+    priv->ready.event_fd = -1;
+    priv->ready.wake_fd = -1;
+    priv->ready.release_fd = -1;
+    priv->capture.next_id = 1;
 
     psurf->priv = priv;
     priv->current.surface_modifiers = (uint64_t *) (priv + 1);
@@ -890,7 +2257,9 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
     // Until we get a wp_presentation_feedback::presented event, start by
     // assuming a refresh rate of 60 Hz.
     priv->current.last_present_refresh = (1000000000 / 60);
+    priv->current.frame_throttle.refresh_estimate = (1000000000 / 60);
     priv->inst = eplWlDisplayInstanceRef(inst);
+    priv->stats = eplWlStatsAddSurface(inst->stats, wsurf_id);
 
     if (plat->priv->wl.display_create_queue_with_name != NULL)
     {
@@ -916,9 +2285,20 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
     }
     wl_proxy_set_queue((struct wl_proxy *) priv->current.wsurf, priv->current.queue);
 
+    priv->current.wdpy = wl_proxy_create_wrapper(inst->wdpy);
+    if (priv->current.wdpy == NULL)
+    {
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create internal wl_display wrapper");
+        goto done;
+    }
+    wl_proxy_set_queue((struct wl_proxy *) priv->current.wdpy, priv->current.queue);
+
     priv->native_window_version = windowVersion;
     priv->driver_format = driver_format;
     priv->present_fourcc = driver_format->fourcc;
+    priv->present_mode = presentMode;
+    priv->buffer_selection = bufferSelection;
+    priv->single_buffer = singleBuffer;
     if (presentOpaque)
     {
         priv->present_fourcc = FindOpaqueFormat(driver_format->fmt);
@@ -935,6 +2315,8 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
     priv->params.swap_interval = 1;
     priv->params.pending_width = (window->width > 0 ? window->width : 1);
     priv->params.pending_height = (window->height > 0 ? window->height : 1);
+    priv->params.render_scale = 100;
+    priv->params.target_frame_duration = targetFrameDuration;
 
     if (inst->globals.syncobj != NULL)
     {
@@ -943,9 +2325,16 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
         {
             goto done;
         }
+        if (singleBuffer && !eplWlTimelineInit(inst, &priv->current.single_release))
+        {
+            eplSetError(plat, EGL_BAD_ALLOC, "Failed to create release timeline");
+            goto done;
+        }
     }
 
-    if (inst->globals.fifo != NULL && inst->globals.presentation_time != NULL)
+    // We use presentation feedback to track present IDs and count dropped
+    // frames, so we want it even if we don't have wp_fifo_v1.
+    if (inst->globals.presentation_time != NULL)
     {
         priv->current.presentation_time = wl_proxy_create_wrapper(inst->globals.presentation_time);
         if (priv->current.presentation_time == NULL)
@@ -954,7 +2343,10 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
             goto done;
         }
         wl_proxy_set_queue((struct wl_proxy *) priv->current.presentation_time, priv->current.queue);
+    }
 
+    if (inst->globals.fifo != NULL && priv->current.presentation_time != NULL)
+    {
         priv->current.fifo = wp_fifo_manager_v1_get_fifo(inst->globals.fifo, priv->current.wsurf);
         if (priv->current.fifo == NULL)
         {
@@ -971,6 +2363,46 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
         }
     }
 
+    if (inst->globals.tearing_control != NULL)
+    {
+        priv->current.tearing_control = wp_tearing_control_manager_v1_get_tearing_control(
+                inst->globals.tearing_control, priv->current.wsurf);
+        if (priv->current.tearing_control == NULL)
+        {
+            goto done;
+        }
+        priv->current.tearing_hint = WP_TEARING_CONTROL_V1_PRESENTATION_HINT_VSYNC;
+    }
+
+    priv->current.dynres.dest_width = -1;
+    priv->current.dynres.dest_height = -1;
+    priv->current.dynres.up_frames = RESOLUTION_UP_FRAMES;
+    if (dynamicResolution && singleBuffer)
+    {
+        // Switching render sizes needs a second set of buffers, which defeats
+        // the point of EGL_SINGLE_BUFFER.
+        plat->callbacks.debugMessage(EGL_DEBUG_MSG_WARN_KHR,
+                "EGL_WAYLAND_DYNAMIC_RESOLUTION_NVX is ignored for EGL_SINGLE_BUFFER surfaces");
+    }
+    else if (dynamicResolution)
+    {
+        if (inst->globals.viewporter != NULL)
+        {
+            priv->current.dynres.viewport = wp_viewporter_get_viewport(inst->globals.viewporter,
+                    priv->current.wsurf);
+            if (priv->current.dynres.viewport == NULL)
+            {
+                goto done;
+            }
+        }
+        else
+        {
+            // This is only a hint, so don't treat it as an error.
+            plat->callbacks.debugMessage(EGL_DEBUG_MSG_WARN_KHR,
+                    "EGL_WAYLAND_DYNAMIC_RESOLUTION_NVX requested, but the compositor does not support wp_viewporter");
+        }
+    }
+
     // Initialize the modifier list based on the default modifiers.
     PickDefaultModifiers(psurf);
     if (psurf->priv->current.num_surface_modifiers == 0)
@@ -982,7 +2414,8 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
         const WlDmaBufFormat *server_format = eplWlDmaBufFormatFind(psurf->priv->inst->default_feedback->formats,
                 psurf->priv->inst->default_feedback->num_formats, psurf->priv->present_fourcc);
         if (server_format == NULL
-                || !eplWlDmaBufFormatSupportsModifier(server_format, DRM_FORMAT_MOD_LINEAR))
+                || !eplWlFormatListHasModifier(psurf->priv->inst->default_feedback,
+                    server_format->fourcc, DRM_FORMAT_MOD_LINEAR))
         {
             /*
              * If the app set the EGL_PRESENT_OPAQUE_EXT, then the format we're
@@ -1010,12 +2443,23 @@ EGLSurface eplWlCreateWindowSurface(EplPlatformData *plat, EplDisplay *pdpy, Epl
 
     // Now that we've got our format modifier list, allocate the initial
     // swapchain.
-    if (!SwapChainRealloc(psurf, EGL_FALSE, &priv->current.swapchain))
+    if (!SwapChainRealloc(psurf, EGL_FALSE, &priv->current.swapchain, NULL))
     {
         eplSetError(plat, EGL_BAD_ALLOC, "Failed to create color buffers");
         goto done;
     }
     assert(priv->current.swapchain != NULL);
+    UpdateMemoryUsage(psurf);
+
+    if (inst->use_async_commit)
+    {
+        if (pthread_create(&priv->commit.thread, NULL, CommitThreadProc, psurf) != 0)
+        {
+            eplSetError(plat, EGL_BAD_ALLOC, "Failed to create commit thread");
+            goto done;
+        }
+        priv->commit.thread_started = EGL_TRUE;
+    }
 
     /*
      * Note that we don't need any internal attributes here. The
@@ -1050,6 +2494,8 @@ done:
 void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
             const struct glvnd_list *existing_surfaces)
 {
+    size_t i;
+
     if (psurf->priv == NULL)
     {
         assert(psurf->internal_surface == EGL_NO_SURFACE);
@@ -1057,6 +2503,15 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
     }
     assert(psurf->type == EPL_SURFACE_TYPE_WINDOW);
 
+    // Flush out any pending frame and shut down the helper threads before we
+    // start tearing anything else down.
+    StopReadyThread(psurf);
+    StopCommitThread(psurf);
+    // If a frame is still waiting for a present batch, then just throw it
+    // away. Committing it would mean throttling and pacing it, which could
+    // block for a frame or more, only to tear the surface down right after.
+    DropBatchedFrame(psurf);
+
     if (psurf->internal_surface != EGL_NO_SURFACE)
     {
         /*
@@ -1084,10 +2539,14 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
         psurf->priv->params.native_window->driver_private = NULL;
     }
 
+    CancelPendingSwapChainBuild(psurf);
+    StopSwapChainBuildThread(psurf);
     if (psurf->priv->current.swapchain != NULL)
     {
         eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.swapchain);
     }
+    eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.dynres.spare);
+    eplWlTimelineDestroy(psurf->priv->inst, &psurf->priv->current.single_release);
 
     DestroySurfaceFeedback(psurf);
 
@@ -1097,6 +2556,10 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
         {
             wl_proxy_wrapper_destroy(psurf->priv->current.wsurf);
         }
+        if (psurf->priv->current.wdpy != NULL)
+        {
+            wl_proxy_wrapper_destroy(psurf->priv->current.wdpy);
+        }
         if (psurf->priv->current.syncobj != NULL)
         {
             wp_linux_drm_syncobj_surface_v1_destroy(psurf->priv->current.syncobj);
@@ -1109,9 +2572,12 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
         {
             wl_callback_destroy(psurf->priv->current.last_swap_sync);
         }
-        if (psurf->priv->current.presentation_feedback != NULL)
+        for (i=0; i<MAX_FRAME_FEEDBACK; i++)
         {
-            wp_presentation_feedback_destroy(psurf->priv->current.presentation_feedback);
+            if (psurf->priv->current.frame_feedback[i].feedback != NULL)
+            {
+                wp_presentation_feedback_destroy(psurf->priv->current.frame_feedback[i].feedback);
+            }
         }
         if (psurf->priv->current.fifo != NULL)
         {
@@ -1121,6 +2587,14 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
         {
             wp_commit_timer_v1_destroy(psurf->priv->current.commit_timer);
         }
+        if (psurf->priv->current.tearing_control != NULL)
+        {
+            wp_tearing_control_v1_destroy(psurf->priv->current.tearing_control);
+        }
+        if (psurf->priv->current.dynres.viewport != NULL)
+        {
+            wp_viewport_destroy(psurf->priv->current.dynres.viewport);
+        }
         if (psurf->priv->current.presentation_time != NULL)
         {
             wl_proxy_wrapper_destroy(psurf->priv->current.presentation_time);
@@ -1132,7 +2606,25 @@ void eplWlDestroyWindow(EplDisplay *pdpy, EplSurface *psurf,
     }
 
     pthread_mutex_destroy(&psurf->priv->params.mutex);
+    pthread_mutex_destroy(&psurf->priv->commit.mutex);
+    pthread_cond_destroy(&psurf->priv->commit.cond);
+    free(psurf->priv->commit.rects);
+    pthread_mutex_destroy(&psurf->priv->ready.mutex);
+    pthread_cond_destroy(&psurf->priv->ready.cond);
+    for (i=0; i<MAX_CAPTURE_HOLDS; i++)
+    {
+        if (psurf->priv->capture.holds[i].released
+                && psurf->priv->capture.holds[i].release_fd >= 0)
+        {
+            close(psurf->priv->capture.holds[i].release_fd);
+        }
+    }
+    pthread_mutex_destroy(&psurf->priv->capture.mutex);
+    pthread_cond_destroy(&psurf->priv->capture.cond);
+    pthread_mutex_destroy(&psurf->priv->builder.mutex);
+    pthread_cond_destroy(&psurf->priv->builder.cond);
 
+    eplWlStatsRemoveSurface(psurf->priv->stats);
     eplWlDisplayInstanceUnref(psurf->priv->inst);
     free(psurf->priv);
     psurf->priv = NULL;
@@ -1144,11 +2636,41 @@ static void on_frame_done(void *userdata, struct wl_callback *callback, uint32_t
 
     if (psurf->priv->current.frame_callback == callback)
     {
+        uint32_t delta = callback_data - psurf->priv->current.frame_throttle.last_callback_time;
+        EGLint interval = psurf->priv->current.frame_throttle.callback_interval;
+        uint64_t period;
+
         psurf->priv->current.frame_callback = NULL;
+
+        // The callback timestamps should be about one frame apart, which is
+        // the swap interval times the refresh period. Divide that back out
+        // to estimate the refresh period for the timer, which multiplies by
+        // the swap interval again. We only need a rough number for this.
+        period = ((uint64_t) delta) * 1000000 / (interval > 1 ? interval : 1);
+        if (!psurf->priv->current.frame_throttle.use_timer
+                && psurf->priv->current.frame_throttle.last_callback_time != 0
+                && period >= FRAME_CALLBACK_MIN_PERIOD * 1000000
+                && period <= FRAME_CALLBACK_MAX_PERIOD * 1000000)
+        {
+            psurf->priv->current.frame_throttle.refresh_estimate =
+                (psurf->priv->current.frame_throttle.refresh_estimate * 7 + period) / 8;
+        }
+        psurf->priv->current.frame_throttle.last_callback_time = callback_data;
+
+        // The window is visible again, so go back to using frame callbacks.
+        psurf->priv->current.frame_throttle.use_timer = EGL_FALSE;
     }
     if (psurf->priv->current.last_swap_sync == callback)
     {
         psurf->priv->current.last_swap_sync = NULL;
+
+        // Without presentation-time, this is as close as we can get to
+        // knowing when a frame is finished.
+        if (psurf->priv->current.presentation_time == NULL
+                && psurf->priv->current.last_swap_sync_id > psurf->priv->current.completed_present_id)
+        {
+            psurf->priv->current.completed_present_id = psurf->priv->current.last_swap_sync_id;
+        }
     }
     wl_callback_destroy(callback);
 }
@@ -1158,40 +2680,140 @@ static void on_wp_presentation_feedback_sync_output(void *userdata,
         struct wp_presentation_feedback *wfeedback, struct wl_output *output)
 {
 }
-static void DiscardPresentationFeedback(EplSurface *psurf)
+
+/**
+ * Counts a frame that was never displayed, for EGL_WAYLAND_DROPPED_FRAMES_NVX
+ * and the live counters.
+ */
+static void CountDiscardedFrame(EplSurface *psurf)
+{
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    psurf->priv->params.dropped_frames++;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+    WL_STATS_SURFACE_ADD(psurf->priv->stats, discarded_frames, 1);
+}
+
+/**
+ * Records that a frame has been displayed or discarded, and cleans up its
+ * feedback object.
+ */
+static void FinishFrameFeedback(WlFrameFeedback *frame)
+{
+    EplSurface *psurf = frame->psurf;
+
+    if (frame->present_id > psurf->priv->current.completed_present_id)
+    {
+        psurf->priv->current.completed_present_id = frame->present_id;
+    }
+
+    wp_presentation_feedback_destroy(frame->feedback);
+    frame->feedback = NULL;
+}
+static void on_wp_presentation_feedback_discarded(void *userdata,
+        struct wp_presentation_feedback *wfeedback)
 {
+    WlFrameFeedback *frame = userdata;
+    EplSurface *psurf = frame->psurf;
     struct timespec ts;
+
+    assert(wfeedback == frame->feedback);
+
+    // Use the current time as the last presentation time.
     if (clock_gettime(psurf->priv->inst->presentation_time_clock_id, &ts) == 0)
     {
         psurf->priv->current.last_present_timestamp = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
     }
 
-    wp_presentation_feedback_destroy(psurf->priv->current.presentation_feedback);
-    psurf->priv->current.presentation_feedback = NULL;
+    CountDiscardedFrame(psurf);
+
+    if (++psurf->priv->current.visibility.consecutive_discards >= OCCLUDED_DISCARD_THRESHOLD)
+    {
+        psurf->priv->current.visibility.occluded = EGL_TRUE;
+    }
+
+    FinishFrameFeedback(frame);
 }
-static void on_wp_presentation_feedback_discarded(void *userdata,
-        struct wp_presentation_feedback *wfeedback)
+/**
+ * Updates our guess as to whether the output has a variable refresh rate.
+ *
+ * This is called for each wp_presentation_feedback::presented event, after
+ * updating \c last_present_timestamp.
+ */
+static void UpdateVrrState(EplSurface *psurf, uint32_t refresh, uint32_t flags)
 {
-    EplSurface *psurf = userdata;
+    uint64_t timestamp = psurf->priv->current.last_present_timestamp;
+    uint64_t prev = psurf->priv->current.pacing.prev_present_timestamp;
+
+    psurf->priv->current.pacing.prev_present_timestamp = timestamp;
+
+    if (refresh == 0)
+    {
+        psurf->priv->current.pacing.vrr = EGL_TRUE;
+        return;
+    }
+
+    // An async flip isn't tied to a vblank either way, so it doesn't tell us
+    // anything.
+    if (!(flags & WP_PRESENTATION_FEEDBACK_KIND_VSYNC) || prev == 0 || timestamp <= prev)
+    {
+        return;
+    }
+
+    {
+        uint64_t interval = timestamp - prev;
+        uint64_t vblanks = (interval + refresh / 2) / refresh;
+        uint64_t error = (interval > vblanks * refresh) ? interval - vblanks * refresh
+            : vblanks * refresh - interval;
+
+        if (vblanks == 0 || error > refresh / VRR_GRID_TOLERANCE)
+        {
+            if (psurf->priv->current.pacing.vrr_score < VRR_SCORE_MAX)
+            {
+                psurf->priv->current.pacing.vrr_score++;
+            }
+        }
+        else if (psurf->priv->current.pacing.vrr_score > 0)
+        {
+            psurf->priv->current.pacing.vrr_score--;
+        }
+    }
 
-    assert(wfeedback == psurf->priv->current.presentation_feedback);
-    DiscardPresentationFeedback(psurf);
+    if (psurf->priv->current.pacing.vrr_score >= VRR_SCORE_THRESHOLD)
+    {
+        psurf->priv->current.pacing.vrr = EGL_TRUE;
+    }
+    else if (psurf->priv->current.pacing.vrr_score == 0)
+    {
+        psurf->priv->current.pacing.vrr = EGL_FALSE;
+    }
 }
+
 static void on_wp_presentation_feedback_presented(void *userdata,
         struct wp_presentation_feedback *wfeedback,
         uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
         uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags)
 {
-    EplSurface *psurf = userdata;
+    WlFrameFeedback *frame = userdata;
+    EplSurface *psurf = frame->psurf;
 
-    assert(wfeedback == psurf->priv->current.presentation_feedback);
+    assert(wfeedback == frame->feedback);
 
     psurf->priv->current.last_present_timestamp =
         ((((uint64_t) tv_sec_hi) << 32) | tv_sec_lo) * 1000000000 + tv_nsec;
-    psurf->priv->current.last_present_refresh = refresh;
 
-    wp_presentation_feedback_destroy(psurf->priv->current.presentation_feedback);
-    psurf->priv->current.presentation_feedback = NULL;
+    // A refresh of zero means that the compositor doesn't know, which
+    // usually means a variable refresh rate. Keep using our previous
+    // estimate in that case.
+    if (refresh != 0)
+    {
+        psurf->priv->current.last_present_refresh = refresh;
+    }
+    UpdateVrrState(psurf, refresh, flags);
+
+    psurf->priv->current.visibility.consecutive_discards = 0;
+    psurf->priv->current.visibility.occluded = EGL_FALSE;
+
+    FinishFrameFeedback(frame);
 }
 static const struct wp_presentation_feedback_listener PRESENTATION_FEEDBACK_LISTENER =
 {
@@ -1201,481 +2823,2953 @@ static const struct wp_presentation_feedback_listener PRESENTATION_FEEDBACK_LIST
 };
 
 /**
- * Waits for any previous frames.
+ * Requests presentation feedback for the next commit.
+ */
+static void RequestFrameFeedback(EplSurface *psurf, uint64_t present_id)
+{
+    WlFrameFeedback *frame = &psurf->priv->current.frame_feedback[psurf->priv->current.next_frame_feedback];
+
+    psurf->priv->current.next_frame_feedback = (psurf->priv->current.next_frame_feedback + 1) % MAX_FRAME_FEEDBACK;
+
+    if (frame->feedback != NULL)
+    {
+        // We've got more frames in flight than we expected, so just forget
+        // about the oldest one. We'll never find out what happened to it, so
+        // count it as discarded rather than presented. It still has to count
+        // as finished, so that nothing waits on it forever.
+        //
+        // Unlike a real discarded event, this doesn't tell us anything about
+        // whether the window is visible, so leave the occlusion state alone.
+        CountDiscardedFrame(psurf);
+        FinishFrameFeedback(frame);
+    }
+
+    frame->psurf = psurf;
+    frame->present_id = present_id;
+    frame->feedback = wp_presentation_feedback(psurf->priv->current.presentation_time,
+            psurf->priv->current.wsurf);
+    if (frame->feedback != NULL)
+    {
+        wp_presentation_feedback_add_listener(frame->feedback, &PRESENTATION_FEEDBACK_LISTENER, frame);
+    }
+}
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static uint64_t GetMonotonicTime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Reads and dispatches any events for the surface, waiting at most
+ * \p timeout_ms milliseconds for new events to arrive.
  *
- * This function ensures that the client doesn't run too far ahead of the
- * compositor.
+ * Unlike wl_display_dispatch_queue_pending, this will also read any new events
+ * from the socket, so it doesn't depend on the application to do that.
+ *
+ * \param psurf The surface.
+ * \param timeout_ms The timeout to pass to poll. Zero to check for events
+ *      without blocking, or -1 to wait indefinitely.
  */
-static EGLBoolean WaitForPreviousFrames(EplSurface *psurf)
+static EGLBoolean PollSurfaceEvents(EplSurface *psurf, int timeout_ms)
 {
-    while (psurf->priv->current.frame_callback != NULL
-            || psurf->priv->current.last_swap_sync != NULL
-            || psurf->priv->current.presentation_feedback != NULL)
+    struct wl_display *wdpy = psurf->priv->inst->wdpy;
+    struct wl_event_queue *queue = psurf->priv->current.queue;
+    struct pollfd pfd;
+    int ret;
+
+    while (wl_display_prepare_read_queue(wdpy, queue) != 0)
     {
-        if (wl_display_dispatch_queue(psurf->priv->inst->wdpy, psurf->priv->current.queue) < 0)
+        if (wl_display_dispatch_queue_pending(wdpy, queue) < 0)
         {
-            eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC,
-                    "Failed to dispatch Wayland events");
             return EGL_FALSE;
         }
     }
 
-    return EGL_TRUE;
+    wl_display_flush(wdpy);
+
+    pfd.fd = wl_display_get_fd(wdpy);
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (timeout_ms != 0)
+    {
+        WL_TRACE_BEGIN(trace);
+        ret = poll(&pfd, 1, timeout_ms);
+        WL_TRACE_END(trace, "PollSurfaceEvents");
+    }
+    else
+    {
+        ret = poll(&pfd, 1, 0);
+    }
+    if (ret > 0)
+    {
+        if (wl_display_read_events(wdpy) < 0)
+        {
+            return EGL_FALSE;
+        }
+    }
+    else
+    {
+        wl_display_cancel_read(wdpy);
+    }
+
+    return (wl_display_dispatch_queue_pending(wdpy, queue) >= 0);
 }
 
 /**
- * Sets up a fence for client -> server synchronization.
+ * Frees a window's extra buffers if it looks idle.
  *
- * If we've got explicit sync, then this function will attach a fence to the
- * timeline object, but it will NOT send the set_acquire_point or
- * set_release_point request. The current timeline point will be set to the
- * acquire point.
+ * A window counts as idle if the application is only swapping occasionally,
+ * or if the compositor is discarding its frames because it isn't visible.
+ * Once a window has been idle for at least IDLE_TRIM_SWAPS frames and
+ * IDLE_TRIM_PERIOD, we free any idle present buffers beyond
+ * WL_MIN_PRESENT_BUFFERS, along with the spare swapchain from dynamic
+ * resolution. If the window gets busy again, then
+ * eplWlSwapChainFindFreePresentBuffer will allocate new buffers as needed.
+ *
+ * We only trim once per idle streak. An occluded window might keep rendering
+ * and need its extra buffers back, and trimming again on every frame would
+ * just free and reallocate them over and over.
+ *
+ * If the process is over its memory budget, then we trim after a single idle
+ * frame, and we free the spare swapchain even if the window is busy.
+ *
+ * Trimming can move buffers to different slots, so this must only be called
+ * while the commit and ready threads are idle.
  */
-static EGLBoolean SyncRendering(EplSurface *psurf, WlPresentBuffer *present_buf)
+static void TrimIdleBuffers(EplSurface *psurf)
 {
-    EGLSync sync = EGL_NO_SYNC;
-    int syncFd = -1;
-    EGLBoolean success = EGL_FALSE;
+    struct timespec ts;
+    uint64_t now;
+    uint64_t freed = 0;
+    EGLBoolean idle = EGL_FALSE;
+    EGLBoolean pressure = eplWlMemoryOverBudget(psurf->priv->inst->platform, 0);
 
-    if (!psurf->priv->inst->supports_EGL_ANDROID_native_fence_sync)
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        // If we don't have EGL_ANDROID_native_fence_sync, then we can't do
-        // anything other than a glFinish here.
-        assert(psurf->priv->current.syncobj == NULL);
-        psurf->priv->inst->platform->priv->egl.Finish();
-        return EGL_TRUE;
+        return;
     }
+    now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
 
-    sync = psurf->priv->inst->platform->priv->egl.CreateSync(psurf->priv->inst->internal_display->edpy,
-            EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
-    if (sync == EGL_NO_SYNC)
+    // The spare swapchain is just a cache, so free it first if we're short
+    // on memory, even if this window is busy.
+    if (pressure && psurf->priv->current.dynres.spare != NULL)
     {
-        goto done;
+        freed += eplWlSwapChainGetMemoryUsage(psurf->priv->current.dynres.spare);
+        eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.dynres.spare);
+        psurf->priv->current.dynres.spare = NULL;
     }
-    psurf->priv->inst->platform->priv->egl.Flush();
 
-    syncFd = psurf->priv->inst->platform->priv->egl.DupNativeFenceFDANDROID(psurf->priv->inst->internal_display->edpy, sync);
-    if (syncFd < 0)
+    if (psurf->priv->current.activity.last_swap_time != 0
+            && now - psurf->priv->current.activity.last_swap_time >= IDLE_SWAP_PERIOD)
     {
-        goto done;
+        idle = EGL_TRUE;
     }
-
-    if (psurf->priv->current.syncobj != NULL)
+    // In mailbox mode, the compositor discards frames as a matter of course,
+    // so that doesn't tell us anything about whether the window is visible.
+    if (psurf->priv->present_mode != EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX
+            && psurf->priv->current.visibility.occluded)
     {
-        assert(present_buf->timeline.wtimeline != NULL);
+        idle = EGL_TRUE;
+    }
+    psurf->priv->current.activity.last_swap_time = now;
 
-        /*
-         * We've got explicit sync available, so plug the syncfd into the next
-         * timeline point.
-         *
-         * We let the caller send the set_acquire/release_point requests,
-         * though. That makes it easier to ensure that the sync requests are
-         * always sent alongside attach and commit requests.
-         */
-        success = eplWlTimelineAttachSyncFD(psurf->priv->inst, &present_buf->timeline, syncFd);
+    if (!idle)
+    {
+        psurf->priv->current.activity.idle_swaps = 0;
+        psurf->priv->current.activity.trimmed = EGL_FALSE;
+        goto done;
     }
-    else
+
+    if (psurf->priv->current.activity.idle_swaps == 0)
     {
-        // Attach an implicit sync fence if we can. If we can't, then fall back
-        // to a CPU wait.
-        if (present_buf->dmabuf < 0 || !psurf->priv->inst->supports_implicit_sync
-                || !eplWlImportDmaBufSyncFile(present_buf->dmabuf, syncFd))
-        {
-            psurf->priv->inst->platform->priv->egl.Finish();
-        }
-        success = EGL_TRUE;
+        psurf->priv->current.activity.idle_start = now;
+    }
+    if (psurf->priv->current.activity.idle_swaps < (pressure ? 1 : IDLE_TRIM_SWAPS))
+    {
+        psurf->priv->current.activity.idle_swaps++;
+        goto done;
     }
+    if (psurf->priv->current.activity.trimmed
+            || (!pressure && now - psurf->priv->current.activity.idle_start < IDLE_TRIM_PERIOD))
+    {
+        goto done;
+    }
+    psurf->priv->current.activity.trimmed = EGL_TRUE;
 
-done:
-    if (sync != EGL_NO_SYNC)
+    if (psurf->priv->current.dynres.spare != NULL)
     {
-        psurf->priv->inst->platform->priv->egl.DestroySync(psurf->priv->inst->internal_display->edpy, sync);
+        freed += eplWlSwapChainGetMemoryUsage(psurf->priv->current.dynres.spare);
+        eplWlSwapChainDestroy(psurf->priv->inst, psurf->priv->current.dynres.spare);
+        psurf->priv->current.dynres.spare = NULL;
     }
-    if (syncFd >= 0)
+    freed += eplWlSwapChainTrim(psurf->priv->inst, psurf->priv->current.swapchain,
+            WL_MIN_PRESENT_BUFFERS);
+
+done:
+    if (freed > 0)
     {
-        close(syncFd);
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        psurf->priv->params.reclaimed_bytes += freed;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
     }
-    return success;
 }
 
-EGLBoolean eplWlSwapBuffers(EplPlatformData *plat, EplDisplay *pdpy,
-        EplSurface *psurf, const EGLint *rects, EGLint n_rects)
+/**
+ * Picks a new render scale based on recent frame times.
+ *
+ * This is called at the start of each eglSwapBuffers. If the time between
+ * frames keeps going over the budget, then we drop to a lower resolution.
+ * The budget is the refresh period times the swap interval, or the target
+ * frame duration if that's longer. If it stays within budget for a while, then
+ * we try the next higher resolution.
+ *
+ * Note that with a nonzero swap interval, the frame time can't go below the
+ * refresh period, so we can't tell how much headroom we'd have at a higher
+ * resolution. Instead, we just try it, and if we end up going back down
+ * right away, we wait longer before trying again.
+ */
+static void UpdateDynamicResolution(EplSurface *psurf, EGLint swap_interval)
 {
-    WlDisplayInstance *inst = pdpy->priv->inst;
-    WlPresentBuffer *present_buf = NULL;
-    WlSwapChain *new_swapchain = NULL;
-    EGLBoolean success = EGL_FALSE;
-    struct wl_display *wdpy_wrapper = NULL;
-    EGLint swap_interval;
+    struct timespec ts;
+    uint64_t now;
+    uint64_t frame_time;
+    uint64_t target;
+    uint32_t level = psurf->priv->current.dynres.level;
 
-    pthread_mutex_lock(&psurf->priv->params.mutex);
-    if (psurf->priv->params.native_window == NULL)
+    if (psurf->priv->current.dynres.viewport == NULL)
     {
-        pthread_mutex_unlock(&psurf->priv->params.mutex);
-        eplSetError(plat, EGL_BAD_NATIVE_WINDOW, "wl_egl_window has been destroyed");
-        return EGL_FALSE;
+        return;
     }
 
-    swap_interval = psurf->priv->params.swap_interval;
-    psurf->priv->params.skip_update_callback++;
-    pthread_mutex_unlock(&psurf->priv->params.mutex);
-
-    if (EGL_PLATFORM_SURFACE_INTERFACE_CHECK_VERSION(plat->priv->egl.platform_surface_version,
-                EGL_PLATFORM_SURFACE_INTERNAL_SWAP_SINCE))
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        // Call into the driver to do any extra pre-present work.
-        if (!plat->egl.SwapBuffers(inst->internal_display->edpy, psurf->internal_surface))
-        {
-            goto done;
-        }
+        return;
     }
+    now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
 
-    // Dispatch any pending events, but don't block for them. This will ensure
-    // that we pick up any modifier changes that the server might have sent.
-    wl_display_dispatch_queue_pending(psurf->priv->inst->wdpy, psurf->priv->current.queue);
+    if (psurf->priv->current.dynres.last_swap_time == 0)
+    {
+        psurf->priv->current.dynres.last_swap_time = now;
+        return;
+    }
+    frame_time = now - psurf->priv->current.dynres.last_swap_time;
+    psurf->priv->current.dynres.last_swap_time = now;
 
-    // If the window has been resized, then allocate a new swapchain. We'll
-    // switch to it after presenting.
-    if (!SwapChainRealloc(psurf, EGL_TRUE, &new_swapchain))
+    if (psurf->priv->current.dynres.cooldown > 0)
     {
-        eplSetError(plat, EGL_BAD_ALLOC, "Failed to allocate resized buffers");
-        goto done;
+        psurf->priv->current.dynres.cooldown--;
+        return;
     }
 
-    if (psurf->priv->current.swapchain->prime)
+    if (psurf->priv->current.dynres.avg_frame_time == 0)
     {
-        // For PRIME, we need to find a free present buffer up front so that we
-        // can blit to it.
-        present_buf = eplWlSwapChainFindFreePresentBuffer(inst,
-                psurf->priv->current.swapchain);
-        if (present_buf == NULL)
-        {
-            goto done;
-        }
-        if (!plat->priv->egl.PlatformCopyColorBufferNVX(inst->internal_display->edpy,
-                psurf->priv->current.swapchain->render_buffer,
-                present_buf->buffer))
-        {
-            eplSetError(plat, EGL_BAD_ALLOC, "Driver error: Failed to blit to shared wl_buffer");
-            goto done;
-        }
+        psurf->priv->current.dynres.avg_frame_time = frame_time;
     }
     else
     {
-        // For non-PRIME, we can present the current back buffer directly. We
-        // don't need a new back buffer until after presenting (which might
-        // free up an existing buffer).
-        present_buf = psurf->priv->current.swapchain->current_back;
+        psurf->priv->current.dynres.avg_frame_time -= psurf->priv->current.dynres.avg_frame_time / 8;
+        psurf->priv->current.dynres.avg_frame_time += frame_time / 8;
     }
+    psurf->priv->current.dynres.frames_at_level++;
 
-    if (!SyncRendering(psurf, present_buf))
+    // If the app has a target frame duration, then frames can't come in any
+    // faster than that, so use it as the budget instead.
+    target = ((uint64_t) psurf->priv->current.last_present_refresh) * (swap_interval > 0 ? swap_interval : 1);
+    if (swap_interval > 0)
     {
-        goto done;
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        if (psurf->priv->params.target_frame_duration > target)
+        {
+            target = psurf->priv->params.target_frame_duration;
+        }
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
     }
 
-    if (swap_interval > 0)
+    if (psurf->priv->current.dynres.avg_frame_time > target + target / 20)
     {
-        if (!WaitForPreviousFrames(psurf))
+        psurf->priv->current.dynres.ok_frames = 0;
+        psurf->priv->current.dynres.slow_frames++;
+        if (psurf->priv->current.dynres.slow_frames >= RESOLUTION_DOWN_FRAMES
+                && level + 1 < NUM_RESOLUTION_SCALES)
         {
-            goto done;
+            if (psurf->priv->current.dynres.frames_at_level < psurf->priv->current.dynres.up_frames)
+            {
+                // We only just got here, so the last step up didn't work.
+                // Wait longer before trying again.
+                psurf->priv->current.dynres.up_frames *= 2;
+                if (psurf->priv->current.dynres.up_frames > RESOLUTION_MAX_UP_FRAMES)
+                {
+                    psurf->priv->current.dynres.up_frames = RESOLUTION_MAX_UP_FRAMES;
+                }
+            }
+            level++;
         }
     }
     else
     {
-        // If the swap interval is zero, then don't wait for a previous frame.
-        // Try to present immediately.
-        if (psurf->priv->current.presentation_feedback != NULL)
+        psurf->priv->current.dynres.slow_frames = 0;
+        psurf->priv->current.dynres.ok_frames++;
+        if (psurf->priv->current.dynres.frames_at_level >= RESOLUTION_MAX_UP_FRAMES)
         {
-            // If we still have an outstanding presentation, then treat this as
-            // a discarded frame, and use the current time as the last
-            // presentation time.
-            DiscardPresentationFeedback(psurf);
+            // We've been stable for a while, so go back to the normal delay.
+            psurf->priv->current.dynres.up_frames = RESOLUTION_UP_FRAMES;
         }
-
-        if (psurf->priv->current.last_swap_sync != NULL)
+        if (level > 0 && psurf->priv->current.dynres.ok_frames >= psurf->priv->current.dynres.up_frames)
         {
-            wl_callback_destroy(psurf->priv->current.last_swap_sync);
-            psurf->priv->current.last_swap_sync = NULL;
+            level--;
         }
     }
 
-    assert(psurf->priv->current.presentation_feedback == NULL);
-    assert(psurf->priv->current.last_swap_sync == NULL);
+    if (level != psurf->priv->current.dynres.level)
+    {
+        psurf->priv->current.dynres.level = level;
+        psurf->priv->current.dynres.slow_frames = 0;
+        psurf->priv->current.dynres.ok_frames = 0;
+        psurf->priv->current.dynres.frames_at_level = 0;
+        psurf->priv->current.dynres.avg_frame_time = 0;
+        psurf->priv->current.dynres.cooldown = RESOLUTION_COOLDOWN_FRAMES;
 
-    if (rects != NULL && n_rects > 0
-            && wl_proxy_get_version((struct wl_proxy *) psurf->priv->current.wsurf)
-                >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        psurf->priv->params.render_scale = RESOLUTION_SCALES[level];
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+    }
+}
+
+/**
+ * Returns the clock that we use for frame pacing.
+ */
+static clockid_t GetPacingClock(EplSurface *psurf)
+{
+    if (psurf->priv->current.presentation_time != NULL)
     {
-        EGLint i;
-        for (i=0; i<n_rects; i++)
+        return psurf->priv->inst->presentation_time_clock_id;
+    }
+    return CLOCK_MONOTONIC;
+}
+
+/**
+ * Sets the deadline for the frame that we're about to commit, after which
+ * we'll send the extra wp_fifo_v1 commit.
+ */
+static void ScheduleOcclusionCommit(EplSurface *psurf, EGLint swap_interval, uint64_t target_time)
+{
+    uint64_t frame_time = ((uint64_t) swap_interval) * psurf->priv->current.last_present_refresh;
+    uint64_t timeout;
+    uint64_t now;
+    struct timespec ts;
+
+    if (target_time != 0 && clock_gettime(GetPacingClock(psurf), &ts) == 0)
+    {
+        // If the frame is scheduled for later, then add that on.
+        now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        if (target_time > now && target_time - now > frame_time)
         {
-            const EGLint *rect = rects + (i * 4);
-            // Coordinate systems are flipped between eglSwapBuffersWithDamage
-            // and wl_surface_damage_buffer, so invert Y values.
-            int inv_y = psurf->priv->current.swapchain->height - (rect[1] + rect[3]);
-            wl_surface_damage_buffer(psurf->priv->current.wsurf,
-                    rect[0], inv_y, rect[2], rect[3]);
+            frame_time = target_time - now;
         }
     }
-    else
+
+    timeout = frame_time * OCCLUDED_TIMEOUT_FRAMES;
+    if (timeout < OCCLUDED_TIMEOUT_MIN)
     {
-        wl_surface_damage(psurf->priv->current.wsurf, 0, 0, INT_MAX, INT_MAX);
+        timeout = OCCLUDED_TIMEOUT_MIN;
     }
 
-    if (psurf->priv->current.syncobj != NULL)
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
     {
-        assert(present_buf->timeline.wtimeline != NULL);
+        // If we can't get the time, then just send the commit now.
+        wl_surface_commit(psurf->priv->current.wsurf);
+        wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
+        psurf->priv->current.visibility.commit_needed = EGL_FALSE;
+        return;
+    }
 
-        wp_linux_drm_syncobj_surface_v1_set_acquire_point(psurf->priv->current.syncobj,
-                present_buf->timeline.wtimeline,
-                (uint32_t) (present_buf->timeline.point >> 32),
-                (uint32_t) present_buf->timeline.point);
+    psurf->priv->current.visibility.deadline = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec + timeout;
+    psurf->priv->current.visibility.commit_needed = EGL_TRUE;
+}
 
-        present_buf->timeline.point++;
-        wp_linux_drm_syncobj_surface_v1_set_release_point(psurf->priv->current.syncobj,
-                present_buf->timeline.wtimeline,
-                (uint32_t) (present_buf->timeline.point >> 32),
-                (uint32_t) present_buf->timeline.point);
+/**
+ * Returns how long we can wait for the frame in \c throttle_present_id before
+ * we have to send the extra wp_fifo_v1 commit.
+ *
+ * \return The timeout in milliseconds, or -1 if there's no deadline.
+ */
+static int GetOcclusionTimeout(EplSurface *psurf)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t remaining;
+
+    if (!psurf->priv->current.visibility.commit_needed
+            || psurf->priv->current.completed_present_id >= psurf->priv->current.throttle_present_id)
+    {
+        return -1;
     }
 
-    wl_surface_attach(psurf->priv->current.wsurf, present_buf->wbuf, 0, 0);
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        return 0;
+    }
+    now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    if (now >= psurf->priv->current.visibility.deadline)
+    {
+        return 0;
+    }
 
-    if (psurf->priv->current.presentation_time != NULL && psurf->priv->current.fifo != NULL)
+    remaining = (psurf->priv->current.visibility.deadline - now + 999999) / 1000000;
+    return (remaining > INT_MAX) ? INT_MAX : (int) remaining;
+}
+
+/**
+ * Sends the extra wp_fifo_v1 commit if the frame in \c throttle_present_id has
+ * taken too long to show up.
+ *
+ * After this, the compositor will send a presented or discarded event in
+ * finite time.
+ */
+static void SendOcclusionCommit(EplSurface *psurf)
+{
+    if (GetOcclusionTimeout(psurf) != 0)
     {
-        wp_fifo_v1_set_barrier(psurf->priv->current.fifo);
+        return;
+    }
 
-        if (swap_interval > 0)
-        {
-            if (psurf->priv->current.commit_timer != NULL
-                    && psurf->priv->current.last_present_timestamp != 0)
-            {
-                uint64_t timestamp = ((uint64_t) swap_interval) * psurf->priv->current.last_present_refresh;
-                if (timestamp >= FRAME_TIMESTAMP_PADDING)
-                {
-                    uint64_t sec;
-                    uint32_t nsec;
-
-                    timestamp += psurf->priv->current.last_present_timestamp - FRAME_TIMESTAMP_PADDING;
-                    sec = timestamp / 1000000000;
-                    nsec = timestamp % 1000000000;
-                    wp_commit_timer_v1_set_timestamp(psurf->priv->current.commit_timer,
-                            (uint32_t) (sec >> 32), (uint32_t) sec, nsec);
-                }
-            }
+    wl_surface_commit(psurf->priv->current.wsurf);
+    wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
+    wl_display_flush(psurf->priv->inst->wdpy);
 
-            psurf->priv->current.presentation_feedback = wp_presentation_feedback(
-                    psurf->priv->current.presentation_time, psurf->priv->current.wsurf);
-            if (psurf->priv->current.presentation_feedback != NULL)
-            {
-                wp_presentation_feedback_add_listener(psurf->priv->current.presentation_feedback,
-                        &PRESENTATION_FEEDBACK_LISTENER, psurf);
-            }
+    psurf->priv->current.visibility.commit_needed = EGL_FALSE;
+    psurf->priv->current.visibility.occluded = EGL_TRUE;
+}
 
+/**
+ * Checks whether we're still waiting on a wl_surface::frame callback (or the
+ * timer that replaces it).
+ *
+ * If we've waited too long for the callback, then this switches to the
+ * timer.
+ *
+ * \param[out] ret_timeout Returns the time in milliseconds until that might
+ *      change, or -1 if we're not waiting for anything.
+ * \return EGL_TRUE if the next frame still has to wait.
+ */
+static EGLBoolean CheckFrameThrottle(EplSurface *psurf, int *ret_timeout)
+{
+    struct timespec ts;
+    uint64_t now;
+    uint64_t deadline;
 
-            wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
+    *ret_timeout = -1;
+    if (psurf->priv->current.frame_callback == NULL)
+    {
+        return EGL_FALSE;
+    }
 
-            /*
-             * If the window is not visible (occluded, monitor on standby,
-             * etc), then we could be waiting for an indefinite amount of time
-             * for the compositor to send a wp_presentation_feedback::presented
-             * or discarded event.
-             *
-             * But, wp_fifo_v1 is required to unblock in finite time, so we can
-             * send an extra dummy commit with a wp_fifo_v1::wait_barrier.
-             *
-             * If the window is visible, then the compositor will send a
-             * presented event as normal, and if the window is not visible,
-             * then the second commit will trigger a discarded event.
-             *
-             * Note that the compositor may trigger a discarded event
-             * immediately, so we use wp_commit_timer_v1 above to try to
-             * throttle things to a sane rate.
-             *
-             * Ugly as this is, Mesa relies on the same behavior, so it's
-             * probably safe to treat this as the "intended" behavior.
-             */
-            wl_surface_commit(psurf->priv->current.wsurf);
-            wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
-        }
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+    {
+        return EGL_FALSE;
     }
-    else if (swap_interval > 0)
+    now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+
+    if (!psurf->priv->current.frame_throttle.use_timer)
     {
-        /*
-         * If we don't have FIFO or presentation time support, then just
-         * request a frame callback.
-         *
-         * Only send that request if the swap interval is non-zero, though.
-         * Since the server can wait indefinitely before sending the response,
-         * and since wl_callback doesn't have a destroy request, sending a
-         * wl_surface::frame request every frame without waiting for them could
-         * create an unbounded number of pending wl_callbacks in the server.
-         */
+        deadline = psurf->priv->current.frame_throttle.commit_time
+            + ((uint64_t) psurf->priv->inst->frame_callback_timeout) * 1000000;
+        if (now >= deadline)
+        {
+            // The window is probably hidden, so fall back to the timer.
+            psurf->priv->current.frame_throttle.use_timer = EGL_TRUE;
+        }
+    }
 
-        // If swap_interval is nonzero, then we should have called
-        // WaitForPreviousFrames above, which would clear frame_callback.
-        assert(psurf->priv->current.frame_callback == NULL);
-        psurf->priv->current.frame_callback = wl_surface_frame(psurf->priv->current.wsurf);
-        if (psurf->priv->current.frame_callback != NULL)
+    if (psurf->priv->current.frame_throttle.use_timer)
+    {
+        deadline = psurf->priv->current.frame_throttle.commit_time
+            + psurf->priv->current.frame_throttle.period;
+        if (now >= deadline)
         {
-            wl_callback_add_listener(psurf->priv->current.frame_callback,
-                    &FRAME_CALLBACK_LISTENER, psurf);
+            return EGL_FALSE;
         }
     }
 
-    wl_surface_commit(psurf->priv->current.wsurf);
+    *ret_timeout = (int) ((deadline - now + 999999) / 1000000);
+    return EGL_TRUE;
+}
 
-    pthread_mutex_lock(&psurf->priv->params.mutex);
-    if (psurf->priv->params.native_window != NULL)
+/**
+ * Waits for and dispatches events for the surface.
+ *
+ * This is like wl_display_dispatch_queue, except that if we're waiting for a
+ * frame that was sent without the extra wp_fifo_v1 commit, then it'll send
+ * that commit once the frame has taken too long. Likewise, it won't wait
+ * past the frame callback timeout.
+ */
+static EGLBoolean DispatchSurfaceEvents(EplSurface *psurf)
+{
+    int timeout = GetOcclusionTimeout(psurf);
+    int frame_timeout;
+
+    CheckFrameThrottle(psurf, &frame_timeout);
+    if (frame_timeout >= 0 && (timeout < 0 || frame_timeout < timeout))
     {
-        psurf->priv->params.native_window->attached_width = psurf->priv->current.swapchain->width;
-        psurf->priv->params.native_window->attached_height = psurf->priv->current.swapchain->height;
+        timeout = frame_timeout;
     }
-    pthread_mutex_unlock(&psurf->priv->params.mutex);
 
-    /*
-     * Send a wl_display::sync request after the commit.
-     *
-     * If we don't have FIFO support, or if the swap interval is zero, then we
-     * can't safely use the presentation timing event in eglWaitGL, but we can
-     * at least wait to make sure that the server has received the present
-     * requests.
-     */
-    wdpy_wrapper = wl_proxy_create_wrapper(psurf->priv->inst->wdpy);
-    if (wdpy_wrapper != NULL)
+    if (timeout < 0)
     {
-        wl_proxy_set_queue((struct wl_proxy *) wdpy_wrapper, psurf->priv->current.queue);
-        psurf->priv->current.last_swap_sync = wl_display_sync(wdpy_wrapper);
-        wl_proxy_wrapper_destroy(wdpy_wrapper);
-        if (psurf->priv->current.last_swap_sync != NULL)
-        {
-            wl_callback_add_listener(psurf->priv->current.last_swap_sync,
-                    &FRAME_CALLBACK_LISTENER, psurf);
-        }
+        EGLBoolean ret;
+        WL_TRACE_BEGIN(trace);
+
+        ret = (wl_display_dispatch_queue(psurf->priv->inst->wdpy, psurf->priv->current.queue) >= 0);
+        WL_TRACE_END(trace, "wl_display_dispatch_queue");
+        return ret;
     }
 
-    wl_display_flush(psurf->priv->inst->wdpy);
-    present_buf->status = BUFFER_STATUS_IN_USE;
+    SendOcclusionCommit(psurf);
+    return PollSurfaceEvents(psurf, timeout);
+}
 
+/**
+ * Waits for any previous frames.
+ *
+ * This function ensures that the client doesn't run too far ahead of the
+ * compositor.
+ */
+static EGLBoolean WaitForPreviousFrames(EplSurface *psurf)
+{
+    int timeout;
+
+    // Pick up any frame callback that's already arrived, so that we don't
+    // switch to the timer just because nothing has read it yet.
+    if (psurf->priv->current.frame_callback != NULL && !PollSurfaceEvents(psurf, 0))
+    {
+        eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC,
+                "Failed to dispatch Wayland events");
+        return EGL_FALSE;
+    }
+
+    while (CheckFrameThrottle(psurf, &timeout)
+            || psurf->priv->current.last_swap_sync != NULL
+            || psurf->priv->current.completed_present_id < psurf->priv->current.throttle_present_id)
+    {
+        if (!DispatchSurfaceEvents(psurf))
+        {
+            eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC,
+                    "Failed to dispatch Wayland events");
+            return EGL_FALSE;
+        }
+    }
+
+    return EGL_TRUE;
+}
+
+/**
+ * Gets the surface ready to commit a new frame.
+ *
+ * With a nonzero swap interval, this waits for the earlier frames. With a
+ * swap interval of zero, it stops waiting for any earlier frames instead, so
+ * that we can present immediately.
+ */
+static EGLBoolean ThrottleFrame(EplSurface *psurf, EGLint swap_interval)
+{
+    if (swap_interval > 0)
+    {
+        EGLBoolean waited;
+        WL_TRACE_BEGIN(trace);
+
+        waited = WaitForPreviousFrames(psurf);
+        WL_TRACE_END(trace, "WaitForPreviousFrames");
+        if (!waited)
+        {
+            return EGL_FALSE;
+        }
+    }
+    else
+    {
+        if (psurf->priv->current.completed_present_id < psurf->priv->current.throttle_present_id)
+        {
+            // If we still have an outstanding presentation, then stop waiting
+            // for it, and use the current time as the last presentation time.
+            struct timespec ts;
+            if (clock_gettime(psurf->priv->inst->presentation_time_clock_id, &ts) == 0)
+            {
+                psurf->priv->current.last_present_timestamp = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+            }
+        }
+        psurf->priv->current.throttle_present_id = 0;
+
+        if (psurf->priv->current.last_swap_sync != NULL)
+        {
+            wl_callback_destroy(psurf->priv->current.last_swap_sync);
+            psurf->priv->current.last_swap_sync = NULL;
+        }
+    }
+
+    assert(psurf->priv->current.completed_present_id >= psurf->priv->current.throttle_present_id);
+    assert(psurf->priv->current.last_swap_sync == NULL);
+    return EGL_TRUE;
+}
+
+/**
+ * Sets up a fence for client -> server synchronization.
+ *
+ * If we've got explicit sync, then this function will attach a fence to the
+ * timeline object, but it will NOT send the set_acquire_point or
+ * set_release_point request. The current timeline point will be set to the
+ * acquire point.
+ *
+ * \param[out] ret_fence_fd If this isn't NULL, then on success, it gets the
+ *      sync_file for the frame, for a frame capture consumer. That's -1 if
+ *      we don't have native fences, since then rendering has already
+ *      finished. The caller must close it.
+ */
+static EGLBoolean SyncRendering(EplSurface *psurf, WlPresentBuffer *present_buf,
+        int *ret_fence_fd)
+{
+    EGLSync sync = EGL_NO_SYNC;
+    int syncFd = -1;
+    EGLBoolean success = EGL_FALSE;
+    WL_TRACE_BEGIN(trace);
+
+    if (ret_fence_fd != NULL)
+    {
+        *ret_fence_fd = -1;
+    }
+
+    if (!psurf->priv->inst->supports_EGL_ANDROID_native_fence_sync)
+    {
+        // If we don't have EGL_ANDROID_native_fence_sync, then we can't do
+        // anything other than a glFinish here.
+        assert(psurf->priv->current.syncobj == NULL);
+        psurf->priv->inst->platform->priv->egl.Finish();
+        WL_STATS_SURFACE_ADD(psurf->priv->stats, finish_fallbacks, 1);
+        eplWlPerfWarning(psurf->priv->inst->platform, WL_PERF_WARNING_FINISH_FALLBACK,
+                "EGL_ANDROID_native_fence_sync is not available, so eglSwapBuffers calls glFinish");
+        WL_TRACE_END(trace, "SyncRendering");
+        return EGL_TRUE;
+    }
+
+    sync = psurf->priv->inst->platform->priv->egl.CreateSync(psurf->priv->inst->internal_display->edpy,
+            EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+    if (sync == EGL_NO_SYNC)
+    {
+        goto done;
+    }
+    psurf->priv->inst->platform->priv->egl.Flush();
+
+    syncFd = psurf->priv->inst->platform->priv->egl.DupNativeFenceFDANDROID(psurf->priv->inst->internal_display->edpy, sync);
+    if (syncFd < 0)
+    {
+        goto done;
+    }
+
+    if (psurf->priv->current.syncobj != NULL)
+    {
+        assert(present_buf->timeline.wtimeline != NULL);
+
+        /*
+         * We've got explicit sync available, so plug the syncfd into the next
+         * timeline point.
+         *
+         * We let the caller send the set_acquire/release_point requests,
+         * though. That makes it easier to ensure that the sync requests are
+         * always sent alongside attach and commit requests.
+         */
+        success = eplWlTimelineAttachSyncFD(psurf->priv->inst, &present_buf->timeline, syncFd);
+    }
+    else
+    {
+        // Attach an implicit sync fence if we can. If we can't, then fall back
+        // to a CPU wait.
+        if (present_buf->dmabuf < 0 || !psurf->priv->inst->supports_implicit_sync
+                || !eplWlImportDmaBufSyncFile(present_buf->dmabuf, syncFd))
+        {
+            psurf->priv->inst->platform->priv->egl.Finish();
+            WL_STATS_SURFACE_ADD(psurf->priv->stats, finish_fallbacks, 1);
+            eplWlPerfWarning(psurf->priv->inst->platform, WL_PERF_WARNING_FINISH_FALLBACK,
+                    "No explicit or implicit sync is available, so eglSwapBuffers calls glFinish");
+        }
+        success = EGL_TRUE;
+    }
+
+done:
+    if (sync != EGL_NO_SYNC)
+    {
+        psurf->priv->inst->platform->priv->egl.DestroySync(psurf->priv->inst->internal_display->edpy, sync);
+    }
+    if (success && ret_fence_fd != NULL)
+    {
+        *ret_fence_fd = syncFd;
+        syncFd = -1;
+    }
+    if (syncFd >= 0)
+    {
+        close(syncFd);
+    }
+    WL_TRACE_END(trace, "SyncRendering");
+    return success;
+}
+
+/**
+ * Figures out when the next frame should be displayed, for a nonzero swap
+ * interval.
+ *
+ * Without a target frame duration, this is just \p swap_interval refresh
+ * periods after the last presented frame, and we only use it with
+ * wp_commit_timer_v1.
+ *
+ * With a target frame duration, each frame is scheduled one duration after
+ * the previous frame's scheduled time. On a fixed refresh rate display, that
+ * gets rounded to the nearest vblank. On a VRR display, we can use the time
+ * as-is.
+ *
+ * \return A timestamp in the pacing clock, or zero to present as soon as
+ *      possible.
+ */
+static uint64_t GetFrameTargetTime(EplSurface *psurf, EGLint swap_interval)
+{
+    uint64_t refresh = psurf->priv->current.last_present_refresh;
+    uint64_t base = psurf->priv->current.last_present_timestamp;
+    uint64_t duration;
+    uint64_t target;
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    duration = psurf->priv->params.target_frame_duration;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    if (duration == 0)
+    {
+        psurf->priv->current.pacing.next_target = 0;
+        if (psurf->priv->current.commit_timer == NULL || base == 0
+                || ((uint64_t) swap_interval) * refresh < FRAME_TIMESTAMP_PADDING)
+        {
+            return 0;
+        }
+        return base + ((uint64_t) swap_interval) * refresh;
+    }
+
+    if (psurf->priv->current.presentation_time == NULL || base == 0)
+    {
+        // If we don't have any presentation times, then just pace against
+        // the current time. Use the same clock as every later deadline.
+        struct timespec ts;
+        if (clock_gettime(GetPacingClock(psurf), &ts) != 0)
+        {
+            return 0;
+        }
+        base = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        refresh = 0;
+    }
+
+    target = psurf->priv->current.pacing.next_target + duration;
+    if (psurf->priv->current.pacing.next_target == 0
+            || target <= base || target > base + 2 * duration)
+    {
+        // We're either just starting, or we've fallen behind, or the duration
+        // got shorter. Either way, start a new schedule from here.
+        target = base + duration;
+    }
+    psurf->priv->current.pacing.next_target = target;
+
+    if (refresh > 0 && !psurf->priv->current.pacing.vrr)
+    {
+        uint64_t vblanks = (target - base + refresh / 2) / refresh;
+        return base + (vblanks > 0 ? vblanks : 1) * refresh;
+    }
+    return target;
+}
+
+/**
+ * Sleeps until the given time in the pacing clock.
+ *
+ * This is the fallback for a target frame duration if we don't have
+ * wp_commit_timer_v1.
+ */
+static void SleepUntilFrameTime(EplSurface *psurf, uint64_t target)
+{
+    struct timespec ts;
+
+    ts.tv_sec = target / 1000000000;
+    ts.tv_nsec = target % 1000000000;
+    while (clock_nanosleep(GetPacingClock(psurf), TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+}
+
+/**
+ * Picks the time that the next frame should be displayed, and if we can't
+ * ask the compositor to hold the frame until then, waits until it's time to
+ * commit it.
+ *
+ * This is called on the app's thread after throttling, right before the
+ * frame goes to PresentFrame, the commit thread, or a present batch. That way,
+ * the commit thread never sleeps, and the next eglSwapBuffers won't block
+ * waiting for it.
+ *
+ * \return The target time to pass to PresentFrame.
+ */
+static uint64_t PaceFrame(EplSurface *psurf, EGLint swap_interval)
+{
+    uint64_t target_time;
+
+    if (psurf->priv->present_mode == EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX
+            || swap_interval <= 0)
+    {
+        return 0;
+    }
+
+    target_time = GetFrameTargetTime(psurf, swap_interval);
+    if (target_time == 0 || psurf->priv->current.commit_timer != NULL)
+    {
+        return target_time;
+    }
+
+    if (psurf->priv->current.presentation_time != NULL && psurf->priv->current.fifo != NULL)
+    {
+        // The FIFO barrier already holds the frame until the next vblank, so
+        // commit it a bit early.
+        if (target_time > FRAME_TIMESTAMP_PADDING)
+        {
+            SleepUntilFrameTime(psurf, target_time - FRAME_TIMESTAMP_PADDING);
+        }
+    }
+    else
+    {
+        // Without wp_commit_timer_v1 or FIFO, the only way to hold a frame
+        // back is to not send it yet.
+        SleepUntilFrameTime(psurf, target_time);
+    }
+    return target_time;
+}
+
+/**
+ * Sends the requests to attach and commit a new frame.
+ *
+ * Normally, this is called from eglSwapBuffers, but if the display's
+ * \c use_async_commit flag is set, then this is called from the commit
+ * thread once rendering has finished.
+ *
+ * \param target_time The time from PaceFrame. This never sleeps, so the
+ *      caller must have already called PaceFrame.
+ */
+static void PresentFrame(EplSurface *psurf, WlPresentBuffer *present_buf,
+        EGLint swap_interval, uint64_t present_id, uint64_t target_time,
+        const EGLint *rects, EGLint n_rects, EGLBoolean flush)
+{
+    EGLBoolean mailbox = (psurf->priv->present_mode == EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX);
+    WL_TRACE_BEGIN(trace);
+
+    if (rects != NULL && n_rects > 0
+            && wl_proxy_get_version((struct wl_proxy *) psurf->priv->current.wsurf)
+                >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+    {
+        EGLint i;
+        for (i=0; i<n_rects; i++)
+        {
+            const EGLint *rect = rects + (i * 4);
+            // Coordinate systems are flipped between eglSwapBuffersWithDamage
+            // and wl_surface_damage_buffer, so invert Y values.
+            int inv_y = psurf->priv->current.swapchain->height - (rect[1] + rect[3]);
+            wl_surface_damage_buffer(psurf->priv->current.wsurf,
+                    rect[0], inv_y, rect[2], rect[3]);
+        }
+    }
+    else
+    {
+        if (rects != NULL && n_rects > 0)
+        {
+            eplWlPerfWarning(psurf->priv->inst->platform, WL_PERF_WARNING_FULL_DAMAGE,
+                    "The wl_surface does not support wl_surface.damage_buffer, so damage rectangles are ignored");
+        }
+        wl_surface_damage(psurf->priv->current.wsurf, 0, 0, INT_MAX, INT_MAX);
+    }
+
+    if (psurf->priv->current.syncobj != NULL)
+    {
+        assert(present_buf->timeline.wtimeline != NULL);
+
+        wp_linux_drm_syncobj_surface_v1_set_acquire_point(psurf->priv->current.syncobj,
+                present_buf->timeline.wtimeline,
+                (uint32_t) (present_buf->timeline.point >> 32),
+                (uint32_t) present_buf->timeline.point);
+
+        if (psurf->priv->single_buffer)
+        {
+            WlTimeline *release = &psurf->priv->current.single_release;
+
+            // Nothing waits for these release points, since we never wait
+            // for the buffer to be free.
+            release->point++;
+            wp_linux_drm_syncobj_surface_v1_set_release_point(psurf->priv->current.syncobj,
+                    release->wtimeline,
+                    (uint32_t) (release->point >> 32),
+                    (uint32_t) release->point);
+        }
+        else
+        {
+            present_buf->timeline.point++;
+            wp_linux_drm_syncobj_surface_v1_set_release_point(psurf->priv->current.syncobj,
+                    present_buf->timeline.wtimeline,
+                    (uint32_t) (present_buf->timeline.point >> 32),
+                    (uint32_t) present_buf->timeline.point);
+        }
+    }
+
+    wl_surface_attach(psurf->priv->current.wsurf, present_buf->wbuf, 0, 0);
+
+    if (psurf->priv->current.dynres.viewport != NULL)
+    {
+        const WlSwapChain *swapchain = psurf->priv->current.swapchain;
+        int32_t dest_width = -1;
+        int32_t dest_height = -1;
+
+        if (swapchain->width != swapchain->display_width
+                || swapchain->height != swapchain->display_height)
+        {
+            dest_width = swapchain->display_width;
+            dest_height = swapchain->display_height;
+        }
+        if (dest_width != psurf->priv->current.dynres.dest_width
+                || dest_height != psurf->priv->current.dynres.dest_height)
+        {
+            wp_viewport_set_destination(psurf->priv->current.dynres.viewport, dest_width, dest_height);
+            psurf->priv->current.dynres.dest_width = dest_width;
+            psurf->priv->current.dynres.dest_height = dest_height;
+        }
+    }
+
+    if (psurf->priv->current.tearing_control != NULL)
+    {
+        // With a swap interval of zero, tell the server that it can flip
+        // asynchronously instead of waiting for vblank. Mailbox mode is
+        // supposed to be tear-free, so it always uses vsync.
+        uint32_t hint = (swap_interval > 0 || mailbox ? WP_TEARING_CONTROL_V1_PRESENTATION_HINT_VSYNC
+                : WP_TEARING_CONTROL_V1_PRESENTATION_HINT_ASYNC);
+        if (hint != psurf->priv->current.tearing_hint)
+        {
+            wp_tearing_control_v1_set_presentation_hint(psurf->priv->current.tearing_control, hint);
+            psurf->priv->current.tearing_hint = hint;
+        }
+    }
+
+    if (psurf->priv->current.presentation_time != NULL)
+    {
+        RequestFrameFeedback(psurf, present_id);
+    }
+
+    if (mailbox)
+    {
+        /*
+         * In mailbox mode, we don't set any FIFO barriers or commit times, so
+         * the compositor will just latch whichever frame is the newest at its
+         * next repaint, and discard any others.
+         */
+    }
+    else if (psurf->priv->current.presentation_time != NULL && psurf->priv->current.fifo != NULL)
+    {
+        /*
+         * If we've asked for async presentation, then don't set a FIFO
+         * barrier. Nothing after this frame needs to wait for it to be
+         * latched, and the barrier would otherwise hold the frame until the
+         * next vblank.
+         */
+        if (swap_interval > 0 || psurf->priv->current.tearing_control == NULL)
+        {
+            wp_fifo_v1_set_barrier(psurf->priv->current.fifo);
+        }
+
+        if (swap_interval > 0)
+        {
+            if (target_time > FRAME_TIMESTAMP_PADDING
+                    && psurf->priv->current.commit_timer != NULL)
+            {
+                uint64_t timestamp = target_time - FRAME_TIMESTAMP_PADDING;
+                uint64_t sec = timestamp / 1000000000;
+                uint32_t nsec = timestamp % 1000000000;
+                wp_commit_timer_v1_set_timestamp(psurf->priv->current.commit_timer,
+                        (uint32_t) (sec >> 32), (uint32_t) sec, nsec);
+            }
+
+            // The next eglSwapBuffers call will wait for this frame.
+            psurf->priv->current.throttle_present_id = present_id;
+
+            wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
+
+            /*
+             * If the window is not visible (occluded, monitor on standby,
+             * etc), then we could be waiting for an indefinite amount of time
+             * for the compositor to send a wp_presentation_feedback::presented
+             * or discarded event.
+             *
+             * But, wp_fifo_v1 is required to unblock in finite time, so we can
+             * send an extra dummy commit with a wp_fifo_v1::wait_barrier.
+             *
+             * If the window is visible, then the compositor will send a
+             * presented event as normal, and if the window is not visible,
+             * then the second commit will trigger a discarded event.
+             *
+             * Note that the compositor may trigger a discarded event
+             * immediately, so we use wp_commit_timer_v1 above to try to
+             * throttle things to a sane rate.
+             *
+             * Ugly as this is, Mesa relies on the same behavior, so it's
+             * probably safe to treat this as the "intended" behavior.
+             *
+             * If we think the window is visible, then we skip the extra
+             * commit here, and only send it from SendOcclusionCommit if the
+             * frame takes too long to show up.
+             */
+            if (psurf->priv->current.visibility.occluded)
+            {
+                wl_surface_commit(psurf->priv->current.wsurf);
+                wp_fifo_v1_wait_barrier(psurf->priv->current.fifo);
+                psurf->priv->current.visibility.commit_needed = EGL_FALSE;
+            }
+            else
+            {
+                ScheduleOcclusionCommit(psurf, swap_interval, target_time);
+            }
+        }
+    }
+    else if (swap_interval > 0)
+    {
+        /*
+         * If we don't have FIFO or presentation time support, then just
+         * request a frame callback.
+         *
+         * Only send that request if the swap interval is non-zero, though.
+         * Since the server can wait indefinitely before sending the response,
+         * and since wl_callback doesn't have a destroy request, sending a
+         * wl_surface::frame request every frame without waiting for them could
+         * create an unbounded number of pending wl_callbacks in the server.
+         */
+
+        struct timespec ts;
+
+        // If swap_interval is nonzero, then we should have called
+        // WaitForPreviousFrames above, which would clear frame_callback,
+        // unless we timed out and switched to the timer.
+        assert(psurf->priv->current.frame_callback == NULL
+                || psurf->priv->current.frame_throttle.use_timer);
+
+        if (psurf->priv->current.frame_callback == NULL)
+        {
+            psurf->priv->current.frame_callback = wl_surface_frame(psurf->priv->current.wsurf);
+            if (psurf->priv->current.frame_callback != NULL)
+            {
+                wl_callback_add_listener(psurf->priv->current.frame_callback,
+                        &FRAME_CALLBACK_LISTENER, psurf);
+                psurf->priv->current.frame_throttle.callback_interval = swap_interval;
+            }
+        }
+
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        {
+            psurf->priv->current.frame_throttle.commit_time = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        }
+        psurf->priv->current.frame_throttle.period =
+            ((uint64_t) swap_interval) * psurf->priv->current.frame_throttle.refresh_estimate;
+    }
+
+    wl_surface_commit(psurf->priv->current.wsurf);
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    if (psurf->priv->params.native_window != NULL)
+    {
+        psurf->priv->params.native_window->attached_width = psurf->priv->current.swapchain->display_width;
+        psurf->priv->params.native_window->attached_height = psurf->priv->current.swapchain->display_height;
+    }
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    /*
+     * Send a wl_display::sync request after the commit.
+     *
+     * If we don't have FIFO support, or if the swap interval is zero, then we
+     * can't safely use the presentation timing event in eglWaitGL, but we can
+     * at least wait to make sure that the server has received the present
+     * requests.
+     */
+    psurf->priv->current.last_swap_sync = wl_display_sync(psurf->priv->current.wdpy);
+    psurf->priv->current.last_swap_sync_id = present_id;
+    if (psurf->priv->current.last_swap_sync != NULL)
+    {
+        wl_callback_add_listener(psurf->priv->current.last_swap_sync,
+                &FRAME_CALLBACK_LISTENER, psurf);
+    }
+    else if (psurf->priv->current.presentation_time == NULL)
+    {
+        // We've got no way to find out when this frame is done, so don't let
+        // eglWaitForPresentNVX wait on it.
+        psurf->priv->current.completed_present_id = present_id;
+    }
+
+    // In a present batch, the caller flushes once after every frame in the
+    // batch has been committed.
+    if (flush)
+    {
+        wl_display_flush(psurf->priv->inst->wdpy);
+    }
+    WL_TRACE_END(trace, "PresentFrame");
+}
+
+/**
+ * Waits for the commit thread to finish with any pending frame.
+ */
+static void WaitForPendingCommit(EplSurface *psurf)
+{
+    if (!psurf->priv->commit.thread_started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&psurf->priv->commit.mutex);
+    while (psurf->priv->commit.pending)
+    {
+        pthread_cond_wait(&psurf->priv->commit.cond, &psurf->priv->commit.mutex);
+    }
+    pthread_mutex_unlock(&psurf->priv->commit.mutex);
+}
+
+static void StopCommitThread(EplSurface *psurf)
+{
+    if (!psurf->priv->commit.thread_started)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&psurf->priv->commit.mutex);
+    psurf->priv->commit.quit = EGL_TRUE;
+    pthread_cond_broadcast(&psurf->priv->commit.cond);
+    pthread_mutex_unlock(&psurf->priv->commit.mutex);
+
+    pthread_join(psurf->priv->commit.thread, NULL);
+    psurf->priv->commit.thread_started = EGL_FALSE;
+}
+
+/**
+ * Waits for the rendering fence for a deferred commit.
+ *
+ * This is called from the commit thread, so it doesn't have a current
+ * context, and it can only do a CPU wait.
+ */
+static void WaitCommitFence(WlDisplayInstance *inst, WlCommitJob *job)
+{
+    if (job->fence_fd >= 0)
+    {
+        struct pollfd pfd = { job->fence_fd, POLLIN, 0 };
+        while (poll(&pfd, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+        }
+        close(job->fence_fd);
+        job->fence_fd = -1;
+    }
+    if (job->fence_sync != EGL_NO_SYNC)
+    {
+        inst->platform->priv->egl.ClientWaitSync(inst->internal_display->edpy,
+                job->fence_sync, 0, EGL_FOREVER);
+        inst->platform->priv->egl.DestroySync(inst->internal_display->edpy, job->fence_sync);
+        job->fence_sync = EGL_NO_SYNC;
+    }
+}
+
+static void *CommitThreadProc(void *param)
+{
+    EplSurface *psurf = param;
+    EplImplSurface *priv = psurf->priv;
+
+    pthread_mutex_lock(&priv->commit.mutex);
+    while (1)
+    {
+        WlCommitJob job;
+
+        while (!priv->commit.pending && !priv->commit.quit)
+        {
+            pthread_cond_wait(&priv->commit.cond, &priv->commit.mutex);
+        }
+        if (!priv->commit.pending)
+        {
+            // We've been told to quit, and there's nothing left to commit.
+            break;
+        }
+
+        job = priv->commit.job;
+        pthread_mutex_unlock(&priv->commit.mutex);
+
+        WaitCommitFence(priv->inst, &job);
+        if (eplWlDisplayInstanceIsNativeValid(priv->inst))
+        {
+            PresentFrame(psurf, job.present_buf, job.swap_interval, job.present_id,
+                    job.target_time, job.rects, job.n_rects, EGL_TRUE);
+        }
+        if (job.capture_pending)
+        {
+            // We've already waited for rendering, so the consumer doesn't
+            // need a fence.
+            DeliverCaptureFrame(psurf, &job.capture, job.rects, job.n_rects);
+        }
+
+        pthread_mutex_lock(&priv->commit.mutex);
+        priv->commit.pending = EGL_FALSE;
+        pthread_cond_broadcast(&priv->commit.cond);
+    }
+    pthread_mutex_unlock(&priv->commit.mutex);
+
+    return NULL;
+}
+
+/**
+ * Creates a fence for the current frame's rendering, for the commit thread
+ * to wait on.
+ *
+ * If we can't create a fence, then this falls back to a glFinish.
+ */
+static void CreateCommitFence(EplSurface *psurf, WlCommitJob *job)
+{
+    WlDisplayInstance *inst = psurf->priv->inst;
+    EGLSync sync = EGL_NO_SYNC;
+
+    job->fence_fd = -1;
+    job->fence_sync = EGL_NO_SYNC;
+
+    if (inst->supports_EGL_ANDROID_native_fence_sync)
+    {
+        sync = inst->platform->priv->egl.CreateSync(inst->internal_display->edpy,
+                EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+        if (sync != EGL_NO_SYNC)
+        {
+            inst->platform->priv->egl.Flush();
+            job->fence_fd = inst->platform->priv->egl.DupNativeFenceFDANDROID(
+                    inst->internal_display->edpy, sync);
+            inst->platform->priv->egl.DestroySync(inst->internal_display->edpy, sync);
+            if (job->fence_fd >= 0)
+            {
+                return;
+            }
+        }
+    }
+
+    job->fence_sync = inst->platform->priv->egl.CreateSync(inst->internal_display->edpy,
+            EGL_SYNC_FENCE, NULL);
+    if (job->fence_sync != EGL_NO_SYNC)
+    {
+        // Flush so that the commit thread's eglClientWaitSync will finish
+        // without needing this thread's context.
+        inst->platform->priv->egl.Flush();
+        return;
+    }
+
+    inst->platform->priv->egl.Finish();
+}
+
+/**
+ * Copies a frame's damage rectangles into \c EplImplSurface::commit.rects,
+ * and points \p job at the copy.
+ */
+static EGLBoolean CopyCommitRects(EplSurface *psurf, WlCommitJob *job,
+        const EGLint *rects, EGLint n_rects)
+{
+    if (rects != NULL && n_rects > 0)
+    {
+        if ((size_t) n_rects > psurf->priv->commit.rects_capacity)
+        {
+            EGLint *buf = realloc(psurf->priv->commit.rects, n_rects * 4 * sizeof(EGLint));
+            if (buf == NULL)
+            {
+                eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC, "Out of memory");
+                return EGL_FALSE;
+            }
+            psurf->priv->commit.rects = buf;
+            psurf->priv->commit.rects_capacity = n_rects;
+        }
+        memcpy(psurf->priv->commit.rects, rects, n_rects * 4 * sizeof(EGLint));
+        job->rects = psurf->priv->commit.rects;
+        job->n_rects = n_rects;
+    }
+    else
+    {
+        job->rects = NULL;
+        job->n_rects = 0;
+    }
+    return EGL_TRUE;
+}
+
+/**
+ * Hands a frame off to the commit thread.
+ *
+ * If the application has a frame capture callback, then the commit thread
+ * calls it too, after it waits for rendering to finish.
+ */
+static EGLBoolean QueueCommit(EplSurface *psurf, WlPresentBuffer *present_buf,
+        EGLint swap_interval, uint64_t present_id, uint64_t target_time,
+        const EGLint *rects, EGLint n_rects)
+{
+    WlCommitJob *job = &psurf->priv->commit.job;
+
+    // The caller should have already waited for the previous frame.
+    assert(!psurf->priv->commit.pending);
+
+    if (!CopyCommitRects(psurf, job, rects, n_rects))
+    {
+        return EGL_FALSE;
+    }
+
+    CreateCommitFence(psurf, job);
+    job->present_buf = present_buf;
+    job->swap_interval = swap_interval;
+    job->present_id = present_id;
+    job->target_time = target_time;
+    job->capture_pending = PrepareCaptureFrame(psurf, present_buf, present_id, &job->capture);
+
+    pthread_mutex_lock(&psurf->priv->commit.mutex);
+    psurf->priv->commit.pending = EGL_TRUE;
+    pthread_cond_broadcast(&psurf->priv->commit.cond);
+    pthread_mutex_unlock(&psurf->priv->commit.mutex);
+
+    return EGL_TRUE;
+}
+
+/**
+ * Returns true if eglSwapBuffers should set this surface's frame aside for
+ * the current thread's present batch, instead of committing it right away.
+ */
+static EGLBoolean IsBatchingPresent(EplSurface *psurf)
+{
+    // With a commit thread, the frame is already committed asynchronously.
+    return present_batch.inst != NULL && present_batch.inst == psurf->priv->inst
+        && !psurf->priv->commit.thread_started;
+}
+
+/**
+ * Sets a frame aside for eglEndPresentBatchNVX to commit.
+ *
+ * The caller must have already called SyncRendering for the frame. The frame
+ * doesn't get a present ID until PresentBatchedFrame commits it, and it isn't
+ * captured until then, either.
+ *
+ * \param fence_fd The sync_file from SyncRendering for the frame capture
+ *      consumer, or -1. On success, this takes ownership of it.
+ */
+static EGLBoolean DeferPresent(EplSurface *psurf, WlPresentBuffer *present_buf,
+        EGLint swap_interval, int fence_fd, const EGLint *rects, EGLint n_rects)
+{
+    WlCommitJob *job = &psurf->priv->current.batch.job;
+
+    assert(!psurf->priv->current.batch.pending);
+
+    if (!CopyCommitRects(psurf, job, rects, n_rects))
+    {
+        return EGL_FALSE;
+    }
+
+    job->present_buf = present_buf;
+    job->swap_interval = swap_interval;
+    job->present_id = 0;
+    job->target_time = 0;
+    job->fence_fd = fence_fd;
+    job->fence_sync = EGL_NO_SYNC;
+    job->capture_pending = EGL_FALSE;
+
+    psurf->priv->current.swapchain->status[present_buf->slot] = BUFFER_STATUS_IN_USE;
+    psurf->priv->current.batch.batch_id = present_batch.id;
+    psurf->priv->current.batch.pending = EGL_TRUE;
+    return EGL_TRUE;
+}
+
+/**
+ * Throws away a surface's batched frame without committing it, if it has one.
+ */
+static void DropBatchedFrame(EplSurface *psurf)
+{
+    WlCommitJob *job = &psurf->priv->current.batch.job;
+
+    if (psurf->priv->current.batch.pending)
+    {
+        psurf->priv->current.swapchain->status[job->present_buf->slot] = BUFFER_STATUS_IDLE;
+        psurf->priv->current.batch.pending = EGL_FALSE;
+        if (job->fence_fd >= 0)
+        {
+            close(job->fence_fd);
+            job->fence_fd = -1;
+        }
+    }
+}
+
+/**
+ * Waits until a batched frame can be committed.
+ *
+ * If this fails, then the frame is dropped.
+ */
+static EGLBoolean WaitBatchedFrame(EplSurface *psurf)
+{
+    WlCommitJob *job = &psurf->priv->current.batch.job;
+
+    assert(psurf->priv->current.batch.pending);
+
+    if (!ThrottleFrame(psurf, job->swap_interval))
+    {
+        DropBatchedFrame(psurf);
+        return EGL_FALSE;
+    }
+    job->target_time = PaceFrame(psurf, job->swap_interval);
+    return EGL_TRUE;
+}
+
+/**
+ * Commits a batched frame, after WaitBatchedFrame. This doesn't flush the
+ * wl_display.
+ */
+static void PresentBatchedFrame(EplSurface *psurf)
+{
+    WlCommitJob *job = &psurf->priv->current.batch.job;
+
+    // Only hand out the present ID now, so that a frame that gets dropped
+    // in WaitBatchedFrame doesn't use one up.
+    job->present_id = ++psurf->priv->current.last_present_id;
+    PresentFrame(psurf, job->present_buf, job->swap_interval, job->present_id,
+            job->target_time, job->rects, job->n_rects, EGL_FALSE);
+    psurf->priv->current.batch.pending = EGL_FALSE;
+
+    // Only capture the frame once it's committed, so that the consumer never
+    // sees a frame that was dropped.
+    CaptureFrame(psurf, job->present_buf, job->present_id, job->fence_fd,
+            job->rects, job->n_rects);
+    job->fence_fd = -1;
+}
+
+/**
+ * Commits a surface's batched frame right away, if it has one.
+ *
+ * This is used for anything that needs the frame to be committed before the
+ * batch ends, like swapping the same surface twice in a batch.
+ */
+static EGLBoolean FlushBatchedFrame(EplSurface *psurf)
+{
+    if (!psurf->priv->current.batch.pending)
+    {
+        return EGL_TRUE;
+    }
+
+    if (!WaitBatchedFrame(psurf))
+    {
+        return EGL_FALSE;
+    }
+    PresentBatchedFrame(psurf);
+    wl_display_flush(psurf->priv->inst->wdpy);
+    return EGL_TRUE;
+}
+
+/**
+ * Checks whether the next eglSwapBuffers call could go through without
+ * blocking.
+ *
+ * This only looks at the current state. It doesn't read or dispatch any
+ * events.
+ */
+static EGLBoolean IsSurfaceReady(EplSurface *psurf)
+{
+    WlDisplayInstance *inst = psurf->priv->inst;
+    WlSwapChain *swapchain = psurf->priv->current.swapchain;
+    uint32_t handles[WL_MAX_PRESENT_BUFFERS];
+    uint64_t points[WL_MAX_PRESENT_BUFFERS];
+    uint32_t count = 0;
+    uint32_t first;
+    uint32_t i;
+    EGLint swap_interval;
+    EGLBoolean resized;
+    int timeout;
+
+    // A single-buffered surface never waits for the compositor or for a
+    // buffer.
+    if (psurf->priv->single_buffer)
+    {
+        return EGL_TRUE;
+    }
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    swap_interval = psurf->priv->params.swap_interval;
+    resized = (psurf->priv->params.pending_width != (EGLint) swapchain->display_width
+            || psurf->priv->params.pending_height != (EGLint) swapchain->display_height);
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    if (psurf->priv->present_mode == EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX)
+    {
+        swap_interval = 0;
+    }
+
+    // These are the same conditions that WaitForPreviousFrames waits for.
+    if (swap_interval > 0
+            && (CheckFrameThrottle(psurf, &timeout)
+                || psurf->priv->current.last_swap_sync != NULL
+                || psurf->priv->current.completed_present_id < psurf->priv->current.throttle_present_id))
+    {
+        return EGL_FALSE;
+    }
+
+    // If the window was resized, or if eglSwapBuffers would allocate another
+    // buffer instead of waiting, then it won't have to wait for a buffer to
+    // free up.
+    if (resized || eplWlSwapChainCanAllocatePresentBuffer(inst, swapchain))
+    {
+        return EGL_TRUE;
+    }
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        if (!eplWlSwapChainNeedsCopy(swapchain) && &swapchain->buffers[i] == swapchain->current_back)
+        {
+            // Without a PRIME copy, we need a free buffer other than the one
+            // that we're about to present.
+            continue;
+        }
+        if (swapchain->buffers[i].capture_id != 0)
+        {
+            // A frame capture consumer is still reading from this buffer.
+            continue;
+        }
+
+        // For implicit sync, once we've got a wl_buffer::release event,
+        // eglSwapBuffers can just do a GPU wait for the buffer.
+        if (swapchain->status[i] == BUFFER_STATUS_IDLE
+                || swapchain->status[i] == BUFFER_STATUS_IDLE_NOTIFIED)
+        {
+            return EGL_TRUE;
+        }
+
+        if (inst->globals.syncobj != NULL)
+        {
+            handles[count] = swapchain->timeline_handles[i];
+            points[count] = swapchain->buffers[i].timeline.point;
+            count++;
+        }
+    }
+
+    // Likewise, for explicit sync, we only need the release point to be
+    // available, not signaled.
+    if (count > 0 && inst->platform->priv->drm.SyncobjTimelineWait(
+                gbm_device_get_fd(inst->gbmdev), handles, points, count, 0,
+                DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE, &first) == 0)
+    {
+        return EGL_TRUE;
+    }
+
+    return EGL_FALSE;
+}
+
+/**
+ * Asks the kernel to signal \c EplImplSurface::ready.release_fd when any of
+ * the current swapchain's release points becomes available.
+ *
+ * \return EGL_TRUE if the release points are registered, or EGL_FALSE if the
+ *      caller will have to poll them instead.
+ */
+static EGLBoolean RegisterReleaseEventfd(EplSurface *psurf)
+{
+    WlDisplayInstance *inst = psurf->priv->inst;
+    WlSwapChain *swapchain = psurf->priv->current.swapchain;
+    uint32_t i;
+
+    if (psurf->priv->ready.release_fd < 0)
+    {
+        return EGL_FALSE;
+    }
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        if (swapchain->status[i] != BUFFER_STATUS_IDLE)
+        {
+            if (inst->platform->priv->drm.SyncobjEventfd(gbm_device_get_fd(inst->gbmdev),
+                        swapchain->timeline_handles[i], swapchain->buffers[i].timeline.point,
+                        psurf->priv->ready.release_fd, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE) != 0)
+            {
+                return EGL_FALSE;
+            }
+        }
+    }
+
+    return EGL_TRUE;
+}
+
+static void DrainEventfd(int fd)
+{
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+    {
+    }
+}
+
+/**
+ * Reads and dispatches events for the surface until the next eglSwapBuffers
+ * call wouldn't block, or until the watch is paused.
+ *
+ * This is called from the ready thread.
+ *
+ * \return EGL_TRUE if the surface is ready, or EGL_FALSE if the watch was
+ *      paused or we ran into an error.
+ */
+static EGLBoolean WatchSurfaceReady(EplSurface *psurf)
+{
+    EplImplSurface *priv = psurf->priv;
+    struct wl_display *wdpy = priv->inst->wdpy;
+    struct wl_event_queue *queue = priv->current.queue;
+    struct wl_event_queue *swapchain_queue;
+    EGLBoolean poll_release = EGL_FALSE;
+
+    // Wait for the commit thread first, so that we're not dispatching events
+    // while it's sending requests.
+    WaitForPendingCommit(psurf);
+
+    if (!eplWlDisplayInstanceIsNativeValid(priv->inst))
+    {
+        return EGL_FALSE;
+    }
+
+    swapchain_queue = priv->current.swapchain->queue;
+    if (priv->inst->globals.syncobj != NULL)
+    {
+        // If we can't get an eventfd for the release points, then we have to
+        // check them periodically instead.
+        poll_release = !RegisterReleaseEventfd(psurf);
+    }
+
+    while (1)
+    {
+        struct pollfd fds[3];
+        nfds_t nfds = 2;
+        EGLBoolean armed;
+        int timeout_ms;
+        int frame_timeout;
+        int ret;
+
+        if (wl_display_dispatch_queue_pending(wdpy, queue) < 0
+                || wl_display_dispatch_queue_pending(wdpy, swapchain_queue) < 0)
+        {
+            return EGL_FALSE;
+        }
+
+        if (IsSurfaceReady(psurf))
+        {
+            uint64_t one = 1;
+            while (write(priv->ready.event_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+            {
+            }
+            return EGL_TRUE;
+        }
+
+        // If the window might be occluded, then we still have to send the
+        // extra FIFO commit, or we could end up waiting forever.
+        SendOcclusionCommit(psurf);
+        timeout_ms = GetOcclusionTimeout(psurf);
+        CheckFrameThrottle(psurf, &frame_timeout);
+        if (frame_timeout >= 0 && (timeout_ms < 0 || frame_timeout < timeout_ms))
+        {
+            timeout_ms = frame_timeout;
+        }
+        if (poll_release && (timeout_ms < 0 || timeout_ms > READY_RELEASE_POLL_INTERVAL))
+        {
+            timeout_ms = READY_RELEASE_POLL_INTERVAL;
+        }
+
+        while (wl_display_prepare_read_queue(wdpy, queue) != 0)
+        {
+            if (wl_display_dispatch_queue_pending(wdpy, queue) < 0)
+            {
+                return EGL_FALSE;
+            }
+        }
+
+        // Once we've called prepare_read, nothing else can read new events
+        // until we do, so it's safe to check the swapchain's queue here.
+        ret = wl_display_dispatch_queue_pending(wdpy, swapchain_queue);
+        if (ret != 0)
+        {
+            wl_display_cancel_read(wdpy);
+            if (ret < 0)
+            {
+                return EGL_FALSE;
+            }
+            continue;
+        }
+
+        wl_display_flush(wdpy);
+
+        fds[0].fd = wl_display_get_fd(wdpy);
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = priv->ready.wake_fd;
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (priv->ready.release_fd >= 0 && !poll_release)
+        {
+            fds[2].fd = priv->ready.release_fd;
+            fds[2].events = POLLIN;
+            fds[2].revents = 0;
+            nfds = 3;
+        }
+
+        ret = poll(fds, nfds, timeout_ms);
+        if (ret > 0 && (fds[0].revents & POLLIN))
+        {
+            if (wl_display_read_events(wdpy) < 0)
+            {
+                return EGL_FALSE;
+            }
+        }
+        else
+        {
+            wl_display_cancel_read(wdpy);
+        }
+
+        if (ret > 0 && nfds > 2 && (fds[2].revents & POLLIN))
+        {
+            DrainEventfd(priv->ready.release_fd);
+        }
+        if (ret > 0 && (fds[1].revents & POLLIN))
+        {
+            DrainEventfd(priv->ready.wake_fd);
+
+            pthread_mutex_lock(&priv->ready.mutex);
+            armed = priv->ready.armed;
+            pthread_mutex_unlock(&priv->ready.mutex);
+            if (!armed)
+            {
+                return EGL_FALSE;
+            }
+        }
+    }
+}
+
+static void *ReadyThreadProc(void *param)
+{
+    EplSurface *psurf = param;
+    EplImplSurface *priv = psurf->priv;
+
+    pthread_mutex_lock(&priv->ready.mutex);
+    while (1)
+    {
+        while (!priv->ready.armed && !priv->ready.quit)
+        {
+            pthread_cond_wait(&priv->ready.cond, &priv->ready.mutex);
+        }
+        if (priv->ready.quit)
+        {
+            break;
+        }
+
+        priv->ready.busy = EGL_TRUE;
+        pthread_mutex_unlock(&priv->ready.mutex);
+
+        WatchSurfaceReady(psurf);
+
+        // Either the surface is ready, in which case we're done until the
+        // next eglSwapBuffers, or we got paused or hit an error. Either way,
+        // wait until we're armed again.
+        pthread_mutex_lock(&priv->ready.mutex);
+        priv->ready.busy = EGL_FALSE;
+        priv->ready.armed = EGL_FALSE;
+        pthread_cond_broadcast(&priv->ready.cond);
+    }
+    pthread_mutex_unlock(&priv->ready.mutex);
+
+    return NULL;
+}
+
+/**
+ * Starts the ready thread and creates the eventfds for
+ * EGL_NVX_wayland_ready_fd, if we haven't already.
+ */
+static EGLBoolean StartReadyThread(EplSurface *psurf)
+{
+    EplImplSurface *priv = psurf->priv;
+    EplPlatformData *plat = priv->inst->platform;
+    EGLBoolean success = EGL_FALSE;
+
+    pthread_mutex_lock(&priv->ready.mutex);
+    if (priv->ready.thread_started)
+    {
+        pthread_mutex_unlock(&priv->ready.mutex);
+        return EGL_TRUE;
+    }
+
+    priv->ready.event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    priv->ready.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (priv->ready.event_fd < 0 || priv->ready.wake_fd < 0)
+    {
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create eventfd: %s", strerror(errno));
+        goto done;
+    }
+
+    if (priv->inst->globals.syncobj != NULL && plat->priv->drm.SyncobjEventfd != NULL)
+    {
+        // This one is optional. Without it, we just poll the release points.
+        priv->ready.release_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    }
+
+    // Start out armed, so that the fd becomes readable right away if the
+    // surface is already ready.
+    priv->ready.armed = EGL_TRUE;
+    if (pthread_create(&priv->ready.thread, NULL, ReadyThreadProc, psurf) != 0)
+    {
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to create helper thread");
+        priv->ready.armed = EGL_FALSE;
+        goto done;
+    }
+    priv->ready.thread_started = EGL_TRUE;
+    success = EGL_TRUE;
+
+done:
+    if (!success)
+    {
+        if (priv->ready.event_fd >= 0)
+        {
+            close(priv->ready.event_fd);
+            priv->ready.event_fd = -1;
+        }
+        if (priv->ready.wake_fd >= 0)
+        {
+            close(priv->ready.wake_fd);
+            priv->ready.wake_fd = -1;
+        }
+        if (priv->ready.release_fd >= 0)
+        {
+            close(priv->ready.release_fd);
+            priv->ready.release_fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&priv->ready.mutex);
+    return success;
+}
+
+/**
+ * Stops the ready thread from touching the surface, and waits for it to
+ * finish anything that it's in the middle of.
+ *
+ * This also clears the application's eventfd, since the surface state is
+ * about to change.
+ */
+static void PauseReadyWatch(EplSurface *psurf)
+{
+    EplImplSurface *priv = psurf->priv;
+
+    pthread_mutex_lock(&priv->ready.mutex);
+    if (priv->ready.thread_started)
+    {
+        uint64_t one = 1;
+
+        priv->ready.armed = EGL_FALSE;
+        while (write(priv->ready.wake_fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        {
+        }
+        while (priv->ready.busy)
+        {
+            pthread_cond_wait(&priv->ready.cond, &priv->ready.mutex);
+        }
+        DrainEventfd(priv->ready.wake_fd);
+        DrainEventfd(priv->ready.event_fd);
+    }
+    pthread_mutex_unlock(&priv->ready.mutex);
+}
+
+/**
+ * Tells the ready thread to start watching the surface again.
+ */
+static void ResumeReadyWatch(EplSurface *psurf)
+{
+    EplImplSurface *priv = psurf->priv;
+
+    pthread_mutex_lock(&priv->ready.mutex);
+    if (priv->ready.thread_started)
+    {
+        priv->ready.armed = EGL_TRUE;
+        pthread_cond_broadcast(&priv->ready.cond);
+    }
+    pthread_mutex_unlock(&priv->ready.mutex);
+}
+
+static void StopReadyThread(EplSurface *psurf)
+{
+    EplImplSurface *priv = psurf->priv;
+
+    PauseReadyWatch(psurf);
+
+    pthread_mutex_lock(&priv->ready.mutex);
+    if (!priv->ready.thread_started)
+    {
+        pthread_mutex_unlock(&priv->ready.mutex);
+        return;
+    }
+    priv->ready.quit = EGL_TRUE;
+    pthread_cond_broadcast(&priv->ready.cond);
+    pthread_mutex_unlock(&priv->ready.mutex);
+
+    pthread_join(priv->ready.thread, NULL);
+    priv->ready.thread_started = EGL_FALSE;
+
+    close(priv->ready.event_fd);
+    close(priv->ready.wake_fd);
+    if (priv->ready.release_fd >= 0)
+    {
+        close(priv->ready.release_fd);
+    }
+    priv->ready.event_fd = -1;
+    priv->ready.wake_fd = -1;
+    priv->ready.release_fd = -1;
+}
+
+/**
+ * Hands any frames that the frame capture consumer has released back to the
+ * swapchain, so that we can render to them again.
+ *
+ * If the buffer belonged to a swapchain that we've since freed, then we just
+ * drop the release fence.
+ */
+static void CollectCaptureReleases(EplSurface *psurf)
+{
+    WlSwapChain *swapchain = psurf->priv->current.swapchain;
+    WlSwapChain *spare = psurf->priv->current.dynres.spare;
+    uint32_t i;
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    for (i=0; i<MAX_CAPTURE_HOLDS; i++)
+    {
+        WlCaptureHold *hold = &psurf->priv->capture.holds[i];
+
+        if (hold->id == 0 || !hold->released)
+        {
+            continue;
+        }
+
+        if (!(swapchain != NULL && eplWlSwapChainReleaseCapture(swapchain, hold->id, hold->release_fd))
+                && !(spare != NULL && eplWlSwapChainReleaseCapture(spare, hold->id, hold->release_fd))
+                && hold->release_fd >= 0)
+        {
+            close(hold->release_fd);
+        }
+        hold->id = 0;
+        hold->released = EGL_FALSE;
+        hold->release_fd = -1;
+    }
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+}
+
+/**
+ * Returns true if the application has set a frame capture callback.
+ */
+static EGLBoolean HasCaptureCallback(EplSurface *psurf)
+{
+    EGLBoolean ret;
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    ret = (psurf->priv->capture.callback != NULL);
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+    return ret;
+}
+
+/**
+ * Claims a capture hold for a frame, and fills in \p frame, except for the
+ * acquire fence and the damage rectangles.
+ *
+ * The buffer stays out of the swapchain's rotation until the consumer
+ * releases it with eglReleaseCaptureFrameNVX.
+ *
+ * \return EGL_TRUE if the caller should pass \p frame to DeliverCaptureFrame,
+ *      or EGL_FALSE if we're not capturing this frame.
+ */
+static EGLBoolean PrepareCaptureFrame(EplSurface *psurf, WlPresentBuffer *present_buf,
+        uint64_t present_id, EGLWaylandCaptureFrameNVX *frame)
+{
+    WlSwapChain *swapchain = psurf->priv->current.swapchain;
+    EGLBoolean have_callback;
+    WlCaptureHold *hold = NULL;
+    uint32_t i;
+
+    /*
+     * Only the thread that presents the surface's frames claims an entry in
+     * the holds array, either in eglSwapBuffers or when it commits a batched
+     * frame, and only CollectCaptureReleases frees one. So, once we've found
+     * a free entry here, it'll stay free until we fill it in.
+     */
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    have_callback = (psurf->priv->capture.callback != NULL);
+    for (i=0; i<MAX_CAPTURE_HOLDS; i++)
+    {
+        if (psurf->priv->capture.holds[i].id == 0)
+        {
+            hold = &psurf->priv->capture.holds[i];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+
+    if (!have_callback)
+    {
+        return EGL_FALSE;
+    }
+    if (hold == NULL)
+    {
+        eplWlPerfWarning(psurf->priv->inst->platform, WL_PERF_WARNING_CAPTURE_DROPPED,
+                "The frame capture consumer is holding too many frames, so a frame was not captured");
+        return EGL_FALSE;
+    }
+
+    memset(frame, 0, sizeof(*frame));
+    frame->dmabufFd = eplWlSwapChainExportPresentBuffer(psurf->priv->inst, present_buf);
+    if (frame->dmabufFd < 0)
+    {
+        return EGL_FALSE;
+    }
+    frame->acquireFenceFd = -1;
+    frame->presentId = present_id;
+    frame->width = swapchain->width;
+    frame->height = swapchain->height;
+    frame->fourcc = (EGLint) swapchain->present_fourcc;
+    frame->stride = present_buf->stride;
+    frame->offset = present_buf->offset;
+    frame->modifier = swapchain->modifier;
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    frame->captureId = psurf->priv->capture.next_id++;
+    hold->id = frame->captureId;
+    hold->released = EGL_FALSE;
+    hold->release_fd = -1;
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+
+    present_buf->capture_id = frame->captureId;
+    return EGL_TRUE;
+}
+
+/**
+ * Calls the application's frame capture callback with a frame from
+ * PrepareCaptureFrame.
+ *
+ * This is called from the commit thread if there is one. If the application
+ * removed its callback in the meantime, then this just releases the frame.
+ */
+static void DeliverCaptureFrame(EplSurface *psurf, EGLWaylandCaptureFrameNVX *frame,
+        const EGLint *rects, EGLint n_rects)
+{
+    PFNEGLWAYLANDCAPTURECALLBACKNVX callback;
+    void *user_data;
+    uint32_t i;
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    callback = psurf->priv->capture.callback;
+    user_data = psurf->priv->capture.user_data;
+    if (callback != NULL)
+    {
+        psurf->priv->capture.delivering = EGL_TRUE;
+        psurf->priv->capture.delivery_thread = pthread_self();
+    }
+    else
+    {
+        for (i=0; i<MAX_CAPTURE_HOLDS; i++)
+        {
+            if (psurf->priv->capture.holds[i].id == frame->captureId)
+            {
+                psurf->priv->capture.holds[i].released = EGL_TRUE;
+                psurf->priv->capture.holds[i].release_fd = -1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+
+    if (callback == NULL)
+    {
+        close(frame->dmabufFd);
+        if (frame->acquireFenceFd >= 0)
+        {
+            close(frame->acquireFenceFd);
+        }
+        return;
+    }
+
+    frame->rects = (n_rects > 0 ? rects : NULL);
+    frame->numRects = (n_rects > 0 ? n_rects : 0);
+    callback(frame, user_data);
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    psurf->priv->capture.delivering = EGL_FALSE;
+    pthread_cond_broadcast(&psurf->priv->capture.cond);
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+}
+
+/**
+ * Hands the frame that we just presented to the application's frame capture
+ * callback, if it set one.
+ *
+ * With a commit thread, QueueCommit takes care of this instead.
+ *
+ * \param fence_fd The sync_file from SyncRendering, or -1. This function
+ *      takes ownership of it.
+ */
+static void CaptureFrame(EplSurface *psurf, WlPresentBuffer *present_buf,
+        uint64_t present_id, int fence_fd, const EGLint *rects, EGLint n_rects)
+{
+    EGLWaylandCaptureFrameNVX frame;
+    WL_TRACE_BEGIN(trace);
+
+    if (PrepareCaptureFrame(psurf, present_buf, present_id, &frame))
+    {
+        frame.acquireFenceFd = fence_fd;
+        DeliverCaptureFrame(psurf, &frame, rects, n_rects);
+    }
+    else if (fence_fd >= 0)
+    {
+        close(fence_fd);
+    }
+
+    WL_TRACE_END(trace, "CaptureFrame");
+}
+
+EGLBoolean eplWlSwapBuffers(EplPlatformData *plat, EplDisplay *pdpy,
+        EplSurface *psurf, const EGLint *rects, EGLint n_rects)
+{
+    WlDisplayInstance *inst = pdpy->priv->inst;
+    WlPresentBuffer *present_buf = NULL;
+    WlSwapChain *new_swapchain = NULL;
+    WlSwapChainBuild *new_build = NULL;
+    EGLBoolean success = EGL_FALSE;
+    EGLint swap_interval;
+    uint64_t blocked_ns = 0;
+    uint64_t wait_start;
+    int capture_fence = -1;
+    WL_TRACE_BEGIN(trace_swap);
+
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    if (psurf->priv->params.native_window == NULL)
+    {
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        eplSetError(plat, EGL_BAD_NATIVE_WINDOW, "wl_egl_window has been destroyed");
+        return EGL_FALSE;
+    }
+
+    swap_interval = psurf->priv->params.swap_interval;
+    psurf->priv->params.skip_update_callback++;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    if (EGL_PLATFORM_SURFACE_INTERFACE_CHECK_VERSION(plat->priv->egl.platform_surface_version,
+                EGL_PLATFORM_SURFACE_INTERNAL_SWAP_SINCE))
+    {
+        // Call into the driver to do any extra pre-present work.
+        if (!plat->egl.SwapBuffers(inst->internal_display->edpy, psurf->internal_surface))
+        {
+            goto done;
+        }
+    }
+
+    // Make sure the helper threads are done with the previous frame before we
+    // dispatch any events or touch any of the Wayland state that they use.
+    {
+        WL_TRACE_BEGIN(trace);
+        wait_start = GetMonotonicTime();
+        PauseReadyWatch(psurf);
+        WaitForPendingCommit(psurf);
+        blocked_ns += GetMonotonicTime() - wait_start;
+        WL_TRACE_END(trace, "WaitForPendingCommit");
+    }
+
+    // If the app swaps the same surface twice in a present batch, then the
+    // earlier frame has to go first.
+    if (!FlushBatchedFrame(psurf))
+    {
+        goto done;
+    }
+
+    CollectCaptureReleases(psurf);
+
+    if (psurf->priv->present_mode == EGL_WAYLAND_PRESENT_MODE_MAILBOX_NVX
+            || psurf->priv->single_buffer)
+    {
+        /*
+         * Mailbox mode never waits for the compositor, so nothing else would
+         * read events from the socket for us. Poll for them here so that we
+         * keep up with buffer releases and presentation feedback.
+         *
+         * The swap interval doesn't apply to mailbox mode, so treat it as
+         * zero for everything below. Likewise, a single-buffered surface
+         * only posts damage, so it never waits.
+         */
+        if (!PollSurfaceEvents(psurf, 0))
+        {
+            eplSetError(plat, EGL_BAD_ALLOC, "Failed to dispatch Wayland events");
+            goto done;
+        }
+        swap_interval = 0;
+    }
+    else
+    {
+        // Dispatch any pending events, but don't block for them. This will
+        // ensure that we pick up any modifier changes that the server might
+        // have sent.
+        wl_display_dispatch_queue_pending(psurf->priv->inst->wdpy, psurf->priv->current.queue);
+    }
+
+    UpdateDynamicResolution(psurf, swap_interval);
+    TrimIdleBuffers(psurf);
+
+    // If the window has been resized, or the compositor wants different
+    // modifiers, then start allocating a new swapchain on the build thread.
+    // We keep presenting with the current swapchain until the new one is
+    // ready. If we can't do that, then we get the build back in new_build,
+    // and we wait for it after presenting this frame.
+    if (!SwapChainRealloc(psurf, EGL_TRUE, &new_swapchain, &new_build))
+    {
+        eplSetError(plat, EGL_BAD_ALLOC, "Failed to allocate resized buffers");
+        goto done;
+    }
+
+    if (eplWlSwapChainNeedsCopy(psurf->priv->current.swapchain))
+    {
+        // For PRIME, we need to find a free present buffer up front so that we
+        // can blit to it.
+        wait_start = GetMonotonicTime();
+        present_buf = eplWlSwapChainFindFreePresentBuffer(inst,
+                psurf->priv->current.swapchain);
+        blocked_ns += GetMonotonicTime() - wait_start;
+        if (present_buf == NULL)
+        {
+            goto done;
+        }
+        {
+            EGLBoolean copied;
+            WL_TRACE_BEGIN(trace);
+
+            copied = plat->priv->egl.PlatformCopyColorBufferNVX(inst->internal_display->edpy,
+                    psurf->priv->current.swapchain->render_buffer,
+                    present_buf->buffer);
+            WL_TRACE_END(trace, "PlatformCopyColorBufferNVX");
+            if (!copied)
+            {
+                eplSetError(plat, EGL_BAD_ALLOC, "Driver error: Failed to blit to shared wl_buffer");
+                goto done;
+            }
+            WL_STATS_SURFACE_ADD(psurf->priv->stats, prime_copies, 1);
+            eplWlPerfWarning(plat, WL_PERF_WARNING_PRIME_COPY,
+                    "The compositor can't use the rendering GPU's buffers directly, so each frame is copied");
+        }
+    }
+    else
+    {
+        // For non-PRIME, or PRIME without a copy, we can present the current
+        // back buffer directly. We don't need a new back buffer until after
+        // presenting (which might free up an existing buffer).
+        present_buf = psurf->priv->current.swapchain->current_back;
+    }
+
+    // If we've got a commit thread, then it will wait for rendering to
+    // finish instead. Otherwise, if we're capturing frames, then hang on to
+    // the rendering fence for the capture consumer.
+    if (!psurf->priv->commit.thread_started
+            && !SyncRendering(psurf, present_buf,
+                HasCaptureCallback(psurf) ? &capture_fence : NULL))
+    {
+        goto done;
+    }
+
+    if (IsBatchingPresent(psurf) && new_build == NULL && new_swapchain == NULL)
+    {
+        // Leave the throttling and the commit for eglEndPresentBatchNVX. If
+        // we're switching to a new swapchain, though, then the frame has to
+        // go out before we free the old buffers.
+        if (!DeferPresent(psurf, present_buf, swap_interval, capture_fence, rects, n_rects))
+        {
+            goto done;
+        }
+        capture_fence = -1;
+    }
+    else
+    {
+        EGLBoolean throttled;
+        uint64_t target_time;
+
+        wait_start = GetMonotonicTime();
+        throttled = ThrottleFrame(psurf, swap_interval);
+        blocked_ns += GetMonotonicTime() - wait_start;
+        if (!throttled)
+        {
+            goto done;
+        }
+
+        // Do any pacing sleep here, so that the commit thread doesn't.
+        target_time = PaceFrame(psurf, swap_interval);
+
+        psurf->priv->current.swapchain->status[present_buf->slot] = BUFFER_STATUS_IN_USE;
+
+        if (psurf->priv->commit.thread_started)
+        {
+            if (!QueueCommit(psurf, present_buf, swap_interval,
+                        psurf->priv->current.last_present_id + 1, target_time, rects, n_rects))
+            {
+                psurf->priv->current.swapchain->status[present_buf->slot] = BUFFER_STATUS_IDLE;
+                goto done;
+            }
+        }
+        else
+        {
+            PresentFrame(psurf, present_buf, swap_interval,
+                    psurf->priv->current.last_present_id + 1, target_time, rects, n_rects, EGL_TRUE);
+        }
+        psurf->priv->current.last_present_id++;
+
+        // Capture the frame before we switch swapchains, since that could
+        // free the buffer. With a commit thread, QueueCommit already set
+        // that up.
+        if (!psurf->priv->commit.thread_started)
+        {
+            CaptureFrame(psurf, present_buf, psurf->priv->current.last_present_id,
+                    capture_fence, rects, n_rects);
+            capture_fence = -1;
+        }
+    }
+
+    if (new_build != NULL)
+    {
+        assert(new_swapchain == NULL);
+        new_swapchain = FinishSwapChainBuild(psurf, new_build);
+        new_build = NULL;
+        if (new_swapchain == NULL)
+        {
+            // We've already presented this frame, so keep going with the old
+            // swapchain, and try again on the next frame.
+            psurf->priv->current.force_realloc = EGL_TRUE;
+        }
+    }
+
+    if (new_swapchain != NULL)
+    {
+        SetWindowSwapchain(psurf, new_swapchain);
+        new_swapchain = NULL;
+    }
+    else if (psurf->priv->single_buffer)
+    {
+        // Keep rendering into the same buffer, which now holds the frame that
+        // we just presented.
+        eplWlSwapChainUpdateBufferAge(inst, psurf->priv->current.swapchain,
+                present_buf, rects, n_rects);
+    }
+    else if (!eplWlSwapChainNeedsCopy(psurf->priv->current.swapchain))
+    {
+        // Find a free buffer to use as the new back buffer.
+        WlPresentBuffer *next_back;
+        EGLAttrib buffers[] = { GL_BACK, 0, EGL_NONE };
+
+        // Update the buffer ages first, so that picking the next back buffer
+        // can account for this frame's damage.
+        eplWlSwapChainUpdateBufferAge(inst, psurf->priv->current.swapchain,
+                present_buf, rects, n_rects);
+
+        wait_start = GetMonotonicTime();
+        next_back = eplWlSwapChainFindFreePresentBuffer(inst,
+                psurf->priv->current.swapchain);
+        blocked_ns += GetMonotonicTime() - wait_start;
+
+        if (psurf->priv->current.swapchain->repaint_saved != 0)
+        {
+            WL_STATS_SURFACE_ADD(psurf->priv->stats, repaint_pixels_saved,
+                    psurf->priv->current.swapchain->repaint_saved);
+            psurf->priv->current.swapchain->repaint_saved = 0;
+        }
+
+        if (next_back == NULL)
+        {
+            psurf->priv->current.force_realloc = EGL_TRUE;
+            goto done;
+        }
+
+        buffers[1] = (EGLAttrib) next_back->buffer;
+
+        if (!psurf->priv->inst->platform->priv->egl.PlatformSetColorBuffersNVX(
+                    psurf->priv->inst->internal_display->edpy,
+                    psurf->internal_surface, buffers))
+        {
+            // Note that this should nver fail. The surface is the same size,
+            // so the driver doesn't have to reallocate anything.
+            psurf->priv->current.force_realloc = EGL_TRUE;
+            goto done;
+        }
+
+        psurf->priv->current.swapchain->current_back = next_back;
+        psurf->priv->current.swapchain->render_buffer = next_back->buffer;
+    }
+
+    // Note that for PRIME, since we don't have a front buffer at all, so we
+    // can just keep using the same back buffer.
+
+    eplWlStatsRecordSwap(psurf->priv->stats, blocked_ns);
+    success = EGL_TRUE;
+
+done:
+    if (capture_fence >= 0)
+    {
+        close(capture_fence);
+    }
+    if (new_build != NULL)
+    {
+        eplWlSwapChainDestroy(psurf->priv->inst, FinishSwapChainBuild(psurf, new_build));
+    }
     if (new_swapchain != NULL)
     {
-        SetWindowSwapchain(psurf, new_swapchain);
-        new_swapchain = NULL;
+        eplWlSwapChainDestroy(psurf->priv->inst, new_swapchain);
+    }
+    UpdateMemoryUsage(psurf);
+    ResumeReadyWatch(psurf);
+    pthread_mutex_lock(&psurf->priv->params.mutex);
+    psurf->priv->params.skip_update_callback--;
+    pthread_mutex_unlock(&psurf->priv->params.mutex);
+
+    WL_TRACE_END(trace_swap, "eglSwapBuffers");
+    eplWlTraceDumpIfRequested();
+    return success;
+}
+
+EGLBoolean eplWlSwapInterval(EplDisplay *pdpy, EplSurface *psurf, EGLint interval)
+{
+    if (psurf->type == EPL_SURFACE_TYPE_WINDOW)
+    {
+        if (interval < 0)
+        {
+            interval = 0;
+        }
+
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        psurf->priv->params.swap_interval = interval;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+    }
+    return EGL_TRUE;
+}
+
+EGLBoolean eplWlWaitGL(EplDisplay *pdpy, EplSurface *psurf)
+{
+    EGLBoolean ret = EGL_TRUE;
+
+    pdpy->platform->priv->egl.Finish();
+    if (psurf != NULL && psurf->type == EPL_SURFACE_TYPE_WINDOW)
+    {
+        PauseReadyWatch(psurf);
+        WaitForPendingCommit(psurf);
+        if (!FlushBatchedFrame(psurf))
+        {
+            ret = EGL_FALSE;
+        }
+
+        /*
+         * Wait until the server has received the commit from the last
+         * eglSwapBuffers.
+         *
+         * If possible, we'll also wait for the presentation feedback so that
+         * the last frame is actually on screen.
+         *
+         * Note that if we don't have presentation timing support, then we do
+         * NOT wait for a wl_surface::frame callback, because that could block
+         * forever.
+         */
+
+        while (psurf->priv->current.completed_present_id < psurf->priv->current.throttle_present_id
+                || psurf->priv->current.last_swap_sync != NULL)
+        {
+            if (!DispatchSurfaceEvents(psurf))
+            {
+                eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC,
+                        "Failed to dispatch Wayland events");
+                ret = EGL_FALSE;
+                break;
+            }
+        }
+
+        ResumeReadyWatch(psurf);
+    }
+
+    return ret;
+}
+
+EplQueryResult eplWlQuerySurface(EplDisplay *pdpy, EplSurface *psurf, EGLint attrib, EGLint *ret_value)
+{
+    if (attrib == EGL_BUFFER_AGE_KHR)
+    {
+        if (eplWlSwapChainNeedsCopy(psurf->priv->current.swapchain))
+        {
+            *ret_value = 0;
+        }
+        else
+        {
+            *ret_value = psurf->priv->current.swapchain->current_back->buffer_age;
+        }
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_PRESENT_MODE_NVX)
+    {
+        *ret_value = psurf->priv->present_mode;
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_RENDER_BUFFER)
+    {
+        *ret_value = (psurf->priv->single_buffer ? EGL_SINGLE_BUFFER : EGL_BACK_BUFFER);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_BUFFER_SELECTION_NVX)
+    {
+        *ret_value = psurf->priv->buffer_selection;
+        return EPL_QUERY_RESULT_SUCCESS;
     }
-    else if (!psurf->priv->current.swapchain->prime)
+    else if (attrib == EGL_WAYLAND_RENDER_SCALE_NVX)
     {
-        // For non-PRIME, find a free buffer to use as the new back buffer.
-        WlPresentBuffer *next_back = eplWlSwapChainFindFreePresentBuffer(inst,
-                psurf->priv->current.swapchain);
-        EGLAttrib buffers[] = { GL_BACK, 0, EGL_NONE };
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        *ret_value = (EGLint) psurf->priv->params.render_scale;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_DROPPED_FRAMES_NVX)
+    {
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        *ret_value = psurf->priv->params.dropped_frames;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_TARGET_FRAME_DURATION_NVX)
+    {
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        *ret_value = (EGLint) (psurf->priv->params.target_frame_duration < INT_MAX
+                ? psurf->priv->params.target_frame_duration : INT_MAX);
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_RECLAIMED_MEMORY_NVX)
+    {
+        uint64_t kb;
 
-        if (next_back == NULL)
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        kb = psurf->priv->params.reclaimed_bytes / 1024;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        *ret_value = (EGLint) (kb < INT_MAX ? kb : INT_MAX);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_SURFACE_MEMORY_NVX)
+    {
+        uint64_t kb;
+
+        pthread_mutex_lock(&psurf->priv->params.mutex);
+        kb = psurf->priv->params.memory_bytes / 1024;
+        pthread_mutex_unlock(&psurf->priv->params.mutex);
+        *ret_value = (EGLint) (kb < INT_MAX ? kb : INT_MAX);
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else if (attrib == EGL_WAYLAND_READY_FD_NVX)
+    {
+        if (!StartReadyThread(psurf))
         {
-            psurf->priv->current.force_realloc = EGL_TRUE;
-            goto done;
+            return EPL_QUERY_RESULT_ERROR;
         }
+        *ret_value = psurf->priv->ready.event_fd;
+        return EPL_QUERY_RESULT_SUCCESS;
+    }
+    else
+    {
+        return EPL_QUERY_RESULT_UNKNOWN;
+    }
+}
 
-        buffers[1] = (EGLAttrib) next_back->buffer;
+/**
+ * Common lookup and validation for the EGL_NVX_wayland_present_wait hooks.
+ *
+ * Like eglSwapBuffers, these functions require the surface to be current, so
+ * that nothing else can be using the surface's event queue at the same time.
+ *
+ * On success, the caller must call \c eplHookDisplaySurfaceEnd afterward.
+ */
+static EGLBoolean PresentWaitHookBegin(EGLDisplay edpy, EGLSurface esurf,
+        EplDisplay **ret_pdpy, EplSurface **ret_psurf)
+{
+    EplDisplay *pdpy;
+    EplSurface *psurf;
 
-        if (!psurf->priv->inst->platform->priv->egl.PlatformSetColorBuffersNVX(
-                    psurf->priv->inst->internal_display->edpy,
-                    psurf->internal_surface, buffers))
+    if (!eplHookDisplaySurface(edpy, esurf, &pdpy, &psurf))
+    {
+        return EGL_FALSE;
+    }
+
+    if (psurf == NULL || psurf->type != EPL_SURFACE_TYPE_WINDOW)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_SURFACE, "EGLSurface %p is not a Wayland window", esurf);
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
+    }
+    if (pdpy->platform->egl.GetCurrentSurface(EGL_DRAW) != esurf)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_SURFACE, "EGLSurface %p is not current", esurf);
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
+    }
+
+    *ret_pdpy = pdpy;
+    *ret_psurf = psurf;
+    return EGL_TRUE;
+}
+
+EGLBoolean eplWlHookGetPresentId(EGLDisplay edpy, EGLSurface esurf, EGLuint64KHR *present_id)
+{
+    EplDisplay *pdpy;
+    EplSurface *psurf;
+
+    if (!PresentWaitHookBegin(edpy, esurf, &pdpy, &psurf))
+    {
+        return EGL_FALSE;
+    }
+
+    if (present_id == NULL)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_PARAMETER, "presentId is NULL");
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
+    }
+
+    *present_id = psurf->priv->current.last_present_id;
+
+    eplHookDisplaySurfaceEnd(pdpy, psurf);
+    return EGL_TRUE;
+}
+
+EGLint eplWlHookWaitForPresent(EGLDisplay edpy, EGLSurface esurf,
+        EGLuint64KHR present_id, EGLTimeKHR timeout)
+{
+    EplDisplay *pdpy;
+    EplSurface *psurf;
+    uint64_t deadline = 0;
+    EGLBoolean expired = EGL_FALSE;
+    EGLint ret = EGL_FALSE;
+
+    if (!PresentWaitHookBegin(edpy, esurf, &pdpy, &psurf))
+    {
+        return EGL_FALSE;
+    }
+
+    if (present_id > psurf->priv->current.last_present_id)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_PARAMETER,
+                "Present ID %llu has not been submitted yet",
+                (unsigned long long) present_id);
+        goto done;
+    }
+
+    if (timeout != EGL_FOREVER_KHR)
+    {
+        struct timespec ts;
+        if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
         {
-            // Note that this should nver fail. The surface is the same size,
-            // so the driver doesn't have to reallocate anything.
-            psurf->priv->current.force_realloc = EGL_TRUE;
+            eplSetError(pdpy->platform, EGL_BAD_ALLOC, "Failed to read the current time");
             goto done;
         }
+        deadline = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+        deadline = (timeout > UINT64_MAX - deadline) ? UINT64_MAX : deadline + timeout;
+    }
 
-        psurf->priv->current.swapchain->current_back = next_back;
-        psurf->priv->current.swapchain->render_buffer = next_back->buffer;
+    // Make sure the frame has actually been committed before we start waiting
+    // for the compositor to tell us about it.
+    PauseReadyWatch(psurf);
+    WaitForPendingCommit(psurf);
+    if (!FlushBatchedFrame(psurf))
+    {
+        ResumeReadyWatch(psurf);
+        goto done;
+    }
 
-        eplWlSwapChainUpdateBufferAge(inst, psurf->priv->current.swapchain, present_buf);
+    while (psurf->priv->current.completed_present_id < present_id)
+    {
+        int timeout_ms = -1;
+        int occlusion_ms;
 
-    }
+        if (expired)
+        {
+            ret = EGL_TIMEOUT_EXPIRED_KHR;
+            break;
+        }
 
-    // Note that for PRIME, since we don't have a front buffer at all, so we
-    // can just keep using the same back buffer.
+        if (timeout != EGL_FOREVER_KHR)
+        {
+            struct timespec ts;
+            uint64_t now;
 
-    success = EGL_TRUE;
+            if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+            {
+                eplSetError(pdpy->platform, EGL_BAD_ALLOC, "Failed to read the current time");
+                break;
+            }
+            now = ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+
+            if (now >= deadline)
+            {
+                // Check for any pending events one more time before we give
+                // up.
+                timeout_ms = 0;
+                expired = EGL_TRUE;
+            }
+            else
+            {
+                // Round up, so that we don't spin with a zero timeout.
+                uint64_t remaining = (deadline - now + 999999) / 1000000;
+                timeout_ms = (remaining > INT_MAX) ? INT_MAX : (int) remaining;
+            }
+        }
+
+        // Don't wait past the point where we'd need to send the extra FIFO
+        // commit for an occluded window.
+        SendOcclusionCommit(psurf);
+        occlusion_ms = GetOcclusionTimeout(psurf);
+        if (occlusion_ms >= 0 && (timeout_ms < 0 || occlusion_ms < timeout_ms))
+        {
+            timeout_ms = occlusion_ms;
+        }
+
+        if (!PollSurfaceEvents(psurf, timeout_ms))
+        {
+            eplSetError(pdpy->platform, EGL_BAD_ALLOC, "Failed to dispatch Wayland events");
+            break;
+        }
+    }
+
+    if (psurf->priv->current.completed_present_id >= present_id)
+    {
+        ret = EGL_CONDITION_SATISFIED_KHR;
+    }
+    ResumeReadyWatch(psurf);
 
 done:
-    if (new_swapchain != NULL)
+    eplHookDisplaySurfaceEnd(pdpy, psurf);
+    return ret;
+}
+
+EGLBoolean eplWlHookSetTargetFrameDuration(EGLDisplay edpy, EGLSurface esurf, EGLuint64KHR duration)
+{
+    EplDisplay *pdpy;
+    EplSurface *psurf;
+
+    if (!eplHookDisplaySurface(edpy, esurf, &pdpy, &psurf))
     {
-        eplWlSwapChainDestroy(psurf->priv->inst, new_swapchain);
+        return EGL_FALSE;
+    }
+
+    if (psurf == NULL || psurf->type != EPL_SURFACE_TYPE_WINDOW)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_SURFACE, "EGLSurface %p is not a Wayland window", esurf);
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
     }
+
     pthread_mutex_lock(&psurf->priv->params.mutex);
-    psurf->priv->params.skip_update_callback--;
+    psurf->priv->params.target_frame_duration = duration;
     pthread_mutex_unlock(&psurf->priv->params.mutex);
 
-    return success;
+    eplHookDisplaySurfaceEnd(pdpy, psurf);
+    return EGL_TRUE;
 }
 
-EGLBoolean eplWlSwapInterval(EplDisplay *pdpy, EplSurface *psurf, EGLint interval)
+EGLBoolean eplWlHookBeginPresentBatch(EGLDisplay edpy)
 {
-    if (psurf->type == EPL_SURFACE_TYPE_WINDOW)
+    EplDisplay *pdpy = eplDisplayAcquire(edpy);
+
+    if (pdpy == NULL)
     {
-        if (interval < 0)
-        {
-            interval = 0;
-        }
+        return EGL_FALSE;
+    }
 
-        pthread_mutex_lock(&psurf->priv->params.mutex);
-        psurf->priv->params.swap_interval = interval;
-        pthread_mutex_unlock(&psurf->priv->params.mutex);
+    if (present_batch.inst != NULL)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_ACCESS,
+                "A present batch is already in progress on this thread");
+        eplDisplayRelease(pdpy);
+        return EGL_FALSE;
     }
+
+    present_batch.edpy = edpy;
+    present_batch.inst = pdpy->priv->inst;
+    present_batch.id = __atomic_fetch_add(&next_present_batch_id, 1, __ATOMIC_RELAXED);
+
+    eplDisplayRelease(pdpy);
     return EGL_TRUE;
 }
 
-EGLBoolean eplWlWaitGL(EplDisplay *pdpy, EplSurface *psurf)
+/**
+ * Returns true if \p psurf has a frame waiting in the given present batch.
+ */
+static EGLBoolean IsInPresentBatch(const EplSurface *psurf, uint64_t batch_id)
+{
+    return psurf->type == EPL_SURFACE_TYPE_WINDOW && psurf->priv != NULL
+        && psurf->priv->current.batch.pending
+        && psurf->priv->current.batch.batch_id == batch_id;
+}
+
+EGLBoolean eplWlHookEndPresentBatch(EGLDisplay edpy)
 {
+    EplDisplay *pdpy = eplDisplayAcquire(edpy);
+    const struct glvnd_list *surface_list;
+    EplSurface *psurf;
+    uint64_t batch_id;
+    EGLBoolean committed = EGL_FALSE;
     EGLBoolean ret = EGL_TRUE;
+    WL_TRACE_BEGIN(trace);
 
-    pdpy->platform->priv->egl.Finish();
-    if (psurf != NULL && psurf->type == EPL_SURFACE_TYPE_WINDOW)
+    if (pdpy == NULL)
     {
-        /*
-         * Wait until the server has received the commit from the last
-         * eglSwapBuffers.
-         *
-         * If possible, we'll also wait for the presentation feedback so that
-         * the last frame is actually on screen.
-         *
-         * Note that if we don't have presentation timing support, then we do
-         * NOT wait for a wl_surface::frame callback, because that could block
-         * forever.
-         */
+        return EGL_FALSE;
+    }
 
-        while (psurf->priv->current.presentation_feedback != NULL
-                || psurf->priv->current.last_swap_sync != NULL)
+    if (present_batch.inst == NULL || present_batch.edpy != edpy)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_ACCESS,
+                "No present batch is in progress for EGLDisplay %p on this thread", edpy);
+        eplDisplayRelease(pdpy);
+        return EGL_FALSE;
+    }
+
+    batch_id = present_batch.id;
+    present_batch.inst = NULL;
+    present_batch.edpy = EGL_NO_DISPLAY;
+
+    surface_list = eplDisplayLockSurfaceList(pdpy);
+
+    /*
+     * Wait for every surface's earlier frames before we commit anything.
+     *
+     * The surfaces are usually waiting for the same vblank, so after the
+     * first one, the rest have typically finished already and this doesn't
+     * block again.
+     */
+    glvnd_list_for_each_entry(psurf, surface_list, entry)
+    {
+        if (IsInPresentBatch(psurf, batch_id))
         {
-            if (wl_display_dispatch_queue(psurf->priv->inst->wdpy, psurf->priv->current.queue) < 0)
+            PauseReadyWatch(psurf);
+            if (!WaitBatchedFrame(psurf))
             {
-                eplSetError(psurf->priv->inst->platform, EGL_BAD_ALLOC,
-                        "Failed to dispatch Wayland events");
-                return EGL_FALSE;
+                ret = EGL_FALSE;
+                ResumeReadyWatch(psurf);
             }
         }
     }
 
+    // Then, commit every frame and send them all to the server at once.
+    glvnd_list_for_each_entry(psurf, surface_list, entry)
+    {
+        if (IsInPresentBatch(psurf, batch_id))
+        {
+            PresentBatchedFrame(psurf);
+            ResumeReadyWatch(psurf);
+            committed = EGL_TRUE;
+        }
+    }
+    if (committed)
+    {
+        wl_display_flush(pdpy->priv->inst->wdpy);
+    }
+
+    eplDisplayUnlockSurfaceList(pdpy);
+    eplDisplayRelease(pdpy);
+    WL_TRACE_END(trace, "eglEndPresentBatchNVX");
     return ret;
 }
 
-EplQueryResult eplWlQuerySurface(EplDisplay *pdpy, EplSurface *psurf, EGLint attrib, EGLint *ret_value)
+EGLBoolean eplWlHookSetCaptureCallback(EGLDisplay edpy, EGLSurface esurf,
+        PFNEGLWAYLANDCAPTURECALLBACKNVX callback, void *user_data)
 {
-    if (attrib == EGL_BUFFER_AGE_KHR)
+    EplDisplay *pdpy;
+    EplSurface *psurf;
+
+    if (!eplHookDisplaySurface(edpy, esurf, &pdpy, &psurf))
     {
-        if (psurf->priv->current.swapchain->prime)
+        return EGL_FALSE;
+    }
+
+    if (psurf == NULL || psurf->type != EPL_SURFACE_TYPE_WINDOW)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_SURFACE, "EGLSurface %p is not a Wayland window", esurf);
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
+    }
+    if (psurf->priv->single_buffer)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_MATCH, "Frame capture is not supported for single-buffered surfaces");
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        return EGL_FALSE;
+    }
+
+    /*
+     * The callback might be running on the commit thread right now. Wait for
+     * it to return, so that once we return, the application knows that the
+     * old callback and user_data won't be used anymore.
+     *
+     * If the callback itself is setting a new callback, then it can't wait
+     * for itself.
+     */
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    while (psurf->priv->capture.delivering
+            && !pthread_equal(psurf->priv->capture.delivery_thread, pthread_self()))
+    {
+        pthread_cond_wait(&psurf->priv->capture.cond, &psurf->priv->capture.mutex);
+    }
+    psurf->priv->capture.callback = callback;
+    psurf->priv->capture.user_data = user_data;
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+
+    eplHookDisplaySurfaceEnd(pdpy, psurf);
+    return EGL_TRUE;
+}
+
+EGLBoolean eplWlHookReleaseCaptureFrame(EGLDisplay edpy, EGLSurface esurf,
+        EGLuint64KHR capture_id, EGLint release_fence_fd)
+{
+    EplDisplay *pdpy;
+    EplSurface *psurf;
+    EGLBoolean found = EGL_FALSE;
+    uint32_t i;
+
+    if (!eplHookDisplaySurface(edpy, esurf, &pdpy, &psurf))
+    {
+        if (release_fence_fd >= 0)
         {
-            *ret_value = 0;
+            close(release_fence_fd);
         }
-        else
+        return EGL_FALSE;
+    }
+
+    if (psurf == NULL || psurf->type != EPL_SURFACE_TYPE_WINDOW)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_SURFACE, "EGLSurface %p is not a Wayland window", esurf);
+        eplHookDisplaySurfaceEnd(pdpy, psurf);
+        if (release_fence_fd >= 0)
         {
-            *ret_value = psurf->priv->current.swapchain->current_back->buffer_age;
+            close(release_fence_fd);
         }
-        return EPL_QUERY_RESULT_SUCCESS;
+        return EGL_FALSE;
     }
-    else
+
+    pthread_mutex_lock(&psurf->priv->capture.mutex);
+    for (i=0; i<MAX_CAPTURE_HOLDS; i++)
     {
-        return EPL_QUERY_RESULT_UNKNOWN;
+        WlCaptureHold *hold = &psurf->priv->capture.holds[i];
+
+        if (capture_id != 0 && hold->id == capture_id && !hold->released)
+        {
+            hold->released = EGL_TRUE;
+            hold->release_fd = release_fence_fd;
+            found = EGL_TRUE;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&psurf->priv->capture.mutex);
+
+    if (!found)
+    {
+        eplSetError(pdpy->platform, EGL_BAD_PARAMETER,
+                "Capture ID %llu is not a frame that the application holds",
+                (unsigned long long) capture_id);
+        if (release_fence_fd >= 0)
+        {
+            close(release_fence_fd);
+        }
     }
+
+    eplHookDisplaySurfaceEnd(pdpy, psurf);
+    return found;
 }
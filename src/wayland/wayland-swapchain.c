@@ -28,13 +28,11 @@
 #include <poll.h>
 #include <limits.h>
 #include <assert.h>
+#include <stddef.h>
 
 #include <GL/gl.h>
 
-/**
- * The maximum number of color buffers to allocate for a window.
- */
-static const size_t MAX_PRESENT_BUFFERS = 4;
+#include "wayland-trace.h"
 
 /**
  * How long to wait for a buffer release before we stop to check for window
@@ -42,54 +40,86 @@ static const size_t MAX_PRESENT_BUFFERS = 4;
  */
 static const int RELEASE_WAIT_TIMEOUT = 100;
 
-static void DestroyPresentBuffer(WlDisplayInstance *inst, WlPresentBuffer *buffer)
+/**
+ * Records that we've allocated a color buffer, both in the process-wide total
+ * and in the display's total.
+ */
+static void AddMemoryUsage(WlDisplayInstance *inst, uint64_t size)
 {
-    if (buffer != NULL)
-    {
-        if (buffer->wbuf != NULL && eplWlDisplayInstanceIsNativeValid(inst))
-        {
-            wl_buffer_destroy(buffer->wbuf);
-        }
-        if (buffer->dmabuf >= 0)
-        {
-            close(buffer->dmabuf);
-        }
-        if (buffer->buffer != NULL)
-        {
-            inst->platform->priv->egl.PlatformFreeColorBufferNVX(inst->internal_display->edpy, buffer->buffer);
-        }
+    eplWlMemoryAdd(inst->platform, size);
+    __atomic_fetch_add(&inst->memory_usage, size, __ATOMIC_RELAXED);
+}
 
-        eplWlTimelineDestroy(inst, &buffer->timeline);
+/**
+ * Records that we've freed a color buffer.
+ */
+static void RemoveMemoryUsage(WlDisplayInstance *inst, uint64_t size)
+{
+    eplWlMemoryRemove(inst->platform, size);
+    __atomic_fetch_sub(&inst->memory_usage, size, __ATOMIC_RELAXED);
+}
 
-        free(buffer);
+/**
+ * Releases the resources for a present buffer and clears its slot.
+ *
+ * This doesn't change \c swapchain->num_buffers.
+ */
+static void DestroyPresentBuffer(WlDisplayInstance *inst, WlSwapChain *swapchain, WlPresentBuffer *buffer)
+{
+    uint32_t slot = buffer->slot;
+
+    if (buffer->wbuf != NULL && eplWlDisplayInstanceIsNativeValid(inst))
+    {
+        wl_buffer_destroy(buffer->wbuf);
+    }
+    if (buffer->dmabuf >= 0)
+    {
+        close(buffer->dmabuf);
+    }
+    if (buffer->capture_release_fd >= 0)
+    {
+        close(buffer->capture_release_fd);
+    }
+    if (buffer->buffer != NULL)
+    {
+        pthread_mutex_lock(&inst->alloc_mutex);
+        inst->platform->priv->egl.PlatformFreeColorBufferNVX(inst->internal_display->edpy, buffer->buffer);
+        pthread_mutex_unlock(&inst->alloc_mutex);
     }
+
+    eplWlTimelineDestroy(inst, &buffer->timeline);
+    RemoveMemoryUsage(inst, buffer->size);
+
+    memset(buffer, 0, sizeof(*buffer));
+    buffer->slot = slot;
+    buffer->dmabuf = -1;
+    buffer->capture_release_fd = -1;
+    swapchain->status[slot] = BUFFER_STATUS_IDLE;
+    swapchain->timeline_handles[slot] = 0;
+    swapchain->release_seq[slot] = 0;
+}
+
+/**
+ * Returns the WlSwapChain that owns a present buffer.
+ */
+static WlSwapChain *PresentBufferGetSwapChain(WlPresentBuffer *buffer)
+{
+    WlPresentBuffer *first = buffer - buffer->slot;
+    return (WlSwapChain *) (((char *) first) - offsetof(WlSwapChain, buffers));
 }
 
 static void on_buffer_release(void *userdata, struct wl_buffer *wbuf)
 {
-    WlSwapChain *swapchain = userdata;
-    WlPresentBuffer *buffer = NULL;
+    WlPresentBuffer *buffer = userdata;
+    WlSwapChain *swapchain = PresentBufferGetSwapChain(buffer);
 
-    glvnd_list_for_each_entry(buffer, &swapchain->present_buffers, entry)
-    {
-        if (buffer->wbuf == wbuf)
-        {
-            if (buffer->status == BUFFER_STATUS_IN_USE)
-            {
-                buffer->status = BUFFER_STATUS_IDLE_NOTIFIED;
-            }
+    assert(buffer->wbuf == wbuf);
 
-            /*
-             * Move the buffer to the end of the list. If we don't have any
-             * server -> client synchronization, then this ensures that
-             * we'll reuse the oldest buffers first, so we'll have the best
-             * chance that the buffer really is idle.
-             */
-            glvnd_list_del(&buffer->entry);
-            glvnd_list_append(&buffer->entry, &swapchain->present_buffers);
-            break;
-        }
+    if (swapchain->status[buffer->slot] == BUFFER_STATUS_IN_USE)
+    {
+        swapchain->status[buffer->slot] = BUFFER_STATUS_IDLE_NOTIFIED;
     }
+    swapchain->release_seq[buffer->slot] = ++swapchain->next_release_seq;
 }
 static const struct wl_buffer_listener BUFFER_LISTENER = { on_buffer_release };
 
@@ -130,6 +160,7 @@ static struct wl_buffer *ShareDmaBuf(WlDisplayInstance *inst,
     DmaBufParamsCreateState state = {};
     struct zwp_linux_dmabuf_v1 *wrapper = NULL;
     struct zwp_linux_buffer_params_v1 *params = NULL;
+    WL_TRACE_BEGIN(trace);
 
     wrapper = wl_proxy_create_wrapper(inst->globals.dmabuf);
     if (wrapper == NULL)
@@ -154,6 +185,7 @@ static struct wl_buffer *ShareDmaBuf(WlDisplayInstance *inst,
 
     while (!state.done)
     {
+        WL_STATS_DISPLAY_ADD(inst->stats, roundtrips, 1);
         if (wl_display_roundtrip_queue(inst->wdpy, queue) < 0)
         {
             goto done;
@@ -170,6 +202,7 @@ done:
         wl_proxy_wrapper_destroy(wrapper);
     }
 
+    WL_TRACE_END(trace, "ShareDmaBuf");
     return state.buffer;
 }
 
@@ -190,32 +223,41 @@ done:
 static WlPresentBuffer *SwapChainAppendPresentBuffer(WlDisplayInstance *inst,
         WlSwapChain *swapchain, int dmabuf, uint32_t stride, uint32_t offset)
 {
-    WlPresentBuffer *buf = calloc(1, sizeof(WlPresentBuffer));
+    WlPresentBuffer *buf;
 
-    if (buf == NULL)
+    if (swapchain->num_buffers >= WL_MAX_PRESENT_BUFFERS)
     {
         close(dmabuf);
         return NULL;
     }
 
-    glvnd_list_init(&buf->entry);
+    buf = &swapchain->buffers[swapchain->num_buffers];
+    memset(buf, 0, sizeof(*buf));
+    buf->slot = swapchain->num_buffers;
     buf->dmabuf = dmabuf;
-    buf->status = BUFFER_STATUS_IDLE;
+    buf->capture_release_fd = -1;
+    buf->size = ((uint64_t) stride) * swapchain->height + offset;
+    buf->stride = stride;
+    buf->offset = offset;
+    AddMemoryUsage(inst, buf->size);
+    swapchain->status[buf->slot] = BUFFER_STATUS_IDLE;
+    swapchain->release_seq[buf->slot] = 0;
 
     if (inst->globals.syncobj != NULL)
     {
         if (!eplWlTimelineInit(inst, &buf->timeline))
         {
-            DestroyPresentBuffer(inst, buf);
+            DestroyPresentBuffer(inst, swapchain, buf);
             return NULL;
         }
+        swapchain->timeline_handles[buf->slot] = buf->timeline.handle;
     }
 
     buf->wbuf = ShareDmaBuf(inst, swapchain->queue, dmabuf, swapchain->width, swapchain->height,
             stride, offset, swapchain->present_fourcc, swapchain->modifier);
     if (buf->wbuf == NULL)
     {
-        DestroyPresentBuffer(inst, buf);
+        DestroyPresentBuffer(inst, swapchain, buf);
         return NULL;
     }
     if (inst->globals.syncobj != NULL)
@@ -229,7 +271,7 @@ static WlPresentBuffer *SwapChainAppendPresentBuffer(WlDisplayInstance *inst,
     {
         // If we don't have explicit sync, then we'll need to watch for
         // wl_buffer::release events.
-        wl_buffer_add_listener(buf->wbuf, &BUFFER_LISTENER, swapchain);
+        wl_buffer_add_listener(buf->wbuf, &BUFFER_LISTENER, buf);
 
         if (!inst->supports_implicit_sync)
         {
@@ -240,7 +282,8 @@ static WlPresentBuffer *SwapChainAppendPresentBuffer(WlDisplayInstance *inst,
         }
     }
 
-    glvnd_list_add(&buf->entry, &swapchain->present_buffers);
+    swapchain->num_buffers++;
+    WL_STATS_DISPLAY_ADD(inst->stats, buffers_allocated, 1);
 
     return buf;
 }
@@ -253,27 +296,29 @@ WlPresentBuffer *eplWlSwapChainCreatePresentBuffer(WlDisplayInstance *inst,
     int dmabuf = -1;
     int stride, offset;
 
-
+    pthread_mutex_lock(&inst->alloc_mutex);
     colorbuf = inst->platform->priv->egl.PlatformAllocColorBufferNVX(
             inst->internal_display->edpy, swapchain->width, swapchain->height,
             swapchain->render_fourcc, swapchain->modifier, swapchain->prime);
-    if (colorbuf == NULL)
-    {
-        return NULL;
-    }
-
-    if (!inst->platform->priv->egl.PlatformExportColorBufferNVX(
+    if (colorbuf != NULL && !inst->platform->priv->egl.PlatformExportColorBufferNVX(
                 inst->internal_display->edpy, colorbuf, &dmabuf, NULL, NULL, NULL,
                 &stride, &offset, NULL))
     {
         inst->platform->priv->egl.PlatformFreeColorBufferNVX(inst->internal_display->edpy, colorbuf);
+        colorbuf = NULL;
+    }
+    pthread_mutex_unlock(&inst->alloc_mutex);
+    if (colorbuf == NULL)
+    {
         return NULL;
     }
 
     presentBuf = SwapChainAppendPresentBuffer(inst, swapchain, dmabuf, stride, offset);
     if (presentBuf == NULL)
     {
+        pthread_mutex_lock(&inst->alloc_mutex);
         inst->platform->priv->egl.PlatformFreeColorBufferNVX(inst->internal_display->edpy, colorbuf);
+        pthread_mutex_unlock(&inst->alloc_mutex);
         return NULL;
     }
     presentBuf->buffer = colorbuf;
@@ -284,19 +329,20 @@ void eplWlSwapChainDestroy(WlDisplayInstance *inst, WlSwapChain *swapchain)
 {
     if (swapchain != NULL)
     {
-        while (!glvnd_list_is_empty(&swapchain->present_buffers))
+        uint32_t i;
+
+        for (i=0; i<swapchain->num_buffers; i++)
         {
-            WlPresentBuffer *buffer = glvnd_list_first_entry(&swapchain->present_buffers,
-                    WlPresentBuffer, entry);
-            glvnd_list_del(&buffer->entry);
+            WlPresentBuffer *buffer = &swapchain->buffers[i];
 
             if (buffer->buffer == swapchain->render_buffer)
             {
                 swapchain->render_buffer = NULL;
             }
 
-            DestroyPresentBuffer(inst, buffer);
+            DestroyPresentBuffer(inst, swapchain, buffer);
         }
+        swapchain->num_buffers = 0;
 
         if (swapchain->queue != NULL && eplWlDisplayInstanceIsNativeValid(inst))
         {
@@ -305,8 +351,11 @@ void eplWlSwapChainDestroy(WlDisplayInstance *inst, WlSwapChain *swapchain)
 
         if (swapchain->render_buffer != NULL)
         {
+            pthread_mutex_lock(&inst->alloc_mutex);
             inst->platform->priv->egl.PlatformFreeColorBufferNVX(inst->internal_display->edpy,
                     swapchain->render_buffer);
+            pthread_mutex_unlock(&inst->alloc_mutex);
+            RemoveMemoryUsage(inst, swapchain->render_buffer_size);
         }
 
         free(swapchain);
@@ -315,13 +364,15 @@ void eplWlSwapChainDestroy(WlDisplayInstance *inst, WlSwapChain *swapchain)
 
 WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *wsurf,
         uint32_t width, uint32_t height, uint32_t render_fourcc, uint32_t present_fourcc,
-        EGLBoolean prime, const uint64_t *modifiers, size_t num_modifiers)
+        EGLBoolean prime, EGLBoolean prime_direct,
+        const uint64_t *modifiers, size_t num_modifiers)
 {
     WlSwapChain *swapchain = NULL;
     uint32_t flags = 0;
     struct gbm_bo *gbo = NULL;
     int dmabuf = -1;
     EGLBoolean success = EGL_FALSE;
+    WL_TRACE_BEGIN(trace);
 
     swapchain = calloc(1, sizeof(WlSwapChain));
     if (swapchain == NULL)
@@ -329,13 +380,15 @@ WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *ws
         goto done;
     }
 
-    glvnd_list_init(&swapchain->present_buffers);
     swapchain->width = width;
     swapchain->height = height;
+    swapchain->display_width = width;
+    swapchain->display_height = height;
     swapchain->render_fourcc = render_fourcc;
     swapchain->present_fourcc = present_fourcc;
     swapchain->modifier = DRM_FORMAT_MOD_INVALID;
     swapchain->prime = prime;
+    swapchain->prime_direct = (prime && prime_direct);
     if (inst->platform->priv->wl.display_create_queue_with_name != NULL)
     {
         char name[64];
@@ -351,6 +404,22 @@ WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *ws
         goto done;
     }
 
+    if (swapchain->prime_direct)
+    {
+        // For PRIME without a copy, we render straight into the same linear
+        // sysmem buffers that we share with the server, so the first present
+        // buffer is also the first back buffer.
+        swapchain->modifier = DRM_FORMAT_MOD_LINEAR;
+        swapchain->current_back = eplWlSwapChainCreatePresentBuffer(inst, swapchain);
+        if (swapchain->current_back == NULL)
+        {
+            goto done;
+        }
+        swapchain->render_buffer = swapchain->current_back->buffer;
+        success = EGL_TRUE;
+        goto done;
+    }
+
     /*
      * Start by creating the render buffer. We'll do that using libgbm, so that
      * we can let the driver pick an optimal format modifier.
@@ -363,6 +432,7 @@ WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *ws
     {
         flags |= GBM_BO_USE_SCANOUT;
     }
+    pthread_mutex_lock(&inst->alloc_mutex);
     if (modifiers != NULL && num_modifiers > 0)
     {
         gbo = inst->platform->priv->gbm.bo_create_with_modifiers2(inst->gbmdev,
@@ -372,21 +442,18 @@ WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *ws
     {
         gbo = gbm_bo_create(inst->gbmdev, width, height, render_fourcc, flags);
     }
-    if (gbo == NULL)
+    if (gbo != NULL)
     {
-        goto done;
+        dmabuf = gbm_bo_get_fd(gbo);
     }
-
-    dmabuf = gbm_bo_get_fd(gbo);
-    if (dmabuf < 0)
+    if (dmabuf >= 0)
     {
-        goto done;
+        swapchain->render_buffer = inst->platform->priv->egl.PlatformImportColorBufferNVX(
+                inst->internal_display->edpy, dmabuf, width, height, render_fourcc,
+                gbm_bo_get_stride(gbo), gbm_bo_get_offset(gbo, 0),
+                gbm_bo_get_modifier(gbo));
     }
-
-    swapchain->render_buffer = inst->platform->priv->egl.PlatformImportColorBufferNVX(
-            inst->internal_display->edpy, dmabuf, width, height, render_fourcc,
-            gbm_bo_get_stride(gbo), gbm_bo_get_offset(gbo, 0),
-            gbm_bo_get_modifier(gbo));
+    pthread_mutex_unlock(&inst->alloc_mutex);
     if (swapchain->render_buffer == NULL)
     {
         goto done;
@@ -398,6 +465,9 @@ WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *ws
         // linear present buffers. We don't need to create any present buffers
         // yet -- we can do that in the first call to eglSwapBuffers.
         swapchain->modifier = DRM_FORMAT_MOD_LINEAR;
+        swapchain->render_buffer_size = ((uint64_t) gbm_bo_get_stride(gbo)) * height
+            + gbm_bo_get_offset(gbo, 0);
+        AddMemoryUsage(inst, swapchain->render_buffer_size);
     }
     else
     {
@@ -430,8 +500,11 @@ done:
     }
     if (gbo != NULL)
     {
+        pthread_mutex_lock(&inst->alloc_mutex);
         gbm_bo_destroy(gbo);
+        pthread_mutex_unlock(&inst->alloc_mutex);
     }
+    WL_TRACE_END(trace, "eplWlSwapChainCreate");
     return swapchain;
 }
 
@@ -475,9 +548,24 @@ static EGLBoolean WaitForSyncFDGPU(WlDisplayInstance *inst, int syncfd)
  */
 static EGLBoolean WaitTimelinePoint(WlDisplayInstance *inst, WlTimeline *timeline)
 {
-    int syncfd = eplWlTimelinePointToSyncFD(inst, timeline);
+    int syncfd;
+    uint32_t first;
     EGLBoolean success = EGL_FALSE;
 
+    /*
+     * By the time we get here, the server has usually finished with the
+     * buffer. If the point has already signaled, then there's nothing for the
+     * GPU to wait on, so we can skip exporting a sync FD and creating an
+     * EGLSync for it.
+     */
+    if (inst->platform->priv->drm.SyncobjTimelineWait(
+                gbm_device_get_fd(inst->gbmdev),
+                &timeline->handle, &timeline->point, 1, 0, 0, &first) == 0)
+    {
+        return EGL_TRUE;
+    }
+
+    syncfd = eplWlTimelinePointToSyncFD(inst, timeline);
     if (syncfd >= 0)
     {
         success = WaitForSyncFDGPU(inst, syncfd);
@@ -487,12 +575,15 @@ static EGLBoolean WaitTimelinePoint(WlDisplayInstance *inst, WlTimeline *timelin
     {
         // If using eglWaitSync failed, then just do a CPU wait on the timeline
         // point.
-        uint32_t first;
+        WL_TRACE_BEGIN(trace);
+        eplWlPerfWarning(inst->platform, WL_PERF_WARNING_CPU_TIMELINE_WAIT,
+                "eglWaitSync is not available for a release point, so eglSwapBuffers waits on the CPU");
         success = (inst->platform->priv->drm.SyncobjTimelineWait(
                     gbm_device_get_fd(inst->gbmdev),
                     &timeline->handle, &timeline->point, 1, INT64_MAX,
                     DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT,
                     &first) == 0);
+        WL_TRACE_END(trace, "drmSyncobjTimelineWait(WAIT_FOR_SUBMIT)");
         if (!success)
         {
             eplSetError(inst->platform, EGL_BAD_ALLOC,
@@ -506,20 +597,24 @@ static EGLBoolean WaitTimelinePoint(WlDisplayInstance *inst, WlTimeline *timelin
 
 static int CheckBufferReleaseExplicit(WlDisplayInstance *inst, WlSwapChain *swapchain, int timeout_ms)
 {
-    WlPresentBuffer *buffer;
-    WlPresentBuffer **buffers;
-    uint32_t *handles;
-    uint64_t *points;
+    uint32_t slots[WL_MAX_PRESENT_BUFFERS];
+    uint32_t handles[WL_MAX_PRESENT_BUFFERS];
+    uint64_t points[WL_MAX_PRESENT_BUFFERS];
     int64_t timeout;
     uint32_t count;
     uint32_t first;
+    uint32_t i;
     int ret, err;
+    WL_TRACE_BEGIN(trace);
 
     count = 0;
-    glvnd_list_for_each_entry(buffer, &swapchain->present_buffers, entry)
+    for (i=0; i<swapchain->num_buffers; i++)
     {
-        if (buffer->status != BUFFER_STATUS_IDLE)
+        if (swapchain->status[i] != BUFFER_STATUS_IDLE)
         {
+            slots[count] = i;
+            handles[count] = swapchain->timeline_handles[i];
+            points[count] = swapchain->buffers[i].timeline.point;
             count++;
         }
     }
@@ -529,22 +624,6 @@ static int CheckBufferReleaseExplicit(WlDisplayInstance *inst, WlSwapChain *swap
         return 0;
     }
 
-    buffers = alloca(count * sizeof(WlPresentBuffer *));
-    handles = alloca(count * sizeof(uint32_t));
-    points = alloca(count * sizeof(uint64_t));
-
-    count = 0;
-    glvnd_list_for_each_entry(buffer, &swapchain->present_buffers, entry)
-    {
-        if (buffer->status != BUFFER_STATUS_IDLE)
-        {
-            buffers[count] = buffer;
-            handles[count] = buffer->timeline.handle;
-            points[count] = buffer->timeline.point;
-            count++;
-        }
-    }
-
     if (timeout_ms > 0)
     {
         struct timespec ts;
@@ -567,13 +646,14 @@ static int CheckBufferReleaseExplicit(WlDisplayInstance *inst, WlSwapChain *swap
                 DRM_SYNCOBJ_WAIT_FLAGS_WAIT_AVAILABLE,
                 &first);
     err = errno;
+    WL_TRACE_END(trace, "drmSyncobjTimelineWait(WAIT_AVAILABLE)");
 
     if (ret == 0)
     {
         assert(first < count);
-        if (WaitTimelinePoint(inst, &buffers[first]->timeline))
+        if (WaitTimelinePoint(inst, &swapchain->buffers[slots[first]].timeline))
         {
-            buffers[first]->status = BUFFER_STATUS_IDLE;
+            swapchain->status[slots[first]] = BUFFER_STATUS_IDLE;
             return count;
         }
         else
@@ -596,14 +676,14 @@ static int CheckBufferReleaseExplicit(WlDisplayInstance *inst, WlSwapChain *swap
     }
 }
 
-static EGLBoolean WaitImplicitFence(WlDisplayInstance *inst, WlPresentBuffer *buffer)
+static EGLBoolean WaitImplicitFence(WlDisplayInstance *inst, WlSwapChain *swapchain, uint32_t slot)
 {
     EGLBoolean success = EGL_FALSE;
     int fd = -1;
 
     assert(inst->supports_implicit_sync);
 
-    fd = eplWlExportDmaBufSyncFile(buffer->dmabuf);
+    fd = eplWlExportDmaBufSyncFile(swapchain->buffers[slot].dmabuf);
     if (fd >= 0)
     {
         success = WaitForSyncFDGPU(inst, fd);
@@ -611,7 +691,7 @@ static EGLBoolean WaitImplicitFence(WlDisplayInstance *inst, WlPresentBuffer *bu
 
     if (success)
     {
-        buffer->status = BUFFER_STATUS_IDLE;
+        swapchain->status[slot] = BUFFER_STATUS_IDLE;
     }
 
     return success;
@@ -633,12 +713,12 @@ static EGLBoolean WaitImplicitFence(WlDisplayInstance *inst, WlPresentBuffer *bu
 static int CheckBufferReleaseImplicit(WlDisplayInstance *inst,
         WlSwapChain *swapchain, int timeout_ms)
 {
-    WlPresentBuffer *buffer;
-    WlPresentBuffer **buffers;
-    struct pollfd *fds;
+    uint32_t slots[WL_MAX_PRESENT_BUFFERS];
+    struct pollfd fds[WL_MAX_PRESENT_BUFFERS];
+    int oldest = -1;
     int count;
-    int i;
     int ret;
+    uint32_t i;
 
     if (wl_display_dispatch_queue_pending(inst->wdpy, swapchain->queue) < 0)
     {
@@ -646,31 +726,45 @@ static int CheckBufferReleaseImplicit(WlDisplayInstance *inst,
     }
 
     count = 0;
-    glvnd_list_for_each_entry(buffer, &swapchain->present_buffers, entry)
+    for (i=0; i<swapchain->num_buffers; i++)
     {
-        if (buffer->status == BUFFER_STATUS_IDLE_NOTIFIED)
+        if (swapchain->status[i] != BUFFER_STATUS_IDLE_NOTIFIED)
         {
-            if (buffer->dmabuf >= 0 && inst->supports_implicit_sync)
-            {
-                if (WaitImplicitFence(inst, buffer))
-                {
-                    // If possible, extract a syncfd and wait on it using eglWaitSync,
-                    // instead of doing a CPU wait.
-                    assert(buffer->status == BUFFER_STATUS_IDLE);
-                    return 1;
-                }
-                count++;
-            }
-            else
+            continue;
+        }
+
+        if (swapchain->buffers[i].dmabuf >= 0 && inst->supports_implicit_sync)
+        {
+            // If possible, extract a syncfd and wait on it using eglWaitSync,
+            // instead of doing a CPU wait.
+            if (WaitImplicitFence(inst, swapchain, i))
             {
-                // If implicit sync isn't available at all, then just grab the
-                // oldest buffer and hope for the best.
-                buffer->status = BUFFER_STATUS_IDLE;
+                assert(swapchain->status[i] == BUFFER_STATUS_IDLE);
                 return 1;
             }
+
+            slots[count] = i;
+            fds[count].fd = swapchain->buffers[i].dmabuf;
+            fds[count].events = POLLOUT;
+            fds[count].revents = 0;
+            count++;
+        }
+        else if (oldest < 0 || swapchain->release_seq[i] < swapchain->release_seq[oldest])
+        {
+            oldest = i;
         }
     }
 
+    if (oldest >= 0)
+    {
+        // If implicit sync isn't available at all, then just grab the
+        // oldest buffer and hope for the best.
+        eplWlPerfWarning(inst->platform, WL_PERF_WARNING_RELEASE_GUESS,
+                "No explicit or implicit sync is available, so a released buffer may still be in use");
+        swapchain->status[oldest] = BUFFER_STATUS_IDLE;
+        return 1;
+    }
+
     if (count == 0)
     {
         return 0;
@@ -680,33 +774,20 @@ static int CheckBufferReleaseImplicit(WlDisplayInstance *inst,
     // have incremented count above.
     assert(inst->supports_implicit_sync);
 
-    buffers = alloca(count * sizeof(WlPresentBuffer *));
-    fds = alloca(count * sizeof(struct pollfd));
-
-    count = 0;
-    glvnd_list_for_each_entry(buffer, &swapchain->present_buffers, entry)
     {
-        if (buffer->status == BUFFER_STATUS_IDLE_NOTIFIED)
-        {
-            assert(buffer->dmabuf >= 0);
-
-            buffers[count] = buffer;
-            fds[count].fd = buffer->dmabuf;
-            fds[count].events = POLLOUT;
-            fds[count].revents = 0;
-            count++;
-        }
+        WL_TRACE_BEGIN(trace);
+        ret = poll(fds, count, timeout_ms);
+        WL_TRACE_END(trace, "WaitForImplicitRelease");
     }
 
-    ret = poll(fds, count, timeout_ms);
-
     if (ret > 0)
     {
-        for (i=0; i<count; i++)
+        int j;
+        for (j=0; j<count; j++)
         {
-            if (fds[i].revents & POLLOUT)
+            if (fds[j].revents & POLLOUT)
             {
-                buffers[i]->status = BUFFER_STATUS_IDLE;
+                swapchain->status[slots[j]] = BUFFER_STATUS_IDLE;
             }
         }
         return count;
@@ -725,6 +806,178 @@ static int CheckBufferReleaseImplicit(WlDisplayInstance *inst,
     }
 }
 
+/**
+ * Estimates how many pixels the application would have to repaint if we
+ * picked \p buf as the next back buffer.
+ *
+ * This only counts the damage from earlier frames, based on the buffer age,
+ * since the damage for the next frame is the same no matter which buffer we
+ * pick. If we don't know the buffer's contents, then it's the whole buffer.
+ */
+static uint64_t EstimateRepaint(const WlSwapChain *swapchain, const WlPresentBuffer *buf)
+{
+    uint64_t full = ((uint64_t) swapchain->width) * swapchain->height;
+    uint64_t total = 0;
+    uint32_t frames;
+    uint32_t i;
+
+    if (buf->buffer_age <= 0)
+    {
+        return full;
+    }
+
+    frames = (uint32_t) buf->buffer_age - 1;
+    if (frames > WL_DAMAGE_HISTORY || frames > swapchain->damage_count)
+    {
+        return full;
+    }
+
+    for (i=0; i<frames; i++)
+    {
+        total += swapchain->damage_history[(swapchain->damage_count - 1 - i) % WL_DAMAGE_HISTORY];
+        if (total >= full)
+        {
+            return full;
+        }
+    }
+    return total;
+}
+
+/**
+ * Returns true if the buffer in a slot is idle, and a frame capture consumer
+ * isn't holding it.
+ */
+static EGLBoolean IsBufferFree(const WlSwapChain *swapchain, uint32_t slot)
+{
+    return (swapchain->status[slot] == BUFFER_STATUS_IDLE
+            && swapchain->buffers[slot].capture_id == 0);
+}
+
+/**
+ * Returns the number of buffers that a frame capture consumer is holding.
+ */
+static uint32_t CountCapturedBuffers(const WlSwapChain *swapchain)
+{
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        if (swapchain->buffers[i].capture_id != 0)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * Waits for the fence that a frame capture consumer returned with a buffer.
+ *
+ * Like a release point, we'll try to let the GPU wait for it, and fall back
+ * to a CPU wait if we can't.
+ */
+static void WaitCaptureRelease(WlDisplayInstance *inst, WlPresentBuffer *buf)
+{
+    int fd = buf->capture_release_fd;
+    int gpu_fd;
+
+    if (fd < 0)
+    {
+        return;
+    }
+    buf->capture_release_fd = -1;
+
+    gpu_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    if (gpu_fd < 0 || !WaitForSyncFDGPU(inst, gpu_fd))
+    {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        WL_TRACE_BEGIN(trace);
+
+        while (poll(&pfd, 1, -1) < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+        }
+        WL_TRACE_END(trace, "WaitCaptureRelease");
+    }
+    close(fd);
+}
+
+/**
+ * Picks one of the idle buffers, or returns NULL if none of them are idle.
+ */
+static WlPresentBuffer *SelectIdleBuffer(WlDisplayInstance *inst, WlSwapChain *swapchain)
+{
+    WlPresentBuffer *first = NULL;
+    WlPresentBuffer *best = NULL;
+    uint64_t first_cost = 0;
+    uint64_t best_cost = 0;
+    uint32_t i;
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        if (IsBufferFree(swapchain, i))
+        {
+            first = &swapchain->buffers[i];
+            break;
+        }
+    }
+
+    /*
+     * If we don't have explicit or implicit sync, then an idle buffer is
+     * only a guess, and the buffer that we guessed on most recently is the
+     * least likely to still be in use. In that case, don't go looking for a
+     * different one.
+     */
+    if (first == NULL || !swapchain->min_repaint || eplWlSwapChainNeedsCopy(swapchain)
+            || (inst->globals.syncobj == NULL && !inst->supports_implicit_sync))
+    {
+        return first;
+    }
+
+    first_cost = best_cost = EstimateRepaint(swapchain, first);
+    best = first;
+    for (i = (uint32_t) (first - swapchain->buffers) + 1; i<swapchain->num_buffers; i++)
+    {
+        WlPresentBuffer *buf = &swapchain->buffers[i];
+        uint64_t cost;
+
+        if (!IsBufferFree(swapchain, i))
+        {
+            continue;
+        }
+
+        // On a tie, prefer the newer contents.
+        cost = EstimateRepaint(swapchain, buf);
+        if (cost < best_cost || (cost == best_cost && buf->buffer_age > 0
+                    && (best->buffer_age == 0 || buf->buffer_age < best->buffer_age)))
+        {
+            best = buf;
+            best_cost = cost;
+        }
+    }
+
+    swapchain->repaint_saved += first_cost - best_cost;
+    return best;
+}
+
+EGLBoolean eplWlSwapChainCanAllocatePresentBuffer(WlDisplayInstance *inst,
+        const WlSwapChain *swapchain)
+{
+    uint32_t usable;
+
+    if (swapchain->num_buffers >= WL_MAX_PRESENT_BUFFERS)
+    {
+        return EGL_FALSE;
+    }
+
+    // Buffers that a frame capture consumer is holding won't free up while
+    // we wait, so don't count them toward the minimum. Past that, if we're
+    // over the memory budget, then we'd rather wait for a buffer to free up.
+    usable = swapchain->num_buffers - CountCapturedBuffers(swapchain);
+    return (usable < WL_MIN_PRESENT_BUFFERS
+            || !eplWlMemoryOverBudget(inst->platform, swapchain->buffers[0].size));
+}
+
 WlPresentBuffer *eplWlSwapChainFindFreePresentBuffer(WlDisplayInstance *inst,
         WlSwapChain *swapchain)
 {
@@ -749,21 +1002,20 @@ WlPresentBuffer *eplWlSwapChainFindFreePresentBuffer(WlDisplayInstance *inst,
 
     while (1)
     {
-        WlPresentBuffer *buf = NULL;
-        size_t num_buffers = 0;
-        glvnd_list_for_each_entry(buf, &swapchain->present_buffers, entry)
+        WlPresentBuffer *buf = SelectIdleBuffer(inst, swapchain);
+
+        if (buf != NULL)
         {
-            if (buf->status == BUFFER_STATUS_IDLE)
-            {
-                return buf;
-            }
-            num_buffers++;
+            WaitCaptureRelease(inst, buf);
+            return buf;
         }
 
-        if (num_buffers < MAX_PRESENT_BUFFERS)
+        if (eplWlSwapChainCanAllocatePresentBuffer(inst, swapchain))
         {
             // We didn't find a free buffer, but we don't have our maximum
-            // number of buffers yet, so allocate a new one.
+            // number of buffers yet, so allocate a new one. If we're over the
+            // memory budget, then only allocate enough to keep going, and
+            // otherwise wait for a buffer to free up.
             return eplWlSwapChainCreatePresentBuffer(inst, swapchain);
         }
 
@@ -795,7 +1047,12 @@ WlPresentBuffer *eplWlSwapChainFindFreePresentBuffer(WlDisplayInstance *inst,
                  * CheckBufferReleaseImplicit will find it on the next pass
                  * through this loop.
                  */
-                if (wl_display_dispatch_queue(inst->wdpy, swapchain->queue) < 0)
+                int ret;
+                WL_TRACE_BEGIN(trace);
+
+                ret = wl_display_dispatch_queue(inst->wdpy, swapchain->queue);
+                WL_TRACE_END(trace, "wl_display_dispatch_queue(buffer release)");
+                if (ret < 0)
                 {
                     return NULL;
                 }
@@ -804,18 +1061,111 @@ WlPresentBuffer *eplWlSwapChainFindFreePresentBuffer(WlDisplayInstance *inst,
     }
 }
 
+int eplWlSwapChainExportPresentBuffer(WlDisplayInstance *inst, WlPresentBuffer *buf)
+{
+    int fd = -1;
+    int stride, offset;
+
+    if (buf->dmabuf >= 0)
+    {
+        return fcntl(buf->dmabuf, F_DUPFD_CLOEXEC, 0);
+    }
+
+    if (!inst->platform->priv->egl.PlatformExportColorBufferNVX(
+                inst->internal_display->edpy, buf->buffer, &fd, NULL, NULL, NULL,
+                &stride, &offset, NULL))
+    {
+        return -1;
+    }
+    return fd;
+}
+
+EGLBoolean eplWlSwapChainReleaseCapture(WlSwapChain *swapchain, uint64_t capture_id,
+        int release_fd)
+{
+    uint32_t i;
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        WlPresentBuffer *buf = &swapchain->buffers[i];
+
+        if (buf->capture_id == capture_id)
+        {
+            assert(buf->capture_release_fd < 0);
+            buf->capture_id = 0;
+            buf->capture_release_fd = release_fd;
+            return EGL_TRUE;
+        }
+    }
+    return EGL_FALSE;
+}
+
+EGLBoolean eplWlSwapChainReuse(WlDisplayInstance *inst, WlSwapChain *swapchain)
+{
+    uint32_t i;
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        swapchain->buffers[i].buffer_age = 0;
+    }
+
+    if (!eplWlSwapChainNeedsCopy(swapchain))
+    {
+        // The old back buffer was presented before we set the swapchain
+        // aside, so it might still be in use.
+        WlPresentBuffer *back = eplWlSwapChainFindFreePresentBuffer(inst, swapchain);
+        if (back == NULL)
+        {
+            return EGL_FALSE;
+        }
+        swapchain->current_back = back;
+        swapchain->render_buffer = back->buffer;
+    }
+
+    return EGL_TRUE;
+}
+
 void eplWlSwapChainUpdateBufferAge(WlDisplayInstance *inst, WlSwapChain *swapchain,
-        WlPresentBuffer *presented_buffer)
+        WlPresentBuffer *presented_buffer, const EGLint *rects, EGLint n_rects)
 {
-    WlPresentBuffer *buf = NULL;
+    uint64_t full = ((uint64_t) swapchain->width) * swapchain->height;
+    uint64_t damage = 0;
+    uint32_t i;
 
-    if (swapchain->prime)
+    if (eplWlSwapChainNeedsCopy(swapchain))
     {
         return;
     }
 
-    glvnd_list_for_each_entry(buf, &swapchain->present_buffers, entry)
+    if (rects != NULL && n_rects > 0)
+    {
+        EGLint j;
+
+        // Overlapping rectangles get counted twice, but that's fine for an
+        // estimate.
+        for (j=0; j<n_rects && damage < full; j++)
+        {
+            const EGLint *rect = rects + (j * 4);
+            if (rect[2] > 0 && rect[3] > 0)
+            {
+                damage += ((uint64_t) rect[2]) * rect[3];
+            }
+        }
+        if (damage > full)
+        {
+            damage = full;
+        }
+    }
+    else
+    {
+        damage = full;
+    }
+    swapchain->damage_history[swapchain->damage_count % WL_DAMAGE_HISTORY] = damage;
+    swapchain->damage_count++;
+
+    for (i=0; i<swapchain->num_buffers; i++)
     {
+        WlPresentBuffer *buf = &swapchain->buffers[i];
         if (buf != presented_buffer)
         {
             if (buf->buffer_age != 0)
@@ -827,3 +1177,106 @@ void eplWlSwapChainUpdateBufferAge(WlDisplayInstance *inst, WlSwapChain *swapcha
 
     presented_buffer->buffer_age = 1;
 }
+
+/**
+ * Moves a present buffer to a different (empty) slot.
+ */
+static void SwapChainMoveBuffer(WlSwapChain *swapchain, uint32_t from, uint32_t to)
+{
+    WlPresentBuffer *src = &swapchain->buffers[from];
+    WlPresentBuffer *dst = &swapchain->buffers[to];
+
+    *dst = *src;
+    dst->slot = to;
+    swapchain->status[to] = swapchain->status[from];
+    swapchain->timeline_handles[to] = swapchain->timeline_handles[from];
+    swapchain->release_seq[to] = swapchain->release_seq[from];
+
+    // The wl_buffer::release listener finds the buffer through its user
+    // data, so point that at the new slot.
+    if (dst->wbuf != NULL)
+    {
+        wl_buffer_set_user_data(dst->wbuf, dst);
+    }
+    if (swapchain->current_back == src)
+    {
+        swapchain->current_back = dst;
+    }
+
+    memset(src, 0, sizeof(*src));
+    src->slot = from;
+    src->dmabuf = -1;
+    src->capture_release_fd = -1;
+    swapchain->status[from] = BUFFER_STATUS_IDLE;
+    swapchain->timeline_handles[from] = 0;
+    swapchain->release_seq[from] = 0;
+}
+
+uint64_t eplWlSwapChainTrim(WlDisplayInstance *inst, WlSwapChain *swapchain,
+        uint32_t min_buffers)
+{
+    uint64_t freed = 0;
+    uint32_t i;
+
+    if (swapchain->num_buffers <= min_buffers)
+    {
+        return 0;
+    }
+
+    // Pick up any buffers that the server has released, but don't wait for
+    // anything. Anything still in use can get trimmed on a later call.
+    if (inst->globals.syncobj != NULL)
+    {
+        if (CheckBufferReleaseExplicit(inst, swapchain, 0) < 0)
+        {
+            return 0;
+        }
+    }
+    else
+    {
+        if (CheckBufferReleaseImplicit(inst, swapchain, 0) < 0)
+        {
+            return 0;
+        }
+    }
+
+    i = swapchain->num_buffers;
+    while (i > 0 && swapchain->num_buffers > min_buffers)
+    {
+        WlPresentBuffer *buffer = &swapchain->buffers[--i];
+        uint32_t last;
+
+        if (swapchain->status[i] != BUFFER_STATUS_IDLE
+                || buffer->capture_id != 0
+                || buffer == swapchain->current_back
+                || buffer->buffer == swapchain->render_buffer)
+        {
+            continue;
+        }
+
+        freed += buffer->size;
+        DestroyPresentBuffer(inst, swapchain, buffer);
+
+        // Keep the valid buffers packed at the start of the array.
+        last = swapchain->num_buffers - 1;
+        if (i != last)
+        {
+            SwapChainMoveBuffer(swapchain, last, i);
+        }
+        swapchain->num_buffers--;
+    }
+
+    return freed;
+}
+
+uint64_t eplWlSwapChainGetMemoryUsage(const WlSwapChain *swapchain)
+{
+    uint64_t total = swapchain->render_buffer_size;
+    uint32_t i;
+
+    for (i=0; i<swapchain->num_buffers; i++)
+    {
+        total += swapchain->buffers[i].size;
+    }
+    return total;
+}
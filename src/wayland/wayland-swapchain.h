@@ -59,6 +59,31 @@ typedef enum
     BUFFER_STATUS_IDLE_NOTIFIED,
 } WlBufferStatus;
 
+/**
+ * The maximum number of color buffers to allocate for a window.
+ *
+ * In mailbox mode, we can have one buffer on screen, one waiting to be
+ * latched, and one that we're rendering to, so this leaves one spare so that
+ * eglSwapBuffers doesn't have to wait for the compositor to release a buffer.
+ */
+#define WL_MAX_PRESENT_BUFFERS 4
+
+/**
+ * The number of color buffers that we'll keep for an idle window.
+ *
+ * That's enough for one buffer on screen and one to render the next frame
+ * into. If the window becomes active again, then eglWlSwapChainFindFreePresentBuffer
+ * will allocate more buffers as needed.
+ */
+#define WL_MIN_PRESENT_BUFFERS 2
+
+/**
+ * The number of frames of damage history that a swapchain keeps.
+ *
+ * A buffer older than this is treated as needing a full repaint.
+ */
+#define WL_DAMAGE_HISTORY 8
+
 /**
  * A shared color buffer that we can use for presentation.
  *
@@ -72,11 +97,6 @@ typedef struct
      */
     EGLPlatformColorBufferNVX buffer;
 
-    /**
-     * Whether this buffer is still in use by the server.
-     */
-    WlBufferStatus status;
-
     /**
      * The value of the EGL_BUFFER_AGE_KHR attribute when this is the current
      * back buffer.
@@ -110,7 +130,36 @@ typedef struct
      */
     WlTimeline timeline;
 
-    struct glvnd_list entry;
+    /**
+     * The index of this buffer in WlSwapChain::buffers.
+     */
+    uint32_t slot;
+
+    /**
+     * The approximate size of the buffer in bytes, based on its stride.
+     */
+    uint64_t size;
+
+    /**
+     * The layout of the dma-buf, which we hand out to a frame capture
+     * consumer along with the buffer.
+     */
+    uint32_t stride;
+    uint32_t offset;
+
+    /**
+     * The ID of the captured frame if a frame capture consumer is still
+     * reading from this buffer, or zero.
+     *
+     * We can't render to the buffer again until the consumer releases it.
+     */
+    uint64_t capture_id;
+
+    /**
+     * A fence that the frame capture consumer returned with the buffer, or
+     * -1. We have to wait for this before rendering to the buffer again.
+     */
+    int capture_release_fd;
 } WlPresentBuffer;
 
 /**
@@ -124,6 +173,15 @@ typedef struct
     uint32_t width;
     uint32_t height;
 
+    /**
+     * The size that the compositor should display the buffers at.
+     *
+     * This is the same as \c width and \c height unless we're rendering at
+     * a reduced resolution and using wp_viewporter to scale it up.
+     */
+    uint32_t display_width;
+    uint32_t display_height;
+
     uint32_t render_fourcc;
 
     /**
@@ -151,37 +209,104 @@ typedef struct
      */
     EGLBoolean prime;
 
+    /**
+     * True if this is a PRIME swapchain that renders straight into the linear
+     * present buffers, instead of rendering into a separate buffer and
+     * copying each frame.
+     *
+     * In that case, the buffers are rotated the same way as without PRIME,
+     * and \c render_buffer is always the current back buffer.
+     */
+    EGLBoolean prime_direct;
+
     /**
      * The color buffers that we've allocated for this window.
      *
-     * This is a list of WlPresentBuffer structs.
+     * Only the first \c num_buffers elements are valid. Each wl_buffer's
+     * user data points to its slot in this array, so that a
+     * wl_buffer::release event doesn't need to search for it.
      *
      * For PRIME, these will be linear buffers, not renderable buffers.
      */
-    struct glvnd_list present_buffers;
+    WlPresentBuffer buffers[WL_MAX_PRESENT_BUFFERS];
+    uint32_t num_buffers;
+
+    /**
+     * Whether each buffer is still in use by the server.
+     *
+     * This is parallel to \c buffers, and is kept separately so that
+     * searching for a free buffer only has to look at a few bytes.
+     */
+    WlBufferStatus status[WL_MAX_PRESENT_BUFFERS];
+
+    /**
+     * The timeline handle for each buffer, parallel to \c buffers.
+     *
+     * These are copied from each buffer's WlTimeline so that we can pass
+     * them straight to drmSyncobjTimelineWait.
+     */
+    uint32_t timeline_handles[WL_MAX_PRESENT_BUFFERS];
+
+    /**
+     * The order that we received wl_buffer::release events in.
+     *
+     * If we don't have any server -> client synchronization, then we use
+     * this to reuse the oldest buffers first, so we'll have the best chance
+     * that the buffer really is idle.
+     */
+    uint64_t release_seq[WL_MAX_PRESENT_BUFFERS];
+    uint64_t next_release_seq;
 
     /**
      * A pointer to the current back buffer.
      *
-     * This is NULL if we're using PRIME.
+     * This is NULL if we're using PRIME with a copy.
      */
     WlPresentBuffer *current_back;
 
     /**
      * The current buffer that we're rendering to.
      *
-     * For PRIME, this will be a single, fixed buffer.
+     * For PRIME with a copy, this will be a single, fixed buffer.
      *
-     * For non-PRIME, this will be the same buffer as \c current_back.
+     * Otherwise, this will be the same buffer as \c current_back.
      */
     EGLPlatformColorBufferNVX render_buffer;
 
+    /**
+     * The size of \c render_buffer in bytes, if it's separate from the
+     * present buffers (that is, with PRIME and a copy). Otherwise, this is
+     * zero.
+     */
+    uint64_t render_buffer_size;
+
     /**
      * An event queue used internally by the swap chain itself.
      */
     struct wl_event_queue *queue;
 
     uint32_t feedback_update_count;
+
+    /**
+     * If true, then eplWlSwapChainFindFreePresentBuffer picks the idle buffer
+     * that should need the least repainting, based on its buffer age and the
+     * damage of the frames since it was last presented. Otherwise, it picks
+     * the first idle buffer.
+     */
+    EGLBoolean min_repaint;
+
+    /**
+     * The damaged area of the most recent frames, in pixels. The most recent
+     * frame is at index (damage_count - 1) % WL_DAMAGE_HISTORY.
+     */
+    uint64_t damage_history[WL_DAMAGE_HISTORY];
+    uint32_t damage_count;
+
+    /**
+     * The number of pixels that \c min_repaint has saved, compared to picking
+     * the first idle buffer. The caller may read and reset this.
+     */
+    uint64_t repaint_saved;
 } WlSwapChain;
 
 /**
@@ -195,35 +320,120 @@ typedef struct
  * \param present_fourcc The fourcc code that we pass to the server for presenting
  * \param prime True to use PRIME for presentation, or false if we can present
  *      directly.
+ * \param prime_direct For PRIME, true to render directly into the linear
+ *      present buffers instead of copying to them. Ignored for non-PRIME.
  * \param modifiers A list of allowed modifiers for the buffers.
  * \param num_modifiers The number of modifiers in \c modifiers.
  */
 WlSwapChain *eplWlSwapChainCreate(WlDisplayInstance *inst, struct wl_surface *wsurf,
         uint32_t width, uint32_t height, uint32_t render_fourcc, uint32_t present_fourcc,
-        EGLBoolean prime, const uint64_t *modifiers, size_t num_modifiers);
+        EGLBoolean prime, EGLBoolean prime_direct,
+        const uint64_t *modifiers, size_t num_modifiers);
+
+/**
+ * Returns true if the swapchain renders into a separate buffer, and copies
+ * each frame to a present buffer.
+ */
+static inline EGLBoolean eplWlSwapChainNeedsCopy(const WlSwapChain *swapchain)
+{
+    return swapchain->prime && !swapchain->prime_direct;
+}
 
 void eplWlSwapChainDestroy(WlDisplayInstance *inst, WlSwapChain *swapchain);
 
 WlPresentBuffer *eplWlSwapChainCreatePresentBuffer(WlDisplayInstance *inst,
         WlSwapChain *swapchain);
 
+/**
+ * Returns true if eplWlSwapChainFindFreePresentBuffer would allocate a new
+ * buffer instead of waiting, when none of the existing buffers are free.
+ *
+ * That's the case if the swapchain is below WL_MAX_PRESENT_BUFFERS, and
+ * either it's under the memory budget or it has fewer than
+ * WL_MIN_PRESENT_BUFFERS buffers that aren't held by a frame capture
+ * consumer.
+ */
+EGLBoolean eplWlSwapChainCanAllocatePresentBuffer(WlDisplayInstance *inst,
+        const WlSwapChain *swapchain);
+
 /**
  * Returns a free present buffer.
  *
  * If there isn't a free buffer, then this will either allocate a new one, or
- * wait for one to free up.
+ * wait for one to free up. If more than one buffer is free, then
+ * \c swapchain->min_repaint controls which one we pick.
+ *
+ * A buffer that a frame capture consumer is holding doesn't count as free.
  */
 WlPresentBuffer *eplWlSwapChainFindFreePresentBuffer(WlDisplayInstance *inst,
         WlSwapChain *swapchain);
 
 /**
- * Updates the buffer age counters for each buffer.
+ * Returns a new file descriptor for a present buffer's dma-buf, or -1 on
+ * error. The caller is responsible for closing it.
+ */
+int eplWlSwapChainExportPresentBuffer(WlDisplayInstance *inst, WlPresentBuffer *buf);
+
+/**
+ * Hands a captured buffer back from a frame capture consumer.
+ *
+ * \param swapchain The swapchain to look in
+ * \param capture_id The ID of the captured frame
+ * \param release_fd A fence to wait for before rendering to the buffer
+ *      again, or -1. If the buffer is found, then the swapchain takes
+ *      ownership of this fd. Otherwise, the caller still owns it.
+ * \return EGL_TRUE if \p swapchain had the buffer, or EGL_FALSE if not.
+ */
+EGLBoolean eplWlSwapChainReleaseCapture(WlSwapChain *swapchain, uint64_t capture_id,
+        int release_fd);
+
+/**
+ * Gets a swapchain ready to use again after it's been set aside.
+ *
+ * This picks a free back buffer, and resets the buffer age of each buffer,
+ * since the contents are no longer useful.
+ *
+ * \return EGL_TRUE on success, or EGL_FALSE on error.
+ */
+EGLBoolean eplWlSwapChainReuse(WlDisplayInstance *inst, WlSwapChain *swapchain);
+
+/**
+ * Frees idle present buffers, down to a minimum number of buffers.
+ *
+ * This never frees the current back buffer, or any buffer that the server or
+ * a frame capture consumer might still be using. Any remaining buffers are moved down to fill in the
+ * freed slots, so any WlPresentBuffer pointers other than
+ * \c swapchain->current_back are invalid afterward.
+ *
+ * \param inst The WlDisplayInstance for the display
+ * \param swapchain The swapchain to trim
+ * \param min_buffers The number of buffers to keep
+ * \return The number of bytes freed.
+ */
+uint64_t eplWlSwapChainTrim(WlDisplayInstance *inst, WlSwapChain *swapchain,
+        uint32_t min_buffers);
+
+/**
+ * Returns the approximate number of bytes allocated for a swapchain's color
+ * buffers.
+ */
+uint64_t eplWlSwapChainGetMemoryUsage(const WlSwapChain *swapchain);
+
+/**
+ * Updates the buffer age counters for each buffer, and records the damage
+ * for the frame that we just presented.
+ *
+ * This should be called before picking the next back buffer, so that
+ * \c min_repaint can take this frame into account.
  *
  * \param inst The WlDisplayInstance for the display
  * \param swapchain The swapchain to update
  * \param presented_buffer The buffer that we just presented.
+ * \param rects The damage rectangles for the frame, or NULL if the whole
+ *      buffer changed.
+ * \param n_rects The number of rectangles in \c rects.
  */
 void eplWlSwapChainUpdateBufferAge(WlDisplayInstance *inst, WlSwapChain *swapchain,
-        WlPresentBuffer *presented_buffer);
+        WlPresentBuffer *presented_buffer, const EGLint *rects, EGLint n_rects);
 
 #endif // WAYLAND_SWAPCHAIN_H
@@ -21,6 +21,8 @@
 #include <unistd.h>
 #include <assert.h>
 
+#include "wayland-trace.h"
+
 EGLBoolean eplWlTimelineInit(WlDisplayInstance *inst, WlTimeline *timeline)
 {
     int fd = -1;
@@ -44,6 +46,15 @@ EGLBoolean eplWlTimelineInit(WlDisplayInstance *inst, WlTimeline *timeline)
         return EGL_FALSE;
     }
 
+    ret = inst->platform->priv->drm.SyncobjCreate(
+            gbm_device_get_fd(inst->gbmdev),
+            0, &timeline->scratch);
+    if (ret != 0)
+    {
+        timeline->scratch = 0;
+        goto done;
+    }
+
     ret = inst->platform->priv->drm.SyncobjHandleToFD(
             gbm_device_get_fd(inst->gbmdev),
             timeline->handle, &fd);
@@ -69,6 +80,12 @@ done:
     }
     if (!success)
     {
+        if (timeline->scratch != 0)
+        {
+            inst->platform->priv->drm.SyncobjDestroy(
+                    gbm_device_get_fd(inst->gbmdev),
+                    timeline->scratch);
+        }
         inst->platform->priv->drm.SyncobjDestroy(
                 gbm_device_get_fd(inst->gbmdev),
                 timeline->handle);
@@ -90,70 +107,60 @@ void eplWlTimelineDestroy(WlDisplayInstance *inst, WlTimeline *timeline)
         inst->platform->priv->drm.SyncobjDestroy(
                 gbm_device_get_fd(inst->gbmdev),
                 timeline->handle);
+        inst->platform->priv->drm.SyncobjDestroy(
+                gbm_device_get_fd(inst->gbmdev),
+                timeline->scratch);
 
         timeline->wtimeline = NULL;
         timeline->handle = 0;
+        timeline->scratch = 0;
         timeline->point = 0;
     }
 }
 
 int eplWlTimelinePointToSyncFD(WlDisplayInstance *inst, WlTimeline *timeline)
 {
-    uint32_t tempobj = 0;
     int syncfd = -1;
+    WL_TRACE_BEGIN(trace);
 
-    if (inst->platform->priv->drm.SyncobjCreate(
-                gbm_device_get_fd(inst->gbmdev),
-                0, &tempobj) != 0)
-    {
-        return -1;
-    }
-
+    // Transferring into the scratch syncobj replaces whatever fence it had
+    // before, so we can reuse it every time.
     if (inst->platform->priv->drm.SyncobjTransfer(gbm_device_get_fd(inst->gbmdev),
-			      tempobj, 0, timeline->handle, timeline->point, 0) != 0)
+			      timeline->scratch, 0, timeline->handle, timeline->point, 0) != 0)
     {
-        goto done;
+        syncfd = -1;
     }
-
-    if (inst->platform->priv->drm.SyncobjExportSyncFile(gbm_device_get_fd(inst->gbmdev),
-            tempobj, &syncfd) != 0)
+    else if (inst->platform->priv->drm.SyncobjExportSyncFile(gbm_device_get_fd(inst->gbmdev),
+            timeline->scratch, &syncfd) != 0)
     {
-        goto done;
+        syncfd = -1;
     }
 
-done:
-    inst->platform->priv->drm.SyncobjDestroy(
-            gbm_device_get_fd(inst->gbmdev),
-            tempobj);
+    WL_TRACE_END(trace, "eplWlTimelinePointToSyncFD");
     return syncfd;
 }
 
 EGLBoolean eplWlTimelineAttachSyncFD(WlDisplayInstance *inst, WlTimeline *timeline, int syncfd)
 {
-    uint32_t tempobj = 0;
     EGLBoolean success = EGL_FALSE;
+    WL_TRACE_BEGIN(trace);
 
     assert(syncfd >= 0);
 
-    if (inst->platform->priv->drm.SyncobjCreate(
-                gbm_device_get_fd(inst->gbmdev),
-                0, &tempobj) != 0)
-    {
-        // TODO: Issue an EGL error here?
-        return EGL_FALSE;
-    }
-
+    // Importing a sync file replaces the scratch syncobj's fence, so we can
+    // reuse it every time.
     if (inst->platform->priv->drm.SyncobjImportSyncFile(
                 gbm_device_get_fd(inst->gbmdev),
-                tempobj, syncfd) != 0)
+                timeline->scratch, syncfd) != 0)
     {
+        // TODO: Issue an EGL error here?
         goto done;
     }
 
     if (inst->platform->priv->drm.SyncobjTransfer(
                 gbm_device_get_fd(inst->gbmdev),
                 timeline->handle, timeline->point + 1,
-                tempobj, 0, 0) != 0)
+                timeline->scratch, 0, 0) != 0)
     {
         goto done;
     }
@@ -162,8 +169,6 @@ EGLBoolean eplWlTimelineAttachSyncFD(WlDisplayInstance *inst, WlTimeline *timeli
     success = EGL_TRUE;
 
 done:
-    inst->platform->priv->drm.SyncobjDestroy(
-            gbm_device_get_fd(inst->gbmdev),
-            tempobj);
+    WL_TRACE_END(trace, "eplWlTimelineAttachSyncFD");
     return success;
 }
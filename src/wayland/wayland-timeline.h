@@ -34,6 +34,15 @@ typedef struct
     uint32_t handle;
     uint64_t point;
     struct wp_linux_drm_syncobj_timeline_v1 *wtimeline;
+
+    /**
+     * A binary syncobj used for converting between timeline points and sync
+     * FDs.
+     *
+     * We keep this around for the lifetime of the timeline so that we don't
+     * have to create and destroy a temporary syncobj every frame.
+     */
+    uint32_t scratch;
 } WlTimeline;
 
 /**
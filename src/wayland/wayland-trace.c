@@ -0,0 +1,330 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wayland-trace.h"
+
+#ifdef WL_ENABLE_TRACE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+
+/**
+ * The number of events to keep for each thread. This must be a power of two.
+ *
+ * Once a thread's ring fills up, new events overwrite the oldest ones, so the
+ * trace ends up with the most recent events.
+ */
+#define TRACE_RING_SIZE 8192
+
+/**
+ * How often to check for the dump trigger file, in nanoseconds.
+ */
+static const uint64_t TRACE_TRIGGER_INTERVAL = 1000000000; // 1 second
+
+typedef struct
+{
+    const char *name;
+    uint64_t start;
+    uint64_t duration;
+
+    /**
+     * The thread that recorded the event. A ring can be handed to a new
+     * thread, so this is per event instead of per ring.
+     */
+    pid_t tid;
+} WlTraceEvent;
+
+typedef struct _WlTraceRing
+{
+    struct _WlTraceRing *next;
+
+    /**
+     * The next ring in \c free_rings, if the ring's thread has exited.
+     */
+    struct _WlTraceRing *next_free;
+    pid_t tid;
+
+    /**
+     * The total number of events that this thread has recorded.
+     *
+     * Only the owning thread writes to this, and it uses a release store so
+     * that the dump can read the events without a lock.
+     */
+    uint64_t count;
+
+    WlTraceEvent events[TRACE_RING_SIZE];
+} WlTraceRing;
+
+EGLBoolean eplWlTraceEnabled = EGL_FALSE;
+
+static char *trace_path = NULL;
+static char *trigger_path = NULL;
+static __thread WlTraceRing *thread_ring = NULL;
+
+/**
+ * A list of every ring buffer. The mutex is only needed to add or reuse a
+ * ring or to write out the trace, not to record an event.
+ *
+ * Rings are never freed. When a thread exits, its ring goes on
+ * \c free_rings, and the next new thread picks it up. The old thread's
+ * events stay in the ring, so they still show up in the trace until the new
+ * thread overwrites them.
+ */
+static WlTraceRing *all_rings = NULL;
+static WlTraceRing *free_rings = NULL;
+static pthread_mutex_t all_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * A thread-specific key, so that we find out when a thread with a ring exits.
+ */
+static pthread_key_t ring_key;
+static EGLBoolean ring_key_valid = EGL_FALSE;
+
+/**
+ * The next time that eplWlTraceCheckTrigger should look for the trigger file.
+ */
+static uint64_t next_trigger_check = 0;
+
+/**
+ * Serializes writing the trace file, so that a trigger and the unload
+ * destructor don't both write to it at once.
+ */
+static pthread_mutex_t write_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void OnThreadExit(void *param)
+{
+    WlTraceRing *ring = param;
+
+    thread_ring = NULL;
+
+    pthread_mutex_lock(&all_rings_mutex);
+    ring->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&all_rings_mutex);
+}
+
+void eplWlTraceInit(void)
+{
+    const char *env = getenv("__NV_WAYLAND_TRACE");
+
+    if (env != NULL && env[0] != '\0' && trace_path == NULL)
+    {
+        if (pthread_key_create(&ring_key, OnThreadExit) != 0)
+        {
+            return;
+        }
+        ring_key_valid = EGL_TRUE;
+
+        trace_path = strdup(env);
+        eplWlTraceEnabled = (trace_path != NULL);
+
+        env = getenv("__NV_WAYLAND_TRACE_TRIGGER");
+        if (eplWlTraceEnabled && env != NULL && env[0] != '\0')
+        {
+            trigger_path = strdup(env);
+        }
+    }
+}
+
+uint64_t eplWlTraceNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static WlTraceRing *GetThreadRing(void)
+{
+    if (thread_ring == NULL)
+    {
+        WlTraceRing *ring;
+
+        pthread_mutex_lock(&all_rings_mutex);
+        if (!ring_key_valid)
+        {
+            // The library is being unloaded.
+            pthread_mutex_unlock(&all_rings_mutex);
+            return NULL;
+        }
+
+        ring = free_rings;
+        if (ring != NULL)
+        {
+            free_rings = ring->next_free;
+            ring->next_free = NULL;
+        }
+        else
+        {
+            ring = calloc(1, sizeof(WlTraceRing));
+            if (ring == NULL)
+            {
+                pthread_mutex_unlock(&all_rings_mutex);
+                return NULL;
+            }
+            ring->next = all_rings;
+            all_rings = ring;
+        }
+
+        if (pthread_setspecific(ring_key, ring) != 0)
+        {
+            ring->next_free = free_rings;
+            free_rings = ring;
+            pthread_mutex_unlock(&all_rings_mutex);
+            return NULL;
+        }
+        pthread_mutex_unlock(&all_rings_mutex);
+
+        ring->tid = (pid_t) syscall(SYS_gettid);
+        thread_ring = ring;
+    }
+    return thread_ring;
+}
+
+void eplWlTraceRecord(const char *name, uint64_t start)
+{
+    WlTraceRing *ring = GetThreadRing();
+    uint64_t end = eplWlTraceNow();
+    WlTraceEvent *event;
+
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    event = &ring->events[ring->count & (TRACE_RING_SIZE - 1)];
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->tid = ring->tid;
+    __atomic_store_n(&ring->count, ring->count + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes every thread's events to the trace file.
+ *
+ * This doesn't stop other threads from recording events while we're writing,
+ * so if another thread is still busy, then a few of its events might be
+ * overwritten by newer ones.
+ */
+static void WriteTrace(void)
+{
+    WlTraceRing *ring;
+    FILE *out;
+    const char *sep = "";
+    pid_t pid = getpid();
+
+    pthread_mutex_lock(&write_mutex);
+    out = fopen(trace_path, "w");
+    if (out == NULL)
+    {
+        pthread_mutex_unlock(&write_mutex);
+        return;
+    }
+
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    pthread_mutex_lock(&all_rings_mutex);
+    for (ring = all_rings; ring != NULL; ring = ring->next)
+    {
+        uint64_t count = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+        uint64_t i = (count > TRACE_RING_SIZE ? count - TRACE_RING_SIZE : 0);
+
+        for (; i < count; i++)
+        {
+            const WlTraceEvent *event = &ring->events[i & (TRACE_RING_SIZE - 1)];
+
+            // Chrome trace timestamps are in microseconds.
+            fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+                    "\"ts\":%llu.%03u,\"dur\":%llu.%03u}",
+                    sep, event->name, (int) pid, (int) event->tid,
+                    (unsigned long long) (event->start / 1000), (unsigned) (event->start % 1000),
+                    (unsigned long long) (event->duration / 1000), (unsigned) (event->duration % 1000));
+            sep = ",";
+        }
+    }
+    pthread_mutex_unlock(&all_rings_mutex);
+
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    pthread_mutex_unlock(&write_mutex);
+}
+
+void eplWlTraceCheckTrigger(void)
+{
+    uint64_t now;
+    uint64_t next;
+
+    if (trigger_path == NULL)
+    {
+        return;
+    }
+
+    now = eplWlTraceNow();
+    next = __atomic_load_n(&next_trigger_check, __ATOMIC_RELAXED);
+    if (now < next)
+    {
+        return;
+    }
+
+    // If another thread got here first, then let it do the check.
+    if (!__atomic_compare_exchange_n(&next_trigger_check, &next,
+                now + TRACE_TRIGGER_INTERVAL, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    // Removing the file both checks for it and consumes the request, so each
+    // time the file is created, we write exactly one trace.
+    if (unlink(trigger_path) == 0)
+    {
+        WriteTrace();
+    }
+}
+
+/**
+ * Writes out the trace when the library is unloaded, or when the process
+ * exits.
+ *
+ * Note that we don't free the ring buffers here. If the process is exiting,
+ * then other threads could still be running and recording events.
+ *
+ * We do delete the thread-specific key, though, so that a thread exiting
+ * after the library is unloaded won't call into OnThreadExit.
+ */
+__attribute__((destructor)) static void TraceFinish(void)
+{
+    if (eplWlTraceEnabled)
+    {
+        eplWlTraceEnabled = EGL_FALSE;
+        WriteTrace();
+    }
+
+    pthread_mutex_lock(&all_rings_mutex);
+    if (ring_key_valid)
+    {
+        pthread_key_delete(ring_key);
+        ring_key_valid = EGL_FALSE;
+    }
+    pthread_mutex_unlock(&all_rings_mutex);
+}
+
+#endif // WL_ENABLE_TRACE
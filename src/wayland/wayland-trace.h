@@ -0,0 +1,125 @@
+/*
+ * SPDX-FileCopyrightText: Copyright (c) 2025 NVIDIA CORPORATION & AFFILIATES. All rights reserved.
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef WAYLAND_TRACE_H
+#define WAYLAND_TRACE_H
+
+/**
+ * \file
+ *
+ * Lightweight tracing for finding out where eglSwapBuffers spends its time.
+ *
+ * Tracing is turned on by setting __NV_WAYLAND_TRACE to the path of an output
+ * file. Each thread records events into its own ring buffer, and the rings
+ * are written out as Chrome trace-event JSON when the library is unloaded or
+ * the process exits. The result can be loaded in Perfetto or chrome://tracing.
+ *
+ * To get a trace from a process that keeps running, also set
+ * __NV_WAYLAND_TRACE_TRIGGER to a file path. Whenever that file shows up, the
+ * next eglSwapBuffers call deletes it and writes out the trace.
+ *
+ * If the library is built without WL_ENABLE_TRACE, then the trace macros
+ * compile to nothing.
+ *
+ * A trace point looks like this:
+ * \code
+ *     WL_TRACE_BEGIN(trace);
+ *     DoSomething();
+ *     WL_TRACE_END(trace, "DoSomething");
+ * \endcode
+ */
+
+#include <stdint.h>
+
+#include <EGL/egl.h>
+
+#ifdef WL_ENABLE_TRACE
+
+/**
+ * True if tracing is turned on. This is only set in eplWlTraceInit.
+ */
+extern EGLBoolean eplWlTraceEnabled;
+
+/**
+ * Checks the environment and turns on tracing if it's requested.
+ *
+ * This should be called once, when the platform library is loaded.
+ */
+void eplWlTraceInit(void);
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t eplWlTraceNow(void);
+
+/**
+ * Records an event in the current thread's ring buffer.
+ *
+ * \param name The event name. This must be a string literal, since we only
+ *      store the pointer.
+ * \param start The start time, from eplWlTraceNow.
+ */
+void eplWlTraceRecord(const char *name, uint64_t start);
+
+/**
+ * Writes out the trace if the trigger file exists.
+ *
+ * This only looks for the file about once a second, so it's cheap enough to
+ * call on every frame.
+ */
+void eplWlTraceCheckTrigger(void);
+
+static inline uint64_t eplWlTraceBegin(void)
+{
+    return eplWlTraceEnabled ? eplWlTraceNow() : 0;
+}
+
+static inline void eplWlTraceEnd(uint64_t start, const char *name)
+{
+    if (start != 0)
+    {
+        eplWlTraceRecord(name, start);
+    }
+}
+
+static inline void eplWlTraceDumpIfRequested(void)
+{
+    if (eplWlTraceEnabled)
+    {
+        eplWlTraceCheckTrigger();
+    }
+}
+
+#define WL_TRACE_BEGIN(var) uint64_t var = eplWlTraceBegin()
+#define WL_TRACE_END(var, name) eplWlTraceEnd(var, name)
+
+#else // WL_ENABLE_TRACE
+
+static inline void eplWlTraceInit(void)
+{
+}
+
+static inline void eplWlTraceDumpIfRequested(void)
+{
+}
+
+#define WL_TRACE_BEGIN(var) do { } while (0)
+#define WL_TRACE_END(var, name) do { } while (0)
+
+#endif // WL_ENABLE_TRACE
+
+#endif // WAYLAND_TRACE_H